@@ -0,0 +1,227 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// libfossa_agent.so: fossa's run, without ptrace.
+//
+// Preloaded into the child by fossa --agent, it interposes glibc's
+// __libc_start_main() so that main() is handed to agent_main() instead.
+// That does from the inside what the tracer does by injection: find
+// the libcuzmem.so instruments, check for a plan, set the project,
+// plan and tuner and call cuzmem_start() before main() and
+// cuzmem_end() after it.  Nothing stops the child and there is nothing
+// for a seccomp filter or Yama's ptrace_scope to get in the way of.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "agent.h"
+
+typedef int (*main_fn) (int, char**, char**);
+
+typedef int (*libc_start_main_fn) (main_fn main, int argc, char **argv,
+                                   void (*init) (void), void (*fini) (void),
+                                   void (*rtld_fini) (void), void *stack_end);
+
+// the libcuzmem.so instruments, as the injections call them
+struct agent_toolbox {
+    void (*start) (int mode, int zero);
+    int  (*end) (void);
+    void (*set_project) (char *project);
+    void (*set_plan) (char *plan);
+    void (*set_tuner) (int tuner);
+    int  (*check_plan) (char *project, char *plan);
+};
+
+static main_fn agent_real_main;
+
+
+// Take our settings out of the environment, and ourselves out of
+// LD_PRELOAD, so that programs the child runs aren't wrapped too
+static void
+agent_scrub_env (void)
+{
+    char *preload = getenv ("LD_PRELOAD");
+    char *copy, *lib, *save, *out;
+    size_t n;
+
+    unsetenv (AGENT_ENV_PROJECT);
+    unsetenv (AGENT_ENV_PLAN);
+    unsetenv (AGENT_ENV_MODE);
+    unsetenv (AGENT_ENV_TUNER);
+
+    if (!preload) {
+        return;
+    }
+
+    copy = strdup (preload);
+    out = calloc (strlen (preload) + 1, 1);
+    if (!copy || !out) {
+        free (copy);
+        free (out);
+        return;
+    }
+
+    for (lib = strtok_r (copy, ": ", &save); lib;
+         lib = strtok_r (NULL, ": ", &save)) {
+        n = strlen (lib);
+        if ((n >= strlen (AGENT_LIB)) &&
+            !strcmp (lib + n - strlen (AGENT_LIB), AGENT_LIB)) {
+            continue;
+        }
+        if (*out) {
+            strcat (out, ":");
+        }
+        strcat (out, lib);
+    }
+
+    if (*out) {
+        setenv ("LD_PRELOAD", out, 1);
+    } else {
+        unsetenv ("LD_PRELOAD");
+    }
+
+    free (copy);
+    free (out);
+}
+
+
+static int
+agent_toolbox (struct agent_toolbox *tbox)
+{
+    tbox->start       = dlsym (RTLD_DEFAULT, "cuzmem_start");
+    tbox->end         = dlsym (RTLD_DEFAULT, "cuzmem_end");
+    tbox->set_project = dlsym (RTLD_DEFAULT, "cuzmem_set_project");
+    tbox->set_plan    = dlsym (RTLD_DEFAULT, "cuzmem_set_plan");
+    tbox->set_tuner   = dlsym (RTLD_DEFAULT, "cuzmem_set_tuner");
+    tbox->check_plan  = dlsym (RTLD_DEFAULT, "cuzmem_check_plan");
+
+    if ( (!tbox->start)       ||
+         (!tbox->end)         ||
+         (!tbox->set_project) ||
+         (!tbox->set_plan)    ||
+         (!tbox->set_tuner)   ||
+         (!tbox->check_plan) )
+    {
+        fprintf (stderr, "fossa: Searching child's symbol table for instruments... FAILED!\n\n");
+        fprintf (stderr, "  Please make sure libcuzmem.so (included with fossa) is in your\n"
+                         "  library path and is locatable by ld.so\n\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// main(), as seen by __libc_start_main()
+static int
+agent_main (int argc, char **argv, char **envp)
+{
+    struct agent_toolbox tbox;
+    char *project = getenv (AGENT_ENV_PROJECT);
+    char *plan    = getenv (AGENT_ENV_PLAN);
+    char *mode_s  = getenv (AGENT_ENV_MODE);
+    char *tuner_s = getenv (AGENT_ENV_TUNER);
+    int mode, tuner, planless, iter, ret = 0;
+
+    // not started by fossa (a program run by the child, say)
+    if (!project || !plan || !mode_s || !tuner_s) {
+        return agent_real_main (argc, argv, envp);
+    }
+    project = strdup (project);
+    plan = strdup (plan);
+    mode = atoi (mode_s);
+    tuner = atoi (tuner_s);
+    agent_scrub_env ();
+
+    if (agent_toolbox (&tbox) < 0) {
+        exit (1);
+    }
+
+    // no plan and run mode?  tune with the "no tune" tuner instead, as
+    // set_mode() does for a traced child.  Otherwise the mode stands
+    planless = tbox.check_plan (project, plan);
+    if (planless && (mode == 0)) {
+        fprintf (stdout,
+            "---------------------------------------------------------------------------\n"
+            "  fossa does not have an optimized memory configuration for `%s'\n"
+            "  Performance may be poor.  Run fossa in tune mode (--tune) to optimize \n"
+            "---------------------------------------------------------------------------\n\n",
+            project + strlen ("fossa/")
+        );
+        fflush (stdout);
+        sleep (1);
+        tuner = 0;
+        mode = 1;
+    }
+
+    tbox.set_project (project);
+    tbox.set_plan (plan);
+    tbox.set_tuner (tuner);
+
+    // a planned run makes one pass: cuzmem_end() goes on the exit
+    // path, so it is called however the program leaves
+    if (mode == 0) {
+        tbox.start (mode, 0);
+        atexit ((void (*) (void))tbox.end);
+        return agent_real_main (argc, argv, envp);
+    }
+
+    // tuning: main() again until the tuner is done with it
+    for (iter=0; ; iter++) {
+        if (tuner != 0) {
+            fprintf (stdout, "fossa: Tuning Iteration: %03i\n", iter);
+            fprintf (stdout, "----------------------------\n");
+            fflush (stdout);
+        }
+
+        tbox.start (mode, 0);
+        ret = agent_real_main (argc, argv, envp);
+        if (!tbox.end ()) {
+            break;
+        }
+    }
+
+    if (tuner != 0) {
+        fprintf (stdout, "fossa: Tuning Complete\n");
+        fflush (stdout);
+    }
+
+    return ret;
+}
+
+
+// The executable's _start calls this, and finds ours ahead of glibc's
+int
+__libc_start_main (main_fn main, int argc, char **argv,
+                   void (*init) (void), void (*fini) (void),
+                   void (*rtld_fini) (void), void *stack_end)
+{
+    libc_start_main_fn real = dlsym (RTLD_NEXT, "__libc_start_main");
+
+    if (!real) {
+        fprintf (stderr, "fossa: agent cannot find __libc_start_main()\n");
+        exit (1);
+    }
+
+    agent_real_main = main;
+
+    return real (agent_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
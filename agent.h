@@ -0,0 +1,32 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _agent_h_
+#define _agent_h_
+
+// fossa --agent runs the child with libfossa_agent.so preloaded, in
+// place of tracing it.  The agent wraps main() in the same check_plan
+// -> set_* -> start -> main() -> end sequence the tracer injects, set
+// up by fossa through these environment variables:
+#define AGENT_ENV_PROJECT   "FOSSA_AGENT_PROJECT"   /* fossa/<program> */
+#define AGENT_ENV_PLAN      "FOSSA_AGENT_PLAN"      /* plan hash       */
+#define AGENT_ENV_MODE      "FOSSA_AGENT_MODE"      /* 0: run, 1: tune */
+#define AGENT_ENV_TUNER     "FOSSA_AGENT_TUNER"
+
+#define AGENT_LIB           "libfossa_agent.so"
+
+#endif /* #ifndef _agent_h_ */
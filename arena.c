@@ -0,0 +1,129 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN     16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    unsigned char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+
+static struct arena_block*
+arena_new_block (size_t size)
+{
+    struct arena_block *b = malloc (sizeof (struct arena_block) + size);
+
+    if (!b) {
+        fprintf (stderr, "fossa: out of memory\n");
+        exit (1);
+    }
+
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+
+    return b;
+}
+
+
+struct arena*
+arena_create (size_t block_size)
+{
+    struct arena *a = malloc (sizeof (struct arena));
+
+    if (!a) {
+        fprintf (stderr, "fossa: out of memory\n");
+        exit (1);
+    }
+
+    a->block_size = block_size;
+    a->head = a->cur = arena_new_block (block_size);
+
+    return a;
+}
+
+
+// Blocks that come after cur are left over from before the last reset
+// and are taken back into use (emptied) before any new one is made
+void*
+arena_alloc (struct arena *a, size_t size)
+{
+    void *p;
+    struct arena_block *b;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    while (a->cur->used + size > a->cur->size) {
+        b = a->cur->next;
+        if (!b || (b->size < size)) {
+            b = arena_new_block ((size > a->block_size) ? size : a->block_size);
+            b->next = a->cur->next;
+            a->cur->next = b;
+        }
+        b->used = 0;
+        a->cur = b;
+    }
+
+    p = a->cur->data + a->cur->used;
+    a->cur->used += size;
+
+    return p;
+}
+
+
+char*
+arena_strdup (struct arena *a, const char *str)
+{
+    size_t len = strlen (str) + 1;
+
+    return memcpy (arena_alloc (a, len), str, len);
+}
+
+
+// Drop everything that was allocated, but hold on to the memory
+void
+arena_reset (struct arena *a)
+{
+    a->cur = a->head;
+    a->cur->used = 0;
+}
+
+
+void
+arena_destroy (struct arena *a)
+{
+    struct arena_block *b, *next;
+
+    if (!a) {
+        return;
+    }
+
+    for (b=a->head; b; b=next) {
+        next = b->next;
+        free (b);
+    }
+    free (a);
+}
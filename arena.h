@@ -0,0 +1,50 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _arena_h_
+#define _arena_h_
+
+#include <stddef.h>
+
+struct arena_block;
+
+// A bump allocator.  Everything taken from an arena is given back at
+// once, either by arena_reset() (which keeps the blocks for reuse, so
+// an arena that has warmed up no longer calls malloc) or by
+// arena_destroy().
+struct arena {
+    struct arena_block *head;
+    struct arena_block *cur;
+    size_t block_size;
+};
+
+struct arena*
+arena_create (size_t block_size);
+
+void*
+arena_alloc (struct arena *a, size_t size);
+
+char*
+arena_strdup (struct arena *a, const char *str);
+
+void
+arena_reset (struct arena *a);
+
+void
+arena_destroy (struct arena *a);
+
+#endif /* #ifndef _arena_h_ */
@@ -0,0 +1,596 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fossa --batch: run a manifest of jobs (a parameter sweep, a nightly
+// suite) from one fossa, up to --batch-jobs of them at once, rather
+// than one fossa per job.  Each line of the manifest is a job, in the
+// words fossa itself would take:
+//
+//     # comment
+//     [options] cuda_program [cuda_program options]
+//
+// split at whitespace, as a shell would: '...' and "..." quote, and a
+// backslash takes the next character as it is (other than in '...').
+// There is nothing else to it: no variables, no globbing.  Options
+// given to fossa along with --batch are every job's defaults.
+//
+// What a job finds out about its program and its libraries is kept
+// for the next job: main()'s (or the --roi function's) address, by
+// program, and the symbols looked up in a child, as offsets into the
+// library they are in.  The jobs' programs print to fossa's stderr;
+// what fossa has to say about each is held back for the report,
+// printed on stdout once all are done.
+//
+// With --zygote, the jobs are fork()s of a child of their program kept
+// at main() (zygote.c), one for each program (and each way of fencing
+// it in), rather than launches of their own.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "ptrace_wrap.h"
+#include "elf_tools.h"
+#include "child_tools.h"
+#include "session.h"
+#include "zygote.h"
+#include "batch.h"
+
+#define BATCH_MAX_WORDS     256     /* words on a manifest line        */
+#define BATCH_MAX_FUNCS     64      /* programs main() is remembered for */
+
+struct batch_job {
+    int line;               /* in the manifest                      */
+    char *text;             /* the line, for the report             */
+    char *words;            /* the line, split into ...             */
+    char **argv;            /* ... these, after fossa's own options */
+    struct fossa_options opt;
+    Elf_Addr main_start;
+    struct session *sess;   /* while it runs                        */
+    FILE *out;              /* what fossa says about it             */
+    char *msgs;
+    size_t nmsgs;
+    double t0, t;           /* when it started, how long it took    */
+    int status;
+};
+
+// main() of a program some job has run
+struct batch_func {
+    char *path;
+    char *func;
+    Elf_Addr addr;
+};
+
+static struct batch_func funcs[BATCH_MAX_FUNCS];
+static int nfuncs;
+
+// --zygote: the programs' zygotes
+static struct zygote *zygotes[BATCH_MAX_FUNCS];
+static int nzygotes;
+
+
+static double
+batch_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Where the job's main() is, from an earlier job with the same program
+// if there was one.  0 if it has none.
+static Elf_Addr
+batch_func (struct fossa_options *opt)
+{
+    char *func = opt->roi ? opt->roi : "main";
+    Elf_Addr addr = 0;
+    int i;
+
+    for (i=0; i<nfuncs; i++) {
+        if (!strcmp (funcs[i].path, opt->child_argv[0]) &&
+            !strcmp (funcs[i].func, func)) {
+            return funcs[i].addr;
+        }
+    }
+
+    elf_get_func (opt->child_argv[0], func, &addr, NULL);
+    if (addr && (nfuncs < BATCH_MAX_FUNCS)) {
+        funcs[nfuncs].path = opt->child_argv[0];
+        funcs[nfuncs].func = func;
+        funcs[nfuncs].addr = addr;
+        nfuncs++;
+    }
+
+    return addr;
+}
+
+
+// Split a manifest line into words, in place.  Returns how many
+// (0 for a blank line or a comment), -1 if there are too many or -2
+// if a quote is left open
+static int
+batch_split (char *p, char **words)
+{
+    char *q, quote;
+    int n = 0;
+
+    while (1) {
+        while (isspace ((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p || (*p == '#' && !n)) {
+            break;
+        }
+        if (n == BATCH_MAX_WORDS) {
+            return -1;
+        }
+
+        // the word is copied down over its quotes and backslashes
+        words[n++] = q = p;
+        quote = 0;
+        while (*p && (quote || !isspace ((unsigned char)*p))) {
+            if (quote ? (*p == quote) : ((*p == '\'') || (*p == '"'))) {
+                quote = quote ? 0 : *p;
+                p++;
+            } else if ((*p == '\\') && (quote != '\'') && p[1]) {
+                p++;
+                *q++ = *p++;
+            } else {
+                *q++ = *p++;
+            }
+        }
+        if (quote) {
+            return -2;
+        }
+        if (*p) {
+            p++;
+        }
+        *q = '\0';
+    }
+
+    return n;
+}
+
+
+// Whether the job's program is an ELF file we can read.  NULL if it
+// is, or why not.
+static const char*
+batch_probe (char *path)
+{
+    unsigned char magic[SELFMAG];
+    ssize_t n;
+    int fd;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        return strerror (errno);
+    }
+    n = read (fd, magic, SELFMAG);
+    close (fd);
+
+    if ((n != SELFMAG) || memcmp (magic, ELFMAG, SELFMAG)) {
+        return "Not an ELF file";
+    }
+
+    return NULL;
+}
+
+
+// Whether parse_cmdline() takes to a job's options, tried out in a
+// fork() as it exit()s over any it doesn't.  Its usage message is no
+// help with a manifest, so that goes nowhere.
+static int
+batch_check (int argc, char **argv)
+{
+    struct fossa_options opt;
+    pid_t pid;
+    int status, fd;
+
+    fflush (stdout);
+    fflush (stderr);
+    pid = fork ();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        fd = open ("/dev/null", O_WRONLY);
+        dup2 (fd, 1);
+        init_options (&opt);
+        parse_cmdline (&opt, argc, argv);
+        _exit (0);
+    }
+
+    if ((waitpid (pid, &status, 0) != pid) || !WIFEXITED (status) ||
+        WEXITSTATUS (status)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Read the manifest into jobs, each with its options parsed as if
+// they followed fossa's own (minus --batch, --batch-jobs, --zygote and
+// --stats) and its program looked at.  Returns how many, or -1 if the
+// manifest is no good: nothing has been run by then.
+static int
+batch_read (char *manifest, int argc, char **argv, struct batch_job **jobs)
+{
+    FILE *fp;
+    char buf[4096], *words[BATCH_MAX_WORDS], **jargv;
+    const char *why;
+    struct batch_job *job;
+    int i, n, nargs, njobs = 0, max = 0, line = 0;
+
+    fp = fopen (manifest, "r");
+    if (!fp) {
+        fprintf (stderr, "fossa: cannot open `%s': %s\n", manifest,
+                 strerror (errno));
+        return -1;
+    }
+
+    *jobs = NULL;
+    while (fgets (buf, sizeof (buf), fp)) {
+        line++;
+        if (!strchr (buf, '\n') && !feof (fp)) {
+            fprintf (stderr, "fossa: %s:%i: line too long\n", manifest, line);
+            fclose (fp);
+            return -1;
+        }
+
+        if (njobs == max) {
+            max = max ? 2 * max : 64;
+            *jobs = realloc (*jobs, max * sizeof (struct batch_job));
+        }
+        job = &(*jobs)[njobs];
+        memset (job, 0, sizeof (struct batch_job));
+        job->line = line;
+        job->text = strdup (buf);
+        job->text[strcspn (job->text, "\n")] = '\0';
+        job->words = strdup (buf);
+
+        n = batch_split (job->words, words);
+        if (n < 0) {
+            fprintf (stderr, "fossa: %s:%i: %s\n", manifest, line,
+                     (n == -1) ? "too many words" : "unterminated quote");
+            fclose (fp);
+            return -1;
+        }
+        if (n == 0) {
+            free (job->text);
+            free (job->words);
+            continue;
+        }
+
+        // fossa's own options first: the line's have the last word
+        jargv = malloc ((argc + n + 1) * sizeof (char*));
+        jargv[0] = argv[0];
+        nargs = 1;
+        for (i=1; i<argc; i++) {
+            if (!strcmp (argv[i], "--batch") || !strcmp (argv[i], "--batch-jobs") ||
+                !strcmp (argv[i], "--stats")) {
+                i++;
+                continue;
+            }
+            if (!strcmp (argv[i], "--zygote")) {
+                continue;
+            }
+            jargv[nargs++] = argv[i];
+        }
+        for (i=0; i<n; i++) {
+            jargv[nargs++] = words[i];
+        }
+        jargv[nargs] = NULL;
+        job->argv = jargv;
+
+        if (batch_check (nargs, jargv)) {
+            fprintf (stderr, "fossa: %s:%i: not a job: %s\n", manifest, line,
+                     job->text);
+            fclose (fp);
+            return -1;
+        }
+        init_options (&job->opt);
+        parse_cmdline (&job->opt, nargs, jargv);
+        if (job->opt.daemon_sock || job->opt.submit_sock || job->opt.bench ||
+            job->opt.batch || job->opt.agent) {
+            fprintf (stderr, "fossa: %s:%i: --daemon, --submit, --bench, "
+                             "--batch and --agent aren't for batch jobs\n",
+                     manifest, line);
+            fclose (fp);
+            return -1;
+        }
+        why = batch_probe (job->opt.child_argv[0]);
+        if (why) {
+            fprintf (stderr, "fossa: %s:%i: cannot run `%s': %s\n", manifest,
+                     line, job->opt.child_argv[0], why);
+            fclose (fp);
+            return -1;
+        }
+        job->main_start = batch_func (&job->opt);
+        njobs++;
+    }
+
+    fclose (fp);
+    return njobs;
+}
+
+
+// --zygote: have the job's child forked off its program's zygote,
+// which is launched if there is none yet.  NULL if it can't be.
+static struct session*
+batch_fork (struct batch_job *job, struct sym_cache *syms, char **envp)
+{
+    struct zygote *z = NULL;
+    pid_t pid;
+    int i;
+
+    for (i=0; i<nzygotes; i++) {
+        if (zygote_fits (zygotes[i], &job->opt)) {
+            z = zygotes[i];
+            break;
+        }
+    }
+
+    if (!z) {
+        // one that was lost makes way for its successor
+        for (i=0; (i < nzygotes) && zygotes[i]->pid; i++);
+        if (i == BATCH_MAX_FUNCS) {
+            return NULL;
+        }
+        z = zygote_create (&job->opt, envp, job->main_start, syms, job->out);
+        if (!z) {
+            return NULL;
+        }
+        if (i < nzygotes) {
+            zygote_destroy (zygotes[i]);
+        } else {
+            nzygotes++;
+        }
+        zygotes[i] = z;
+    }
+
+    pid = zygote_fork (z, job->opt.child_argv, job->out);
+    if (pid < 0) {
+        return NULL;
+    }
+
+    return session_adopt (&job->opt, pid, z->main_start, z->tbox, job->out);
+}
+
+
+// Launch the job's child.  It prints to our stderr, keeping stdout for
+// the report; its SIGCHLD must not be blocked, as ours is.  With
+// --zygote, a job that can't be forked is launched all the same;
+// --roi's function is called from well into the program, with the
+// arguments main() was called with used up, so its jobs always are
+static void
+batch_start (struct batch_job *job, struct sym_cache *syms, char **envp,
+             int zygote)
+{
+    sigset_t chld;
+    int out;
+
+    job->out = open_memstream (&job->msgs, &job->nmsgs);
+    setvbuf (job->out, NULL, _IOLBF, 0);
+    job->t0 = batch_now ();
+
+    if (!job->main_start) {
+        fprintf (job->out, "fossa: cannot find %s() in `%s'\n",
+                 job->opt.roi ? job->opt.roi : "main", job->opt.child_prg);
+        return;
+    }
+
+    sigemptyset (&chld);
+    sigaddset (&chld, SIGCHLD);
+    sigprocmask (SIG_UNBLOCK, &chld, NULL);
+    out = dup (1);
+    dup2 (2, 1);
+
+    if (zygote && !job->opt.roi) {
+        job->sess = batch_fork (job, syms, envp);
+    }
+    if (!job->sess) {
+        job->sess = session_spawn (&job->opt, envp, job->main_start,
+                                   job->out);
+    }
+
+    dup2 (out, 1);
+    close (out);
+    sigprocmask (SIG_BLOCK, &chld, NULL);
+
+    if (job->sess) {
+        job->sess->syms = syms;
+        job->sess->shared = 1;
+    }
+}
+
+
+// The job is over, one way or another
+static void
+batch_finish (struct batch_job *job, int done, int njobs)
+{
+    job->t = batch_now () - job->t0;
+    job->status = job->sess ? job->sess->status : 1;
+    if (job->sess) {
+        session_destroy (job->sess);
+        job->sess = NULL;
+    }
+    fclose (job->out);
+    job->out = NULL;
+
+    fprintf (stderr, "fossa: [%i/%i] line %i done, status %i, %.3f s\n",
+             done, njobs, job->line, job->status, job->t);
+}
+
+
+// All the jobs are done: say how each went, and what fossa had to say
+static int
+batch_report (char *manifest, struct batch_job *jobs, int njobs, double t)
+{
+    char *p, *nl;
+    int i, failed = 0;
+
+    for (i=0; i<njobs; i++) {
+        printf ("== %s:%i: %s\n", manifest, jobs[i].line, jobs[i].text);
+        printf ("   status %i, %.3f s\n", jobs[i].status, jobs[i].t);
+        for (p=jobs[i].msgs; p && *p; p=nl) {
+            nl = strchr (p, '\n');
+            nl = nl ? nl + 1 : p + strlen (p);
+            printf ("   %.*s", (int)(nl - p), p);
+        }
+        if (jobs[i].nmsgs && (jobs[i].msgs[jobs[i].nmsgs - 1] != '\n')) {
+            printf ("\n");
+        }
+        failed += (jobs[i].status != 0);
+    }
+
+    printf ("fossa: batch `%s': %i jobs, %i failed, %.3f s\n", manifest,
+            njobs, failed, t);
+
+    return failed ? 1 : 0;
+}
+
+
+// fossa --batch: returns 0 if every job's program exited 0, 1 otherwise
+int
+fossa_batch (struct fossa_options *opt, int argc, char **argv, char **envp)
+{
+    struct batch_job *jobs, *job;
+    struct sym_cache *syms;
+    struct pt_event ev;
+    struct timespec ts;
+    sigset_t chld;
+    double t0 = batch_now ();
+    int i, t, timeout, ret;
+    int njobs, next = 0, running = 0, done = 0;
+    int max = opt->batch_jobs;
+
+    njobs = batch_read (opt->batch, argc, argv, &jobs);
+    if (njobs < 0) {
+        return 1;
+    }
+    if (max <= 0) {
+        max = sysconf (_SC_NPROCESSORS_ONLN);
+        max = (max > 0) ? max : 1;
+    }
+    syms = calloc (1, sizeof (struct sym_cache));
+
+    // the children's stops come in as SIGCHLDs, waited for with a
+    // timeout while any pass is being raced
+    sigemptyset (&chld);
+    sigaddset (&chld, SIGCHLD);
+    sigprocmask (SIG_BLOCK, &chld, NULL);
+
+    while (done < njobs) {
+        // keep max of them going
+        while ((running < max) && (next < njobs)) {
+            job = &jobs[next++];
+            batch_start (job, syms, envp, opt->zygote);
+            if (!job->sess) {
+                batch_finish (job, ++done, njobs);
+                continue;
+            }
+            running++;
+        }
+
+        timeout = -1;
+        for (i=0; i<njobs; i++) {
+            job = &jobs[i];
+            if (!job->sess) {
+                continue;
+            }
+            t = session_timeout (job->sess);
+            if (job->sess->state == SESSION_DONE) {
+                batch_finish (job, ++done, njobs);
+                running--;
+                continue;
+            }
+            if ((t >= 0) && ((timeout < 0) || (t < timeout))) {
+                timeout = t;
+            }
+        }
+        if (!running) {
+            continue;
+        }
+
+        if (!pt_poll (&ev)) {
+            if (timeout >= 0) {
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000000;
+                sigtimedwait (&chld, NULL, &ts);
+            } else {
+                sigwaitinfo (&chld, NULL);
+            }
+            continue;
+        }
+
+        for (i=0; i<njobs; i++) {
+            job = &jobs[i];
+            if (job->sess && session_owns (job->sess, ev.pid)) {
+                break;
+            }
+        }
+        if (i == njobs) {
+            // a zygote only ever goes away: it is never let run
+            for (i=0; i<nzygotes; i++) {
+                if (zygotes[i]->pid == ev.pid) {
+                    zygotes[i]->pid = 0;
+                }
+            }
+            pt_forget (ev.pid);
+            continue;
+        }
+
+        session_event (job->sess, &ev);
+        if (job->sess->state == SESSION_DONE) {
+            batch_finish (job, ++done, njobs);
+            running--;
+        }
+    }
+
+    for (i=0; i<nzygotes; i++) {
+        zygote_destroy (zygotes[i]);
+    }
+    nzygotes = 0;
+
+    ret = batch_report (opt->batch, jobs, njobs, batch_now () - t0);
+
+    // the programs' paths were the jobs' words
+    nfuncs = 0;
+    for (i=0; i<njobs; i++) {
+        free (jobs[i].text);
+        free (jobs[i].words);
+        free (jobs[i].argv);
+        free (jobs[i].msgs);
+    }
+    free (jobs);
+    free (syms);
+
+    return ret;
+}
@@ -0,0 +1,283 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fossa --bench n: time the tracer against a simulated tracee (sim.c)
+// instead of a real child, so the numbers only measure fossa itself.
+//
+// Each benchmark is run n times and reports the average wall time of a
+// run, along with how much the tracer asked of the tracee per run:
+// memory transfers, register accesses, resumes and the instructions
+// the tracee executed.  Those counts are deterministic, so they can be
+// compared across changes exactly, without any timing noise.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ptrace.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "ptrace_wrap.h"
+#include "child_tools.h"
+#include "arena.h"
+#include "inject.h"
+#include "session.h"
+#include "sim.h"
+#include "bench.h"
+
+#if _arch_x86_64_
+
+// the simulated program: a large link_map with libcuzmem.so at the
+// far end of it, and a main() with plenty of calls to step over
+static struct sim_config bench_cfg = {
+    32,         /* nlibs      */
+    1024,       /* nsyms      */
+    256,        /* ncalls     */
+    3,          /* tune_iters */
+    0           /* planless   */
+};
+
+
+static double
+bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static pid_t
+bench_tracee (Elf_Addr *main_start)
+{
+    pid_t pid = sim_create (&bench_cfg, main_start);
+
+    pt_trace_threads (pid);
+
+    return pid;
+}
+
+
+static void
+bench_report (const char *name, int iters, double secs)
+{
+    struct sim_stats st;
+
+    sim_get_stats (&st);
+
+    printf ("%-8s %10.1f us/run  reads %lu (%lu B)  writes %lu (%lu B)  "
+            "regs %lu/%lu  dr %lu  resumes %lu  insns %lu\n",
+            name, secs * 1e6 / iters,
+            st.reads / iters, st.read_bytes / iters,
+            st.writes / iters, st.write_bytes / iters,
+            st.get_regs / iters, st.set_regs / iters,
+            st.set_dr / iters, st.resumes / iters, st.insns / iters);
+}
+
+
+// Before anything is timed: does child_dlsym() find each function
+// fossa looks up, and not another whose name starts the same?
+static int
+bench_check_dlsym (void)
+{
+    static const char *lookups[][2] = {
+        { "cuzmem_start"       , "libcuzmem.so" },
+        { "cuzmem_end"         , "libcuzmem.so" },
+        { "cuzmem_set_project" , "libcuzmem.so" },
+        { "cuzmem_set_plan"    , "libcuzmem.so" },
+        { "cuzmem_set_tuner"   , "libcuzmem.so" },
+        { "cuzmem_check_plan"  , "libcuzmem.so" },
+        { "__cxa_atexit"       , "libc.so" },
+        { "__fork"             , "libc.so" },
+        { "__waitpid"          , "libc.so" },
+        { "_IO_fflush"         , "libc.so" },
+        { "malloc"             , "libc.so" },
+    };
+    Elf_Addr main_start, addr;
+    pid_t pid = bench_tracee (&main_start);
+    int i, ret = 0;
+
+    for (i=0; i<sizeof (lookups) / sizeof (lookups[0]); i++) {
+        addr = child_dlsym (pid, (char *)lookups[i][0], (char *)lookups[i][1]);
+        if (addr != sim_func_addr (lookups[i][0])) {
+            fprintf (stderr, "fossa: bench: %s() found at 0x%lx, not 0x%lx\n",
+                     lookups[i][0], (unsigned long)addr,
+                     (unsigned long)sim_func_addr (lookups[i][0]));
+            ret = -1;
+        }
+    }
+
+    pt_forget (pid);
+
+    return ret;
+}
+
+
+// child_dlsym(): walking the link_map and searching libcuzmem.so
+static void
+bench_dlsym (int iters)
+{
+    int i;
+    double t;
+    Elf_Addr main_start;
+    pid_t pid = bench_tracee (&main_start);
+
+    sim_reset_stats ();
+    t = bench_now ();
+    for (i=0; i<iters; i++) {
+        if (!child_dlsym (pid, "cuzmem_end", "libcuzmem.so")) {
+            fprintf (stderr, "fossa: bench: cuzmem_end not found\n");
+            exit (1);
+        }
+    }
+    t = bench_now () - t;
+
+    bench_report ("dlsym", iters, t);
+    pt_forget (pid);
+}
+
+
+// One injection: plant it, run it to its int3 and put things back
+static void
+bench_inject (int iters)
+{
+    int i;
+    double t;
+    Elf_Addr main_start, end;
+    struct arena *arena = arena_create (256);
+    struct code_injection *inj;
+    struct inject_ctx ctx;
+    struct pt_event ev;
+    pid_t pid = bench_tracee (&main_start);
+
+    end = child_dlsym (pid, "cuzmem_end", "libcuzmem.so");
+    inj = inject_build_end (arena, end);
+    ctx.arena = arena_create (256);
+    ctx.fp = 0;
+
+    sim_reset_stats ();
+    t = bench_now ();
+    for (i=0; i<iters; i++) {
+        arena_reset (ctx.arena);
+        inject_begin (pid, main_start + 1, inj, &ctx);
+        pt_resume (pid, PTRACE_CONT, 0);
+        if ((pt_wait (pid, &ev) < 0) || (ev.type != PT_EVENT_STOP)) {
+            fprintf (stderr, "fossa: bench: injection did not trap\n");
+            exit (1);
+        }
+        inject_finish (pid, main_start + 1, inj, &ctx);
+    }
+    t = bench_now () - t;
+
+    bench_report ("inject", iters, t);
+    arena_destroy (ctx.arena);
+    arena_destroy (arena);
+    pt_forget (pid);
+}
+
+
+// A whole tuning session, from the stop before main() to the exit
+static void
+bench_session (int iters, FILE *out)
+{
+    int i;
+    double t, total = 0;
+    Elf_Addr main_start;
+    pid_t pid;
+    struct fossa_options opt;
+    struct session *s;
+    struct pt_event ev;
+
+    memset (&opt, 0, sizeof (opt));
+    opt.mode = 1;
+    opt.tuner = 1;
+    opt.child_prg = "sim";
+
+    sim_reset_stats ();
+    for (i=0; i<iters; i++) {
+        pid = bench_tracee (&main_start);
+
+        t = bench_now ();
+        s = session_launch (&opt, pid, main_start, out);
+        while (!session_finished (s)) {
+            if (pt_wait (s->pid, &ev) < 0) {
+                fprintf (stderr, "fossa: bench: lost the tracee\n");
+                exit (1);
+            }
+            session_event (s, &ev);
+        }
+        total += bench_now () - t;
+
+        // a detached tracee still has its exit to report
+        if (s->state == SESSION_DETACHED) {
+            pt_wait (pid, &ev);
+            pt_forget (pid);
+        }
+        if (ev.type != PT_EVENT_EXIT || ev.status != 0) {
+            fprintf (stderr, "fossa: bench: tracee did not exit cleanly\n");
+            exit (1);
+        }
+        session_destroy (s);
+    }
+
+    bench_report ("session", iters, total);
+}
+
+
+int
+fossa_bench (int iters)
+{
+    FILE *out;
+
+    out = fopen ("/dev/null", "w");
+    if (!out) {
+        perror ("fossa: /dev/null");
+        return 1;
+    }
+
+    pt_set_backend (&sim_backend);
+
+    printf ("fossa: %i runs, %i libraries x %i symbols, %i calls in main()\n",
+            iters, bench_cfg.nlibs, bench_cfg.nsyms, bench_cfg.ncalls);
+    if (bench_check_dlsym () < 0) {
+        sim_destroy ();
+        fclose (out);
+        return 1;
+    }
+    bench_dlsym (iters);
+    bench_inject (iters);
+    bench_session (iters, out);
+
+    sim_destroy ();
+    fclose (out);
+
+    return 0;
+}
+
+#else
+
+int
+fossa_bench (int iters)
+{
+    fprintf (stderr, "fossa: --bench is only supported on x86_64\n");
+    return 1;
+}
+
+#endif /* #if _arch_x86_64_ */
@@ -0,0 +1,287 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// --checkpoint, --resume: a tuning campaign that is cut off (fossa or
+// the node dying, a preemptible allocation running out) can be picked
+// up where it was.  After every tuning iteration, the tuner's state is
+// written out along with the number of the next iteration and, with
+// --samples, the candidates' results.
+//
+// fossa can't make sense of the tuner's memory (its globals may point
+// anywhere on the heap), so the tuner has to save and load its state
+// itself: libcuzmem's cuzmem_save() writes it to the file it is given
+// and cuzmem_load() reads it back, each returning 0 if all went well.
+// A cuzmem_load() that fails is to leave the tuner as it was.  What
+// cuzmem_save() wrote is tacked onto the end of the checkpoint.
+//
+// A checkpoint is written to a temporary file first and renamed over
+// the last one, so that there always is a whole one to resume from.
+//
+// --online keeps its record of production runs the same way: there,
+// the iteration is the number of runs so far, and a libcuzmem without
+// cuzmem_save() and cuzmem_load() has only the candidates' results
+// kept for it.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "ptrace_wrap.h"
+#include "arena.h"
+#include "hash.h"
+#include "inject.h"
+#include "session.h"
+#include "checkpoint.h"
+
+#define CKPT_MAGIC      0x706b6366      /* "fckp" */
+#define CKPT_VERSION    2
+
+struct ckpt_hdr {
+    uint32_t magic;
+    uint32_t version;
+    char plan[72];          /* the plan hash it is for               */
+    int32_t iter;           /* the iteration to go on with           */
+    int32_t ncands;
+    int32_t best;           /* index of the quickest candidate, or -1 */
+    uint64_t tlen;          /* the tuner's state, after the candidates */
+};
+
+
+// Where the checkpoint goes: --checkpoint, or a file named after the
+// plan (with extension ext) in the current directory.  Made absolute,
+// as the daemon doesn't stay in its clients' directories.
+char*
+checkpoint_path (struct arena *a, struct fossa_options *opt, const char *ext)
+{
+    char cwd[FILENAME_MAX], *name, *path, *plan_hash;
+
+    name = arena_alloc (a, FILENAME_MAX);
+    if (opt->ckpt) {
+        snprintf (name, FILENAME_MAX, "%s", opt->ckpt);
+    } else {
+        plan_hash = hash (opt);
+        snprintf (name, FILENAME_MAX, "fossa-%.16s%s", plan_hash, ext);
+        free (plan_hash);
+    }
+
+    if ((name[0] == '/') || !getcwd (cwd, sizeof (cwd))) {
+        return name;
+    }
+
+    path = arena_alloc (a, 2 * FILENAME_MAX);
+    snprintf (path, 2 * FILENAME_MAX, "%s/%s", cwd, name);
+
+    return path;
+}
+
+
+// Have the tuner in process pid, which is stopped at the injection
+// site, save its state to path or load it from there (func is
+// cuzmem_save() or cuzmem_load()).  Unlike the session's injections,
+// this one is waited on.  Returns 0, or what went wrong.
+static int
+checkpoint_tuner (struct session *s, pid_t pid, Elf_Addr func, char *path)
+{
+    struct code_injection *inj;
+    struct inject_ctx ctx;
+
+    arena_reset (s->scratch);
+    inj = inject_build_path (s->scratch, func, path);
+    ctx.arena = s->scratch;
+    ctx.fp = s->ictx.fp;
+
+    inject_begin (pid, s->main_start, inj, &ctx);
+    if (pt_continue (pid) < 0) {
+        return -1;
+    }
+
+    return inject_finish (pid, s->main_start, inj, &ctx);
+}
+
+
+// Copy len bytes from one file to the other.  Returns 0, or -1 if
+// they couldn't all be copied.
+static int
+checkpoint_copy (FILE *to, FILE *from, uint64_t len)
+{
+    char buf[4096];
+    size_t n;
+
+    while (len) {
+        n = (len < sizeof (buf)) ? len : sizeof (buf);
+        if ((fread (buf, 1, n, from) != n) || (fwrite (buf, 1, n, to) != n)) {
+            return -1;
+        }
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+// Write the tuner's state, as process pid has it, along with the
+// iteration to resume at.  Without cuzmem_save(), only the candidates'
+// results are.  Returns 0, or -1 if it couldn't be written (the last
+// checkpoint is then left as it was).
+int
+checkpoint_save (struct session *s, pid_t pid, int iter)
+{
+    char tmp[FILENAME_MAX + 8], path[FILENAME_MAX + 8];
+    struct ckpt_hdr hdr;
+    FILE *fp, *tfp = NULL;
+    long len;
+    int ok = 1;
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = CKPT_MAGIC;
+    hdr.version = CKPT_VERSION;
+    snprintf (hdr.plan, sizeof (hdr.plan), "%s", s->plan_hash);
+    hdr.iter = iter;
+    hdr.ncands = s->ncands;
+    hdr.best = s->best_cand ? (int32_t)(s->best_cand - s->cands) : -1;
+
+    // the tuner's file is only needed until it is copied in
+    if (s->tbox->save) {
+        snprintf (path, sizeof (path), "%s.tuner", s->ckpt);
+        if (checkpoint_tuner (s, pid, s->tbox->save, path)) {
+            unlink (path);
+            errno = EIO;
+            return -1;
+        }
+        tfp = fopen (path, "r");
+        unlink (path);
+        if (!tfp || fseek (tfp, 0, SEEK_END) || ((len = ftell (tfp)) < 0)) {
+            if (tfp) {
+                fclose (tfp);
+            }
+            return -1;
+        }
+        rewind (tfp);
+        hdr.tlen = len;
+    }
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", s->ckpt);
+    fp = fopen (tmp, "w");
+    if (!fp) {
+        if (tfp) {
+            fclose (tfp);
+        }
+        return -1;
+    }
+
+    ok &= (fwrite (&hdr, sizeof (hdr), 1, fp) == 1);
+    if (s->ncands) {
+        ok &= (fwrite (s->cands, sizeof (struct cand), s->ncands, fp) == s->ncands);
+    }
+    if (tfp) {
+        ok &= (checkpoint_copy (fp, tfp, hdr.tlen) == 0);
+        fclose (tfp);
+    }
+
+    // on disk before it takes the last one's place
+    ok &= (fflush (fp) == 0);
+    ok &= (fsync (fileno (fp)) == 0);
+    ok &= (fclose (fp) == 0);
+
+    if (!ok || (rename (tmp, s->ckpt) < 0)) {
+        unlink (tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Put the tuner's state from the checkpoint into the child, which is
+// set up for tuning but hasn't started on it.  Returns the iteration
+// to go on with: 0 if there is no checkpoint, or none that fits.
+int
+checkpoint_load (struct session *s)
+{
+    char path[FILENAME_MAX + 8];
+    struct ckpt_hdr hdr;
+    FILE *fp, *tfp;
+    int ok;
+
+    fp = fopen (s->ckpt, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    if ((fread (&hdr, sizeof (hdr), 1, fp) != 1) ||
+        (hdr.magic != CKPT_MAGIC) || (hdr.version != CKPT_VERSION) ||
+        (hdr.iter <= 0) || (hdr.ncands < 0) ||
+        (hdr.ncands > (s->cands ? SESSION_MAX_CANDS : 0)) ||
+        (hdr.best >= hdr.ncands)) {
+        goto mismatch;
+    }
+
+    hdr.plan[sizeof (hdr.plan) - 1] = '\0';
+    if (strcmp (hdr.plan, s->plan_hash)) {
+        goto mismatch;
+    }
+
+    // a tuner's state is no good to a libcuzmem that can't load it
+    if (hdr.tlen && !s->tbox->load) {
+        goto mismatch;
+    }
+
+    if (hdr.ncands &&
+        (fread (s->cands, sizeof (struct cand), hdr.ncands, fp) != hdr.ncands)) {
+        goto mismatch;
+    }
+
+    // the tuner reads its state from a file of its own
+    if (hdr.tlen) {
+        snprintf (path, sizeof (path), "%s.tuner", s->ckpt);
+        tfp = fopen (path, "w");
+        ok = tfp && (checkpoint_copy (tfp, fp, hdr.tlen) == 0);
+        if (tfp && fclose (tfp)) {
+            ok = 0;
+        }
+        if (!ok || checkpoint_tuner (s, s->pid, s->tbox->load, path)) {
+            unlink (path);
+            goto mismatch;
+        }
+        unlink (path);
+    }
+    fclose (fp);
+
+    s->ncands = hdr.ncands;
+    s->best_cand = (hdr.best >= 0) ? &s->cands[hdr.best] : NULL;
+
+    return hdr.iter;
+
+mismatch:
+    fclose (fp);
+    fprintf (s->out, "fossa: checkpoint `%s' is not for this run, "
+                     "starting over\n", s->ckpt);
+    return 0;
+}
+
+
+// Tuning is over: there is nothing left to resume
+void
+checkpoint_drop (struct session *s)
+{
+    unlink (s->ckpt);
+}
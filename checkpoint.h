@@ -0,0 +1,37 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _checkpoint_h_
+#define _checkpoint_h_
+
+#include "arena.h"
+#include "options.h"
+#include "session.h"
+
+char*
+checkpoint_path (struct arena *a, struct fossa_options *opt, const char *ext);
+
+int
+checkpoint_save (struct session *s, pid_t pid, int iter);
+
+int
+checkpoint_load (struct session *s);
+
+void
+checkpoint_drop (struct session *s);
+
+#endif /* #ifndef _checkpoint_h_ */
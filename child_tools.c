@@ -17,16 +17,21 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <link.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/user.h>
+#include <sys/wait.h>
 #include <sys/stat.h>
 
 #include "fossa.h"
 #include "ptrace_wrap.h"
 #include "child_tools.h"
+#include "agent.h"
+#include "isolate.h"
 
 char*
 file_from_path (char* full_path)
@@ -35,7 +40,8 @@ file_from_path (char* full_path)
 
     // Get the last occurance of '/'
     if (full_path) {
-        file_name = strrchr (full_path, '/') + 1;
+        file_name = strrchr (full_path, '/');
+        file_name = file_name ? file_name + 1 : full_path;
     }
 
     return file_name;
@@ -53,22 +59,12 @@ child_drop_root (void)
     }
 }
 
-void
-child_oom_adj (pid_t pid, int oom_adj)
-{
-    FILE* fd;
-    char fn[FILENAME_MAX];
-
-    sprintf (fn, "/proc/%i/oom_adj", pid);
-    fd = fopen (fn, "r+");
-    fprintf (fd, "%i\n", oom_adj);
-    fclose (fd);
-}
-
+// Launch the child, stopped at its exec.  Returns its pid, or -1 if
+// it can't be forked or exec()ed.
 pid_t
-child_fork (char** child_argv, char** child_envp, int oom_adj)
+child_fork (char** child_argv, char** child_envp, struct fossa_options *opt)
 {
-    int i;
+    int i, status;
     size_t envp_size;
     pid_t child_pid;
     char **new_envp = NULL;
@@ -78,43 +74,99 @@ child_fork (char** child_argv, char** child_envp, int oom_adj)
     char preload[] = "LD_PRELOAD=./libcuzmem.so";
 #endif
 
+    // the child gets our environment plus the preload; only the
+    // pointer array is ours, so it can be freed once the child has exec'd
     for (i=0; child_envp[i] != NULL; i++);
-    envp_size = (i+1) * sizeof (char*); 
+    envp_size = (i+2) * sizeof (char*);
     new_envp = malloc (envp_size);
 
     for (i=0; child_envp[i] != NULL; i++) {
-        new_envp[i] = malloc (strlen (child_envp[i])*sizeof(char));
-        strcpy (new_envp[i], child_envp[i]);
+        new_envp[i] = child_envp[i];
     }
 
-    new_envp[i] = malloc (strlen (preload) * sizeof(char));
-    strcpy (new_envp[i], preload);
+    new_envp[i] = preload;
     new_envp[i+1] = NULL;
 
     switch (child_pid = fork()) {
         case -1:
-            perror ("fork()");
-            exit (1);
+            perror ("fossa: fork()");
+            free (new_envp);
+            return -1;
         case 0: 
             pt_allow_trace ();
+            // set while still root: a lower oom_score_adj takes sudo
+            isolate_enter (opt);
             child_drop_root ();
             execve (child_argv[0], child_argv, new_envp);
-            exit (1);
+            fprintf (stderr, "fossa: cannot run `%s': %s\n", child_argv[0],
+                     strerror (errno));
+            _exit (1);
+    }
+    free (new_envp);
+
+    // gone already, if the exec failed
+    if ((waitpid (child_pid, &status, 0) != child_pid) ||
+        !WIFSTOPPED (status)) {
+        return -1;
     }
-    waitpid (child_pid, NULL, 0);
 
     // The child is stopped @ this point due to the execv() call
     // (received SIGTRAP)
 
-
-    // try to set oom_adj for child
-    // will only work if user ran fossa with sudo
-    child_oom_adj (child_pid, oom_adj);
+    // follow any threads the child starts
+    pt_trace_threads (child_pid);
 
     return child_pid;
 }
 
 
+// Become the child, with the agent preloaded to drive it from the
+// inside (fossa --agent).  agent_env holds the agent's settings, as
+// NAME=value strings.  Only returns if the exec fails.
+void
+child_exec_agent (char** child_argv, char** child_envp,
+                  struct fossa_options *opt, char** agent_env)
+{
+    int i, j;
+    char **new_envp = NULL;
+    char *preload, *user = "";
+#if _release_
+    char agent_preload[] = "LD_PRELOAD=libcuzmem.so:" AGENT_LIB;
+#else
+    char agent_preload[] = "LD_PRELOAD=./libcuzmem.so:./" AGENT_LIB;
+#endif
+
+    for (i=0; child_envp[i] != NULL; i++);
+    for (j=0; agent_env[j] != NULL; j++);
+    new_envp = malloc ((i+j+2) * sizeof (char*));
+
+    // ld.so only looks at the first LD_PRELOAD, so one the user has
+    // set is added to ours rather than left in front of it
+    for (i=0, j=0; child_envp[i] != NULL; i++) {
+        if (!strncmp (child_envp[i], "LD_PRELOAD=", strlen ("LD_PRELOAD="))) {
+            user = child_envp[i] + strlen ("LD_PRELOAD=");
+            continue;
+        }
+        new_envp[j++] = child_envp[i];
+    }
+    for (i=0; agent_env[i] != NULL; i++) {
+        new_envp[j++] = agent_env[i];
+    }
+
+    preload = malloc (strlen (agent_preload) + strlen (user) + 2);
+    sprintf (preload, "%s%s%s", agent_preload, *user ? ":" : "", user);
+    new_envp[j] = preload;
+    new_envp[j+1] = NULL;
+
+    // same as for a traced child, only done to ourselves
+    isolate_enter (opt);
+    child_drop_root ();
+
+    execve (child_argv[0], child_argv, new_envp);
+    free (preload);
+    free (new_envp);
+}
+
 
 // Get the address of the Global Offset Table within
 // a child process's memory space
@@ -188,6 +240,55 @@ child_get_linkmap (pid_t pid)
 }
 
 
+// Count the symbols of a library that only carries a DT_GNU_HASH table.
+// Unlike DT_HASH, the GNU hash doesn't store the symbol count, so we find
+// the highest symbol index referenced by the buckets and follow its chain
+// to the end.
+static int
+child_gnu_hash_nsyms (pid_t pid, Elf_Addr gnu_hash)
+{
+    int i, n;
+    uint32_t hdr[4];        /* nbuckets, symoffset, bloom_size, bloom_shift */
+    uint32_t *buckets;
+    uint32_t chain[64];
+    uint32_t max_idx = 0;
+    Elf_Addr addr;
+
+    pt_peek (pid, gnu_hash, hdr, sizeof (hdr));
+
+    buckets = malloc (hdr[0] * sizeof (uint32_t));
+    addr = gnu_hash + sizeof (hdr) + hdr[2] * sizeof (Elf_Addr);
+    pt_peek (pid, addr, buckets, hdr[0] * sizeof (uint32_t));
+
+    for (i=0; i<hdr[0]; i++) {
+        if (buckets[i] > max_idx) {
+            max_idx = buckets[i];
+        }
+    }
+    free (buckets);
+
+    if (max_idx < hdr[1]) {
+        return hdr[1];
+    }
+
+    // walk the last chain until we find the entry with its low bit set
+    addr += hdr[0] * sizeof (uint32_t) + (max_idx - hdr[1]) * sizeof (uint32_t);
+    while (1) {
+        n = pt_read (pid, addr, chain, sizeof (chain)) / sizeof (uint32_t);
+        if (n <= 0) {
+            return max_idx + 1;
+        }
+
+        for (i=0; i<n; i++, max_idx++) {
+            if (chain[i] & 1) {
+                return max_idx + 1;
+            }
+        }
+        addr += n * sizeof (uint32_t);
+    }
+}
+
+
 // For a given link_map entry, this function will resolve the # of symbols
 // (nchains) and the addresses of the associated string and symbols tables
 // (strtab & symtab).
@@ -197,38 +298,55 @@ child_get_linkmap (pid_t pid)
 struct lib_map*
 child_get_lib (pid_t pid, struct link_map *entry)
 {
+    int i, n;
     unsigned long addr, addr_nchains;
-    Elf_Dyn *dyn = malloc (sizeof(Elf_Dyn));
+    Elf_Addr gnu_hash = 0;
+    Elf_Dyn dyn[32];
     struct lib_map *lib = malloc (sizeof(struct lib_map));
 
     // save library's base address in child's virtual memory map
     lib->base_addr = entry->l_addr;
+    lib->num_syms = 0;
+    lib->strsz = 0;
 
-    // now search through dynamic sections for what we want
+    // now search through dynamic sections for what we want.
+    // the section is read a batch of entries at a time
     addr = (unsigned long)entry->l_ld;
-    pt_peek (pid, addr, dyn, sizeof(Elf_Dyn));
+    n = pt_read (pid, addr, dyn, sizeof (dyn)) / sizeof (Elf_Dyn);
 
-    while (dyn->d_tag) {
-        switch (dyn->d_tag) {
+    for (i=0; (i < n) && dyn[i].d_tag; i++) {
+        switch (dyn[i].d_tag) {
             case DT_HASH:
-                addr_nchains = dyn->d_un.d_ptr+4;
+                addr_nchains = dyn[i].d_un.d_ptr+4;
                 pt_peek (pid, addr_nchains, &lib->num_syms, sizeof (lib->num_syms));
                 break;
+            case DT_GNU_HASH:
+                gnu_hash = dyn[i].d_un.d_ptr;
+                break;
             case DT_STRTAB:
-                lib->strtab = dyn->d_un.d_ptr;
+                lib->strtab = dyn[i].d_un.d_ptr;
+                break;
+            case DT_STRSZ:
+                lib->strsz = dyn[i].d_un.d_val;
                 break;
             case DT_SYMTAB:
-                lib->symtab = dyn->d_un.d_ptr;
+                lib->symtab = dyn[i].d_un.d_ptr;
                 break;
             default:
                 break;
         }
 
-        addr += sizeof (Elf_Dyn);
-        pt_peek (pid, addr, dyn, sizeof (Elf_Dyn));
+        if (i == n-1) {
+            addr += n * sizeof (Elf_Dyn);
+            n = pt_read (pid, addr, dyn, sizeof (dyn)) / sizeof (Elf_Dyn);
+            i = -1;
+        }
     }
 
-    free(dyn);
+    // modern toolchains often only emit the GNU style hash table
+    if (!lib->num_syms && gnu_hash) {
+        lib->num_syms = child_gnu_hash_nsyms (pid, gnu_hash);
+    }
 
     return lib;
 }
@@ -236,42 +354,64 @@ child_get_lib (pid_t pid, struct link_map *entry)
 
 // Get the address of a symbol within a library that
 // exists in the linkmap.
+//
+// The symbol and string tables are each pulled over in a single bulk
+// transfer and searched locally, rather than peeking every entry.
 unsigned long
 child_get_sym (pid_t pid, char* sym_name, struct lib_map* lib)
 {
     int i;
     char *str;
-    Elf_Sym *sym = malloc (sizeof(Elf_Sym));
-
-    i = 0;
-    while (i < lib->num_syms) {
-        // get the next symbol from the symbol table
-        pt_peek (pid, lib->symtab+(i*sizeof(Elf_Sym)), sym, sizeof(Elf_Sym));
-        i++;
-        
+    char *strtab = NULL;
+    unsigned long ret = 0;
+    Elf_Sym *syms = malloc (lib->num_syms * sizeof(Elf_Sym));
+
+    pt_peek (pid, lib->symtab, syms, lib->num_syms * sizeof(Elf_Sym));
+
+    if (lib->strsz) {
+        strtab = malloc (lib->strsz);
+        if (pt_read (pid, lib->strtab, strtab, lib->strsz) != lib->strsz) {
+            free (strtab);
+            strtab = NULL;
+        }
+    }
+
+    for (i=0; i<lib->num_syms; i++) {
         // is this symbol a function ?
-        if (ELF32_ST_TYPE (sym->st_info) != STT_FUNC) {
+        if (ELF32_ST_TYPE (syms[i].st_info) != STT_FUNC) {
             continue;
         }
 
         // yes, get its name
-        str = pt_get_str (pid, lib->strtab + sym->st_name);
+        if (strtab) {
+            if (syms[i].st_name >= lib->strsz) {
+                continue;
+            }
+            str = strtab + syms[i].st_name;
+        } else {
+            str = pt_get_str (pid, lib->strtab + syms[i].st_name);
+        }
 //        fprintf (stderr, "sym->st_name: %s\n", str);
-    
+
         // does this name match the name we are looking for ?
-        if (strncmp (str, sym_name, strlen(sym_name))) {
-            // no, just free str
-            free (str);
-        } else {
+        if (!strcmp (str, sym_name)) {
             // yes, return (base_addr + offset)
+            ret = lib->base_addr + syms[i].st_value;
+        }
+
+        if (!strtab) {
             free (str);
-            return (lib->base_addr + sym->st_value);
         }
-            
+
+        if (ret) {
+            break;
+        }
     }
 
-    // symbol not found
-    return 0;
+    free (strtab);
+    free (syms);
+
+    return ret;
 }   
 
 struct link_map*
@@ -289,7 +429,10 @@ child_search_linkmap (pid_t pid, char *lib_name)
         pt_peek (pid, (unsigned long)entry->l_next, entry, sizeof(struct link_map));
 
         // full_libname = entry->l_name;
-        pt_peek (pid, (unsigned long)entry->l_name, full_libname, sizeof(full_libname));
+        if (pt_read_str (pid, (unsigned long)entry->l_name,
+                         full_libname, sizeof(full_libname)) < 0) {
+            continue;
+        }
 
         // don't process "empty" library names
         if (*full_libname == '\0') {
@@ -308,6 +451,7 @@ child_search_linkmap (pid_t pid, char *lib_name)
     }
 
     // could not find library in linkmap
+    free (entry);
     return NULL;
 }
 
@@ -334,7 +478,129 @@ child_dlsym (pid_t pid, char *sym_name, char *lib_name)
     sym = child_get_sym (pid, sym_name, lib);
 
     free (lib);
+    free (entry);
 
     return sym;
 }
 
+
+// child_dlsym(), but a symbol already found in another child's copy of
+// the same library is only offset by where this child has it.  Only the
+// link_map is walked; the library's symbol table isn't read again.  A
+// NULL cache is no cache.
+unsigned long
+child_dlsym_cached (pid_t pid, char *sym_name, char *lib_name,
+                    struct sym_cache *cache)
+{
+    char full_libname[256];
+    struct link_map *entry;
+    struct lib_map* lib;
+    struct sym_cached *c;
+    Elf_Addr sym;
+    int i;
+
+    if (!cache) {
+        return child_dlsym (pid, sym_name, lib_name);
+    }
+
+    entry = child_search_linkmap (pid, lib_name);
+    if (entry == NULL) {
+        return 0;
+    }
+    if (pt_read_str (pid, (unsigned long)entry->l_name,
+                     full_libname, sizeof (full_libname)) < 0) {
+        full_libname[0] = '\0';
+    }
+
+    for (i=0; full_libname[0] && (i<cache->n); i++) {
+        c = &cache->e[i];
+        if (!strcmp (c->lib, full_libname) && !strcmp (c->sym, sym_name)) {
+            sym = entry->l_addr + c->off;
+            free (entry);
+            return sym;
+        }
+    }
+
+    lib = child_get_lib (pid, entry);
+    sym = child_get_sym (pid, sym_name, lib);
+
+    if (sym && full_libname[0] && (cache->n < CHILD_SYM_CACHE) &&
+        (strlen (sym_name) < sizeof (c->sym))) {
+        c = &cache->e[cache->n++];
+        strcpy (c->lib, full_libname);
+        strcpy (c->sym, sym_name);
+        c->off = sym - entry->l_addr;
+    }
+
+    free (lib);
+    free (entry);
+
+    return sym;
+}
+
+
+
+// Find the writable segments (.data and .bss) of a library loaded into
+// the child, from the program headers mapped along with its first
+// segment.  Up to max of them are put in seg[]; returns how many.
+int
+child_lib_data (pid_t pid, char *lib_name, struct lib_seg *seg, int max)
+{
+    struct link_map *entry;
+    Elf_Ehdr ehdr;
+    Elf_Phdr phdr;
+    int i, n = 0;
+
+    entry = child_search_linkmap (pid, lib_name);
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    if ((pt_read (pid, entry->l_addr, &ehdr, sizeof (ehdr)) != sizeof (ehdr)) ||
+        memcmp (ehdr.e_ident, ELFMAG, SELFMAG)) {
+        free (entry);
+        return 0;
+    }
+
+    for (i=0; (i < ehdr.e_phnum) && (n < max); i++) {
+        if (pt_read (pid, entry->l_addr + ehdr.e_phoff + i * sizeof (phdr),
+                     &phdr, sizeof (phdr)) != sizeof (phdr)) {
+            break;
+        }
+        if ((phdr.p_type == PT_LOAD) && (phdr.p_flags & PF_W)) {
+            seg[n].addr = entry->l_addr + phdr.p_vaddr;
+            seg[n].len = phdr.p_memsz;
+            n++;
+        }
+    }
+
+    free (entry);
+
+    return n;
+}
+
+
+// Does the child have a handler of its own for signal sig?
+int
+child_sig_caught (pid_t pid, int sig)
+{
+    FILE* fd;
+    char fn[FILENAME_MAX], line[128];
+    unsigned long long mask = 0;
+
+    sprintf (fn, "/proc/%i/status", pid);
+    fd = fopen (fn, "r");
+    if (!fd) {
+        return 0;
+    }
+
+    while (fgets (line, sizeof (line), fd)) {
+        if (sscanf (line, "SigCgt: %llx", &mask) == 1) {
+            break;
+        }
+    }
+    fclose (fd);
+
+    return (mask >> (sig - 1)) & 1;
+}
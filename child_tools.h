@@ -20,6 +20,7 @@
 #define _child_tools_h_
 
 #include "fossa.h"
+#include "options.h"
 
 // library map
 struct lib_map {
@@ -27,13 +28,41 @@ struct lib_map {
     Elf_Addr symtab;
     Elf_Addr strtab;
     Elf_Addr base_addr;
+    size_t strsz;
+};
+
+// a writable segment of a library
+struct lib_seg {
+    Elf_Addr addr;
+    size_t len;
+};
+
+#define CHILD_SYM_CACHE     32
+
+// a symbol found in one child, as an offset into its library, which is
+// known by the path the dynamic loader has for it
+struct sym_cached {
+    char lib[256];
+    char sym[64];
+    Elf_Addr off;
+};
+
+// symbols looked up in one child, for the next to skip the lookup
+// (fossa --batch)
+struct sym_cache {
+    int n;
+    struct sym_cached e[CHILD_SYM_CACHE];
 };
 
 char*
 file_from_path (char* full_path);
 
 pid_t
-child_fork (char** child_argv, char** child_envp, int oom_adj);
+child_fork (char** child_argv, char** child_envp, struct fossa_options *opt);
+
+void
+child_exec_agent (char** child_argv, char** child_envp,
+                  struct fossa_options *opt, char** agent_env);
 
 Elf_Addr
 child_get_got (pid_t pid);
@@ -53,4 +82,14 @@ child_search_linkmap (pid_t pid, char *lib_name);
 unsigned long
 child_dlsym (pid_t pid, char *sym_name, char *lib_name);
 
+unsigned long
+child_dlsym_cached (pid_t pid, char *sym_name, char *lib_name,
+                    struct sym_cache *cache);
+
+int
+child_lib_data (pid_t pid, char *lib_name, struct lib_seg *seg, int max);
+
+int
+child_sig_caught (pid_t pid, int sig);
+
 #endif /* #ifndef _child_tools_h_ */
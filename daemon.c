@@ -0,0 +1,699 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fossa --daemon: one tracer process that owns many children.
+//
+// Clients (fossa --submit) connect over a unix socket and send a job:
+// the options they were given, the program's argv, their environment
+// and working directory, along with their stdin/stdout/stderr (passed
+// as SCM_RIGHTS).  Each job becomes a session, and every session is
+// driven from a single epoll loop.  ptrace stops are announced with
+// SIGCHLD, which we take through a signalfd and then drain with
+// waitpid(-1, WNOHANG).  When a job's child exits, its exit status is
+// written back to the client and everything belonging to the job is
+// released, so the daemon's footprint only depends on how many jobs
+// are live.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "ptrace_wrap.h"
+#include "session.h"
+#include "daemon.h"
+
+#define JOB_MAGIC       0x666f7373      /* "foss" */
+#define JOB_MAX_LEN     (1 << 20)       /* strings in a job request  */
+#define MAX_EVENTS      64
+#define JOB_NOPTS       6               /* options sent as strings   */
+
+// what a client sends ahead of its strings:
+//   cwd \0 roi \0 cpus \0 cgroup \0 cpu_max \0 mem_max \0 ckpt \0
+//   argv[0] \0 ... argv[argc-1] \0 envp[0] \0 ... envp[envc-1] \0
+// (the options are empty when not given: roi for main())
+struct job_hdr {
+    uint32_t magic;
+    int32_t mode;
+    int32_t tuner;
+    int32_t oom_score;
+    int32_t numa_node;
+    int32_t reps;
+    int32_t fork;
+    int32_t jobs;
+    int32_t samples;
+    int32_t resume;
+    int32_t online;
+    int32_t drift;
+    double budget;
+    double race;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;
+};
+
+struct job {
+    int sock;               /* connection to the client (-1: gone)  */
+    int fds[3];             /* client's stdin, stdout, stderr       */
+    struct job_hdr hdr;
+    size_t got;             /* bytes of hdr + strings received      */
+    char* buf;
+    char** argv;
+    char** envp;
+    char* roi;
+    char* cpus;
+    char* cgroup;
+    char* cpu_max;
+    char* mem_max;
+    char* ckpt;
+    FILE* out;
+    struct session* sess;
+    struct job* next;
+};
+
+static struct job* jobs = NULL;
+
+// finished jobs are only freed once the current batch of epoll
+// events (which may still point at them) has been handled
+static struct job* graveyard = NULL;
+
+// epoll tags for the two fds that aren't jobs
+static int tag_listen, tag_signal;
+
+
+static void
+job_close_client (struct job* job, int epfd)
+{
+    if (job->sock >= 0) {
+        epoll_ctl (epfd, EPOLL_CTL_DEL, job->sock, NULL);
+        close (job->sock);
+        job->sock = -1;
+    }
+}
+
+
+// The job's child is gone (or never got going): tell the client how
+// it went and let go of everything
+static void
+job_finish (struct job* job, int epfd, int status)
+{
+    struct job** p;
+    int32_t st = status;
+    int i;
+
+    if (job->sock >= 0) {
+        send (job->sock, &st, sizeof (st), MSG_NOSIGNAL);
+    }
+    job_close_client (job, epfd);
+
+    if (job->out) {
+        fclose (job->out);
+    }
+    for (i=0; i<3; i++) {
+        if (job->fds[i] >= 0) {
+            close (job->fds[i]);
+        }
+    }
+    if (job->sess) {
+        session_destroy (job->sess);
+    }
+    job->out = NULL;
+    for (i=0; i<3; i++) {
+        job->fds[i] = -1;
+    }
+
+    for (p=&jobs; *p; p=&(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    }
+
+    job->sess = NULL;
+    job->next = graveyard;
+    graveyard = job;
+}
+
+
+static void
+job_bury (void)
+{
+    struct job* job;
+
+    while ((job = graveyard)) {
+        graveyard = job->next;
+        free (job->argv);
+        free (job->envp);
+        free (job->buf);
+        free (job);
+    }
+}
+
+
+static struct job*
+job_find (pid_t pid)
+{
+    struct job* job;
+
+    for (job=jobs; job; job=job->next) {
+        if (job->sess && session_owns (job->sess, pid)) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Collect every pending child state change and hand it to its session
+static void
+daemon_reap (int epfd)
+{
+    struct job* job;
+    struct pt_event ev;
+
+    while (pt_poll (&ev)) {
+        job = job_find (ev.pid);
+        if (!job) {
+            pt_forget (ev.pid);
+            continue;
+        }
+
+        session_event (job->sess, &ev);
+
+        if (job->sess->state == SESSION_DONE) {
+            job_finish (job, epfd, job->sess->status);
+        }
+    }
+}
+
+
+// --race, --tune-budget: cut short the jobs' passes that have run out
+// of time.  Returns how long epoll may wait (ms), -1 for as long as it
+// takes.
+static int
+daemon_timeouts (int epfd)
+{
+    struct job *job, *next;
+    int t, timeout = -1;
+
+    for (job=jobs; job; job=next) {
+        next = job->next;
+        if (!job->sess) {
+            continue;
+        }
+
+        t = session_timeout (job->sess);
+        if (job->sess->state == SESSION_DONE) {
+            job_finish (job, epfd, job->sess->status);
+            continue;
+        }
+        if ((t >= 0) && ((timeout < 0) || (t < timeout))) {
+            timeout = t;
+        }
+    }
+
+    return timeout;
+}
+
+
+// Split the received strings into cwd, options, argv and envp
+static int
+job_parse (struct job* job, char** cwd)
+{
+    char* p = job->buf;
+    char* end = job->buf + job->hdr.len;
+    char** opts[JOB_NOPTS] = {
+        &job->roi, &job->cpus, &job->cgroup, &job->cpu_max, &job->mem_max,
+        &job->ckpt
+    };
+    int i;
+
+    if ((job->hdr.argc == 0) || (end[-1] != '\0')) {
+        return -1;
+    }
+
+    job->argv = malloc ((job->hdr.argc + 1) * sizeof (char*));
+    job->envp = malloc ((job->hdr.envc + 1) * sizeof (char*));
+
+    *cwd = p;
+    p += strlen (p) + 1;
+
+    for (i=0; i<JOB_NOPTS; i++) {
+        if (p >= end) {
+            return -1;
+        }
+        *opts[i] = *p ? p : NULL;
+        p += strlen (p) + 1;
+    }
+
+    for (i=0; i<job->hdr.argc; i++) {
+        if (p >= end) {
+            return -1;
+        }
+        job->argv[i] = p;
+        p += strlen (p) + 1;
+    }
+    job->argv[i] = NULL;
+
+    for (i=0; i<job->hdr.envc; i++) {
+        if (p >= end) {
+            return -1;
+        }
+        job->envp[i] = p;
+        p += strlen (p) + 1;
+    }
+    job->envp[i] = NULL;
+
+    return 0;
+}
+
+
+// Fork the job's child with the client's cwd and stdio.  child_fork()
+// hands the child our own, so we borrow them around the fork.  The
+// child must also not inherit our blocked SIGCHLD or ignored SIGPIPE.
+static void
+job_launch (struct job* job, int epfd)
+{
+    struct fossa_options opt;
+    sigset_t mask;
+    char* cwd;
+    int old_cwd, old_fds[3];
+    int i;
+
+    if (job_parse (job, &cwd) < 0) {
+        job_finish (job, epfd, 1);
+        return;
+    }
+
+    memset (&opt, 0, sizeof (opt));
+    opt.mode = job->hdr.mode;
+    opt.tuner = job->hdr.tuner;
+    opt.oom_score = job->hdr.oom_score;
+    opt.numa_node = job->hdr.numa_node;
+    opt.cpus = job->cpus;
+    opt.cgroup = job->cgroup;
+    opt.cpu_max = job->cpu_max;
+    opt.mem_max = job->mem_max;
+    opt.roi = job->roi;
+    opt.reps = job->hdr.reps;
+    opt.fork = job->hdr.fork;
+    opt.jobs = job->hdr.jobs;
+    opt.samples = job->hdr.samples;
+    opt.ckpt = job->ckpt;
+    opt.resume = job->hdr.resume;
+    opt.online = job->hdr.online;
+    opt.drift = job->hdr.drift;
+    opt.budget = job->hdr.budget;
+    opt.race = job->hdr.race;
+    opt.child_argv = job->argv;
+    opt.child_argc = job->hdr.argc;
+    opt.child_prg = get_child_prg (job->argv[0]);
+
+    job->out = fdopen (dup (job->fds[1]), "w");
+    setvbuf (job->out, NULL, _IOLBF, 0);
+
+    old_cwd = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (chdir (cwd) < 0) {
+        fprintf (job->out, "fossa: cannot chdir to `%s'\n", cwd);
+        close (old_cwd);
+        job_finish (job, epfd, 1);
+        return;
+    }
+
+    for (i=0; i<3; i++) {
+        old_fds[i] = fcntl (i, F_DUPFD_CLOEXEC, 3);
+        dup2 (job->fds[i], i);
+    }
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGCHLD);
+    sigprocmask (SIG_UNBLOCK, &mask, NULL);
+    signal (SIGPIPE, SIG_DFL);
+
+    job->sess = session_create (&opt, job->envp, job->out);
+
+    signal (SIGPIPE, SIG_IGN);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+    for (i=0; i<3; i++) {
+        dup2 (old_fds[i], i);
+        close (old_fds[i]);
+    }
+    fchdir (old_cwd);
+    close (old_cwd);
+
+    if (!job->sess) {
+        job_finish (job, epfd, 1);
+        return;
+    }
+    job->sess->shared = 1;
+
+    // SIGCHLDs that arrived while unblocked were discarded
+    daemon_reap (epfd);
+}
+
+
+// Pull in more of a job request.  The client's stdio rides along
+// with the first bytes of the header.
+static void
+job_read (struct job* job, int epfd)
+{
+    char cbuf[CMSG_SPACE (3 * sizeof (int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    ssize_t n;
+
+    while (job->got < sizeof (job->hdr)) {
+        iov.iov_base = (char*)&job->hdr + job->got;
+        iov.iov_len = sizeof (job->hdr) - job->got;
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof (cbuf);
+
+        n = recvmsg (job->sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            job_finish (job, epfd, 1);
+            return;
+        }
+
+        cmsg = CMSG_FIRSTHDR (&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN (3 * sizeof (int))) {
+            memcpy (job->fds, CMSG_DATA (cmsg), 3 * sizeof (int));
+        }
+        job->got += n;
+
+        if (job->got == sizeof (job->hdr)) {
+            if ((job->hdr.magic != JOB_MAGIC) || (job->fds[1] < 0) ||
+                (job->hdr.len == 0) || (job->hdr.len > JOB_MAX_LEN)) {
+                job_finish (job, epfd, 1);
+                return;
+            }
+            job->buf = malloc (job->hdr.len);
+        }
+    }
+
+    while (job->got < sizeof (job->hdr) + job->hdr.len) {
+        n = read (job->sock, job->buf + job->got - sizeof (job->hdr),
+                  sizeof (job->hdr) + job->hdr.len - job->got);
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            job_finish (job, epfd, 1);
+            return;
+        }
+        job->got += n;
+    }
+
+    job_launch (job, epfd);
+}
+
+
+static void
+daemon_accept (int lfd, int epfd)
+{
+    int fd, i;
+    struct job* job;
+    struct epoll_event ev;
+    struct ucred cred;
+    socklen_t len;
+
+    while ((fd = accept4 (lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        // a job runs with our rights, so only our own user may send one
+        len = sizeof (cred);
+        cred.uid = -1;
+        if ((getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) ||
+            (cred.uid != geteuid ())) {
+            fprintf (stderr, "fossa: refused a job from uid %i\n",
+                     (int)cred.uid);
+            close (fd);
+            continue;
+        }
+
+        job = malloc (sizeof (struct job));
+        memset (job, 0, sizeof (struct job));
+        job->sock = fd;
+        for (i=0; i<3; i++) {
+            job->fds[i] = -1;
+        }
+        job->next = jobs;
+        jobs = job;
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = job;
+        epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+
+int
+fossa_daemon (char* sock_path)
+{
+    int lfd, sfd, epfd;
+    int i, n;
+    sigset_t mask;
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct signalfd_siginfo si;
+    struct job* job;
+    mode_t mask_old;
+    int ret;
+
+    if (strlen (sock_path) >= sizeof (addr.sun_path)) {
+        fprintf (stderr, "fossa: socket path too long\n");
+        return 1;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, sock_path);
+
+    lfd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink (sock_path);
+
+    // the socket is only ours to connect to from the start, not just
+    // after a chmod() that others could race
+    mask_old = umask (077);
+    ret = (lfd < 0) || (bind (lfd, (struct sockaddr*)&addr, sizeof (addr)) < 0);
+    umask (mask_old);
+
+    if (ret || (listen (lfd, SOMAXCONN) < 0)) {
+        perror ("fossa: daemon socket");
+        return 1;
+    }
+
+    // ptrace stops show up as SIGCHLD
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGCHLD);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+    sfd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    signal (SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &tag_listen;
+    epoll_ctl (epfd, EPOLL_CTL_ADD, lfd, &ev);
+    ev.data.ptr = &tag_signal;
+    epoll_ctl (epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+    printf ("fossa: daemon listening on %s\n", sock_path);
+    fflush (stdout);
+
+    while (1) {
+        n = epoll_wait (epfd, events, MAX_EVENTS, daemon_timeouts (epfd));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror ("fossa: epoll_wait");
+            return 1;
+        }
+
+        for (i=0; i<n; i++) {
+            if (events[i].data.ptr == &tag_listen) {
+                daemon_accept (lfd, epfd);
+            }
+            else if (events[i].data.ptr == &tag_signal) {
+                while (read (sfd, &si, sizeof (si)) == sizeof (si));
+                daemon_reap (epfd);
+            }
+            else {
+                job = events[i].data.ptr;
+                if (job->sock < 0) {
+                    continue;
+                }
+                if (!job->sess) {
+                    job_read (job, epfd);
+                    continue;
+                }
+
+                // client went away while its job is running
+                kill (job->sess->pid, SIGKILL);
+                job_close_client (job, epfd);
+            }
+        }
+
+        job_bury ();
+    }
+
+    return 0;
+}
+
+
+// fossa --submit: ship the job to the daemon and wait for its status
+int
+fossa_submit (char* sock_path, struct fossa_options *opt, char** envp)
+{
+    int fd, i, envc;
+    ssize_t n;
+    size_t sent;
+    int fds[3] = { 0, 1, 2 };
+    int32_t status;
+    char cwd[FILENAME_MAX];
+    char cbuf[CMSG_SPACE (sizeof (fds))];
+    char *buf, *p;
+    char *opts[JOB_NOPTS] = {
+        opt->roi, opt->cpus, opt->cgroup, opt->cpu_max, opt->mem_max,
+        opt->ckpt
+    };
+    struct job_hdr hdr;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr* cmsg;
+
+    if (!getcwd (cwd, sizeof (cwd))) {
+        perror ("fossa: getcwd");
+        return 1;
+    }
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = JOB_MAGIC;
+    hdr.mode = opt->mode;
+    hdr.tuner = opt->tuner;
+    hdr.oom_score = opt->oom_score;
+    hdr.numa_node = opt->numa_node;
+    hdr.reps = opt->reps;
+    hdr.fork = opt->fork;
+    hdr.jobs = opt->jobs;
+    hdr.samples = opt->samples;
+    hdr.resume = opt->resume;
+    hdr.online = opt->online;
+    hdr.drift = opt->drift;
+    hdr.budget = opt->budget;
+    hdr.race = opt->race;
+    hdr.argc = opt->child_argc;
+    hdr.len = strlen (cwd) + 1;
+    for (i=0; i<JOB_NOPTS; i++) {
+        hdr.len += (opts[i] ? strlen (opts[i]) : 0) + 1;
+    }
+    for (i=0; i<opt->child_argc; i++) {
+        hdr.len += strlen (opt->child_argv[i]) + 1;
+    }
+    for (envc=0; envp[envc]; envc++) {
+        hdr.len += strlen (envp[envc]) + 1;
+    }
+    hdr.envc = envc;
+
+    p = buf = malloc (hdr.len);
+    p = stpcpy (p, cwd) + 1;
+    for (i=0; i<JOB_NOPTS; i++) {
+        p = stpcpy (p, opts[i] ? opts[i] : "") + 1;
+    }
+    for (i=0; i<opt->child_argc; i++) {
+        p = stpcpy (p, opt->child_argv[i]) + 1;
+    }
+    for (i=0; i<envc; i++) {
+        p = stpcpy (p, envp[i]) + 1;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, sock_path, sizeof (addr.sun_path) - 1);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((fd < 0) || (connect (fd, (struct sockaddr*)&addr, sizeof (addr)) < 0)) {
+        perror ("fossa: cannot reach daemon");
+        return 1;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof (hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = hdr.len;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+    memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+    n = sendmsg (fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+        perror ("fossa: cannot submit job");
+        return 1;
+    }
+
+    // anything sendmsg() didn't take goes out as plain data
+    for (sent=n; sent < sizeof (hdr) + hdr.len; sent += n) {
+        if (sent < sizeof (hdr)) {
+            n = send (fd, (char*)&hdr + sent, sizeof (hdr) - sent, MSG_NOSIGNAL);
+        } else {
+            n = send (fd, buf + sent - sizeof (hdr),
+                      sizeof (hdr) + hdr.len - sent, MSG_NOSIGNAL);
+        }
+        if (n <= 0) {
+            perror ("fossa: cannot submit job");
+            return 1;
+        }
+    }
+    free (buf);
+
+    if (read (fd, &status, sizeof (status)) != sizeof (status)) {
+        fprintf (stderr, "fossa: lost contact with daemon\n");
+        return 1;
+    }
+
+    close (fd);
+
+    return status;
+}
@@ -0,0 +1,29 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _daemon_h_
+#define _daemon_h_
+
+#include "options.h"
+
+int
+fossa_daemon (char* sock_path);
+
+int
+fossa_submit (char* sock_path, struct fossa_options *opt, char** envp);
+
+#endif /* #ifndef _daemon_h_ */
@@ -0,0 +1,157 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// --drift: a plan is tuned for the program, its input, the driver and
+// the device memory free at the time, none of which stay put.  Each
+// planned run's main() time is kept against the plan's baseline in a
+// record named after the plan, and a run that finds the latest ones
+// slower (by Welch's test, and by more than DRIFT_SLOWDOWN) marks the
+// plan stale.
+//
+// The baseline is what tuning made of the plan's time with --samples;
+// otherwise (or if tuning wasn't watched) the plan's first planned
+// runs make it up.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "arena.h"
+#include "hash.h"
+#include "samples.h"
+#include "drift.h"
+
+#define DRIFT_MAGIC     0x74667264      /* "drft" */
+
+
+// The plan's record: fossa-<plan>.drift in the current directory, made
+// absolute as the daemon doesn't stay in its clients' directories
+char*
+drift_path (struct arena *a, struct fossa_options *opt)
+{
+    char cwd[FILENAME_MAX], *path, *plan_hash;
+
+    path = arena_alloc (a, 2 * FILENAME_MAX);
+    plan_hash = hash (opt);
+    if (getcwd (cwd, sizeof (cwd))) {
+        snprintf (path, 2 * FILENAME_MAX, "%s/fossa-%.16s.drift", cwd, plan_hash);
+    } else {
+        snprintf (path, 2 * FILENAME_MAX, "fossa-%.16s.drift", plan_hash);
+    }
+    free (plan_hash);
+
+    return path;
+}
+
+
+// Read the plan's record.  One that is missing or unreadable is an
+// empty one: the baseline is made up anew
+void
+drift_load (const char *path, struct drift *d)
+{
+    FILE *fp = fopen (path, "r");
+
+    if (!fp || (fread (d, sizeof (struct drift), 1, fp) != 1) ||
+        (d->magic != DRIFT_MAGIC) || (d->nrecent < 0) ||
+        (d->nrecent > DRIFT_WINDOW) || (d->next < 0) ||
+        (d->next >= DRIFT_WINDOW)) {
+        drift_reset (d, NULL);
+    }
+
+    if (fp) {
+        fclose (fp);
+    }
+}
+
+
+// Write the plan's record, by way of a temporary file.  Returns 0, or -1
+int
+drift_save (const char *path, struct drift *d)
+{
+    char tmp[2 * FILENAME_MAX + 8];
+    FILE *fp;
+    int ok;
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    fp = fopen (tmp, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    ok = (fwrite (d, sizeof (struct drift), 1, fp) == 1);
+    ok &= (fclose (fp) == 0);
+
+    if (!ok || (rename (tmp, path) < 0)) {
+        unlink (tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// A new plan: start over, from base if tuning timed it
+void
+drift_reset (struct drift *d, struct samples *base)
+{
+    memset (d, 0, sizeof (struct drift));
+    d->magic = DRIFT_MAGIC;
+    if (base) {
+        d->base = *base;
+    }
+}
+
+
+// A planned run took t seconds
+void
+drift_add (struct drift *d, double t)
+{
+    if (d->base.n < DRIFT_BASE) {
+        samples_add (&d->base, t);
+        return;
+    }
+
+    d->recent[d->next] = t;
+    d->next = (d->next + 1) % DRIFT_WINDOW;
+    if (d->nrecent < DRIFT_WINDOW) {
+        d->nrecent++;
+    }
+}
+
+
+// Have the latest runs slowed down for real?  Returns 1 if so, with
+// their times in now
+int
+drift_check (struct drift *d, struct samples *now)
+{
+    int i;
+
+    memset (now, 0, sizeof (struct samples));
+    for (i=0; i<d->nrecent; i++) {
+        samples_add (now, d->recent[i]);
+    }
+
+    if ((d->base.n < DRIFT_BASE) || (now->n < DRIFT_MIN_RUNS)) {
+        return 0;
+    }
+
+    return samples_less (&d->base, now) &&
+           (now->mean > d->base.mean * DRIFT_SLOWDOWN);
+}
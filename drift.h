@@ -0,0 +1,64 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _drift_h_
+#define _drift_h_
+
+#include <stdint.h>
+#include "arena.h"
+#include "options.h"
+#include "samples.h"
+
+// --drift: what is done about a plan that has gone stale
+#define DRIFT_WARN          1       /* just say so, every run          */
+#define DRIFT_RETUNE        2       /* tune again, come the next run   */
+#define DRIFT_PLANLESS      3       /* run without it until re-tuned   */
+
+#define DRIFT_BASE          5       /* planned runs a baseline needs   */
+#define DRIFT_WINDOW        8       /* latest runs held up against it  */
+#define DRIFT_MIN_RUNS      3       /* ... at the least                */
+#define DRIFT_SLOWDOWN      1.05    /* smallest slowdown that counts   */
+
+// How a plan's runs have taken since it was tuned
+struct drift {
+    uint32_t magic;
+    struct samples base;    /* main()'s time, as tuned                */
+    double recent[DRIFT_WINDOW];    /* the latest runs, round robin   */
+    int32_t nrecent;
+    int32_t next;
+    int32_t stale;          /* the plan has been found to have slowed */
+};
+
+char*
+drift_path (struct arena *a, struct fossa_options *opt);
+
+void
+drift_load (const char *path, struct drift *d);
+
+int
+drift_save (const char *path, struct drift *d);
+
+void
+drift_reset (struct drift *d, struct samples *base);
+
+void
+drift_add (struct drift *d, double t);
+
+int
+drift_check (struct drift *d, struct samples *now);
+
+#endif /* #ifndef _drift_h_ */
@@ -17,11 +17,48 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "fossa.h"
+#include "arena.h"
+#include "x86_decode.h"
+#include "elf_tools.h"
 
+#if _arch_i386_
+#define ELF_ST_TYPE(i)  ELF32_ST_TYPE(i)
+#define ELF_R_SYM(i)    ELF32_R_SYM(i)
+#elif _arch_x86_64_
+#define ELF_ST_TYPE(i)  ELF64_ST_TYPE(i)
+#define ELF_R_SYM(i)    ELF64_R_SYM(i)
+#endif
+
+// An ELF file mapped in, read only
+struct elf_image {
+    u_char *base;
+    size_t size;
+    Elf_Ehdr *ehdr;
+    Elf_Phdr *phdr;
+    Elf_Shdr *shdr;
+};
+
+// Functions that don't come back: a call to one ends a path through
+// the caller as surely as a ret does
+static const char *elf_noreturn[] = {
+    "exit", "_exit", "_Exit", "quick_exit", "abort", "pthread_exit",
+    "longjmp", "_longjmp", "siglongjmp", "__longjmp_chk",
+    "err", "errx", "verr", "verrx",
+    "__assert_fail", "__assert_perror_fail", "__stack_chk_fail",
+    "__chk_fail", "__fortify_fail",
+    "__cxa_throw", "__cxa_rethrow", "_Unwind_Resume",
+    "_ZSt9terminatev",
+    NULL
+};
+
+// Read elf_file in whole.  NULL (and a message) if it can't be.
 u_char*
 elf_load (char* elf_file)
 {
@@ -32,26 +69,27 @@ elf_load (char* elf_file)
     fd_elf = open (elf_file, O_RDONLY);
     if (fd_elf == -1) {
         fprintf (stderr, "fossa: cannot run `%s': No such file\n", elf_file);
-        exit (1);
+        return NULL;
     }
 
     if (fstat (fd_elf, &elf_stat) == -1) {
         fprintf (stderr, "fossa: cannot run `%s': Could not stat file\n", elf_file);
-        exit (1);
+        close (fd_elf);
+        return NULL;
     }
 
     elf_img = (u_char *)calloc (sizeof(u_char), elf_stat.st_size);
     if (!elf_img) {
         fprintf (stderr, "fossa: cannot run `%s': Not enough memory\n", elf_file);
         close (fd_elf);
-        exit (1);
+        return NULL;
     }
 
     if (read (fd_elf, elf_img, elf_stat.st_size) != elf_stat.st_size) {
         fprintf (stderr, "fossa: cannot run `%s': File read error\n", elf_file);
         free (elf_img);
         close (fd_elf);
-        exit (1);
+        return NULL;
     }
 
     close (fd_elf);
@@ -60,68 +98,558 @@ elf_load (char* elf_file)
 }
 
 
-void
-elf_get_func (char* elf_file, const char *func_name, Elf_Addr *func_start, Elf_Addr *func_len)
+// Map elf_file in.  Only the parts that get looked at are ever read
+// from disk, which matters for big binaries.  Returns 0, or -1 (with a
+// message to say why) if it isn't an ELF file that can be read.
+static int
+elf_map (char *elf_file, struct elf_image *img)
 {
-    int i;
-    u_char* base = NULL;
-    Elf_Ehdr      *ehdr   = NULL;
-    Elf_Phdr      *phdr   = NULL;
-    Elf_Shdr      *shdr   = NULL;
-    Elf_Sym       *sym    = NULL;
-    char* strtable = NULL;
-    char* sym_name = NULL;
-    size_t cur_size = 0;
-    size_t sym_size = 0;
-
-    base = elf_load (elf_file);
+    int fd_elf;
+    struct stat elf_stat;
+
+    fd_elf = open (elf_file, O_RDONLY);
+    if (fd_elf == -1) {
+        fprintf (stderr, "fossa: cannot run `%s': No such file\n", elf_file);
+        return -1;
+    }
+
+    if (fstat (fd_elf, &elf_stat) == -1) {
+        fprintf (stderr, "fossa: cannot run `%s': Could not stat file\n", elf_file);
+        close (fd_elf);
+        return -1;
+    }
+
+    img->size = elf_stat.st_size;
+    img->base = mmap (NULL, img->size, PROT_READ, MAP_PRIVATE, fd_elf, 0);
+    close (fd_elf);
+
+    if ((img->base == MAP_FAILED) || (img->size < sizeof (Elf_Ehdr)) ||
+        memcmp (img->base, ELFMAG, SELFMAG)) {
+        fprintf (stderr, "fossa: cannot run `%s': Not an ELF file\n", elf_file);
+        if (img->base != MAP_FAILED) {
+            munmap (img->base, img->size);
+        }
+        return -1;
+    }
 
     // We now have the ELF header
-    ehdr = (Elf_Ehdr *)base;
+    img->ehdr = (Elf_Ehdr *)img->base;
 
     // Get the program and section headers
-    phdr = (Elf_Phdr *)(base + ehdr->e_phoff);
-    shdr = (Elf_Shdr *)(base + ehdr->e_shoff);
+    img->phdr = (Elf_Phdr *)(img->base + img->ehdr->e_phoff);
+    img->shdr = (Elf_Shdr *)(img->base + img->ehdr->e_shoff);
+
+    return 0;
+}
+
+
+static void
+elf_unmap (struct elf_image *img)
+{
+    munmap (img->base, img->size);
+}
 
-    // Get offset to the string table (.shstrtab)
-    // .shstrtab holds the ELF section names
-    strtable = (char*)(base + shdr[ehdr->e_shstrndx].sh_offset);
+
+// Where the bytes loaded at vaddr are in the file.  *avail is set to
+// how many follow them in the same segment.
+static u_char*
+elf_vaddr (struct elf_image *img, Elf_Addr vaddr, size_t *avail)
+{
+    int i;
+    Elf_Phdr *phdr = img->phdr;
+
+    for (i=0; i<img->ehdr->e_phnum; i++) {
+        if ((phdr[i].p_type == PT_LOAD) &&
+            (vaddr >= phdr[i].p_vaddr) &&
+            (vaddr < phdr[i].p_vaddr + phdr[i].p_filesz) &&
+            (phdr[i].p_offset + phdr[i].p_filesz <= img->size)) {
+            *avail = phdr[i].p_vaddr + phdr[i].p_filesz - vaddr;
+            return img->base + phdr[i].p_offset + (vaddr - phdr[i].p_vaddr);
+        }
+    }
+
+    return NULL;
+}
+
+
+// Look a symbol up by name in the sections of type sh_type, or, if
+// func_name is NULL, find the function at addr.
+static Elf_Sym*
+elf_scan_syms (struct elf_image *img, Elf_Word sh_type,
+               const char *func_name, Elf_Addr addr, char **name)
+{
+    int i;
+    Elf_Shdr *shdr = img->shdr;
+    Elf_Sym *sym;
+    char *strtab;
+    size_t n, j;
 
     // Cycle through section headers
-    for (i=0; i<ehdr->e_shnum; i++) {
-        if (shdr[i].sh_type == SHT_DYNSYM) {
-            sym = (Elf_Sym*)(base + shdr[i].sh_offset);
-            sym++;
+    for (i=0; i<img->ehdr->e_shnum; i++) {
+        if ((shdr[i].sh_type != sh_type) || !shdr[i].sh_entsize) {
+            continue;
+        }
 
-            sym_size = shdr[i].sh_entsize;
-            cur_size +=sym_size;
+        sym = (Elf_Sym*)(img->base + shdr[i].sh_offset);
+        strtab = (char*)(img->base + shdr[shdr[i].sh_link].sh_offset);
+        n = shdr[i].sh_size / shdr[i].sh_entsize;
 
-            do {
-#if _arch_i386_
-                if (ELF32_ST_TYPE(sym->st_info) != STT_SECTION) {
-#elif _arch_x86_64_
-                if (ELF64_ST_TYPE(sym->st_info) != STT_SECTION) {
-#endif
-                    sym_name = (base + shdr[shdr[i].sh_link].sh_offset) + sym->st_name;
-                    if (!strcmp (func_name, sym_name)) {
-                        if (func_start != NULL) {
-                            *func_start = sym->st_value;
-                        }
-
-                        if (func_len != NULL) {
-                            *func_len   = sym->st_size;
-                        }
-
-                        free (base);
-                        return;
-                    }
+        for (j=1; j<n; j++) {
+            if (ELF_ST_TYPE(sym[j].st_info) == STT_SECTION) {
+                continue;
+            }
+
+            if (func_name) {
+                if (!strcmp (func_name, strtab + sym[j].st_name)) {
+                    return &sym[j];
                 }
+            } else if ((sym[j].st_value == addr) &&
+                       (ELF_ST_TYPE(sym[j].st_info) == STT_FUNC)) {
+                *name = strtab + sym[j].st_name;
+                return &sym[j];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+// The exported symbols go first (that is all there is in a stripped
+// binary), then the full symbol table, for functions that aren't
+// exported
+static Elf_Sym*
+elf_find_sym (struct elf_image *img, const char *func_name)
+{
+    Elf_Sym *sym = elf_scan_syms (img, SHT_DYNSYM, func_name, 0, NULL);
+
+    if (!sym) {
+        sym = elf_scan_syms (img, SHT_SYMTAB, func_name, 0, NULL);
+    }
+
+    return sym;
+}
+
+
+// Name of the symbol whose address the dynamic linker puts in the
+// GOT slot at slot (relocation sections are REL on i386, RELA on
+// x86_64: both start with r_offset and r_info)
+static char*
+elf_slot_name (struct elf_image *img, Elf_Addr slot)
+{
+    int i;
+    Elf_Shdr *shdr = img->shdr, *symtab;
+    Elf_Rel *rel;
+    Elf_Sym *sym;
+    size_t n, j;
+
+    for (i=0; i<img->ehdr->e_shnum; i++) {
+        if (((shdr[i].sh_type != SHT_REL) && (shdr[i].sh_type != SHT_RELA)) ||
+            !shdr[i].sh_entsize || (shdr[i].sh_link >= img->ehdr->e_shnum)) {
+            continue;
+        }
+
+        symtab = &shdr[shdr[i].sh_link];
+        sym = (Elf_Sym*)(img->base + symtab->sh_offset);
+        n = shdr[i].sh_size / shdr[i].sh_entsize;
+
+        for (j=0; j<n; j++) {
+            rel = (Elf_Rel*)(img->base + shdr[i].sh_offset + j * shdr[i].sh_entsize);
+            if ((rel->r_offset == slot) && ELF_R_SYM(rel->r_info)) {
+                return (char*)(img->base + img->shdr[symtab->sh_link].sh_offset) +
+                       sym[ELF_R_SYM(rel->r_info)].st_name;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+// Name of the function a call to addr ends up in: the function there,
+// or, for a PLT entry, whatever its GOT slot gets bound to
+static char*
+elf_callee_name (struct elf_image *img, Elf_Addr addr, int bits)
+{
+    struct x86_insn insn;
+    char *name = NULL;
+    u_char *code;
+    size_t avail;
+    int i, len;
+
+    if (elf_scan_syms (img, SHT_SYMTAB, NULL, addr, &name) ||
+        elf_scan_syms (img, SHT_DYNSYM, NULL, addr, &name)) {
+        return name;
+    }
+
+    // a PLT entry is a jmp *slot, maybe after an endbr
+    for (i=0; i<2; i++) {
+        code = elf_vaddr (img, addr, &avail);
+        if (!code || !(len = x86_decode (code, avail, addr, bits, &insn))) {
+            return NULL;
+        }
+        if (insn.flow == X86_JMP_IND) {
+            return insn.has_mem ? elf_slot_name (img, insn.mem) : NULL;
+        }
+        if (insn.flow != X86_NEXT) {
+            return NULL;
+        }
+        addr += len;
+    }
+
+    return NULL;
+}
+
+
+// Does a call (of what x86_decode made of it) never come back?
+static int
+elf_call_noreturn (struct elf_image *img, struct x86_insn *insn, int bits)
+{
+    char *name = NULL;
+    int i;
+
+    if (insn->flow == X86_CALL) {
+        name = elf_callee_name (img, insn->target, bits);
+    } else if (insn->has_mem) {
+        // call *slot, as with -fno-plt
+        name = elf_slot_name (img, insn->mem);
+    }
+
+    if (!name) {
+        return 0;
+    }
+
+    for (i=0; elf_noreturn[i]; i++) {
+        if (!strcmp (name, elf_noreturn[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Where func_name is in elf_file, and how long it is.  Both are left
+// alone if it isn't there.  Returns 0, or -1 if elf_file can't be read
+int
+elf_get_func (char* elf_file, const char *func_name, Elf_Addr *func_start, Elf_Addr *func_len)
+{
+    struct elf_image img;
+    Elf_Sym *sym = NULL;
+
+    if (elf_map (elf_file, &img) < 0) {
+        return -1;
+    }
+
+    // the symbols of a position independent executable only give
+    // offsets from wherever it gets loaded, which we can't know here
+    if (img.ehdr->e_type == ET_EXEC) {
+        sym = elf_find_sym (&img, func_name);
+    }
+
+    if (sym) {
+        if (func_start != NULL) {
+            *func_start = sym->st_value;
+        }
+
+        if (func_len != NULL) {
+            *func_len   = sym->st_size;
+        }
+    }
 
-                cur_size += sym_size;
-                sym++;
-            } while (cur_size < shdr[i].sh_size);
+    elf_unmap (&img);
+
+    return 0;
+}
+
+
+// per byte of the function, while building its CFG
+#define ELF_CFG_INSN    0x01    /* an instruction starts here          */
+#define ELF_CFG_LEADER  0x02    /* ... and so does a basic block       */
+#define ELF_CFG_END     0x04    /* ... and it is the last one in it    */
+
+// index of the block starting at addr, -1 if none
+static int
+elf_cfg_block (struct elf_cfg *cfg, Elf_Addr addr)
+{
+    int lo = 0, hi = cfg->nblocks - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (cfg->block[mid].start == addr) {
+            return mid;
+        } else if (cfg->block[mid].start < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
         }
     }
 
+    return -1;
+}
+
+
+static void
+elf_cfg_exit (struct elf_cfg *cfg, int max, Elf_Addr addr,
+              enum elf_exit_kind kind)
+{
+    if (cfg->nexits < max) {
+        cfg->exit[cfg->nexits].addr = addr;
+        cfg->exit[cfg->nexits].kind = kind;
+        cfg->nexits++;
+    }
 }
 
+
+// Find the loop headers: the targets of the back edges of a depth
+// first walk of the blocks
+static void
+elf_cfg_loops (struct arena *a, struct elf_cfg *cfg)
+{
+    int *color = calloc (cfg->nblocks, sizeof (int));
+    int *stack = malloc (cfg->nblocks * sizeof (int));
+    int *next = calloc (cfg->nblocks, sizeof (int));
+    int top = 0, b, succ, i;
+
+    if (!color || !stack || !next) {
+        fprintf (stderr, "fossa: elf_cfg_loops(): Not enough memory\n");
+        exit (1);
+    }
+
+    // white (0), on the stack (1), done (2)
+    stack[top++] = 0;
+    color[0] = 1;
+    while (top) {
+        b = stack[top - 1];
+        if (next[b] == 2) {
+            color[b] = 2;
+            top--;
+            continue;
+        }
+
+        succ = cfg->block[b].succ[next[b]++];
+        if (succ < 0) {
+            continue;
+        }
+        if (color[succ] == 1) {
+            cfg->block[succ].loop_header = 1;
+        } else if (color[succ] == 0) {
+            color[succ] = 1;
+            stack[top++] = succ;
+        }
+    }
+
+    for (i=0; i<cfg->nblocks; i++) {
+        cfg->nloops += cfg->block[i].loop_header;
+    }
+    cfg->loop = arena_alloc (a, (cfg->nloops + 1) * sizeof (Elf_Addr));
+    cfg->nloops = 0;
+    for (i=0; i<cfg->nblocks; i++) {
+        if (cfg->block[i].loop_header) {
+            cfg->loop[cfg->nloops++] = cfg->block[i].start;
+        }
+    }
+
+    free (color);
+    free (stack);
+    free (next);
+}
+
+
+// Build the control flow graph of func_name in elf_file by decoding it
+// from where its entry point leads.  The CFG (allocated in a) holds
+// the basic blocks, every site the function can leave from and its
+// loop headers.  Returns NULL if the function can't be found.
+struct elf_cfg*
+elf_get_cfg (struct arena *a, char *elf_file, const char *func_name)
+{
+    struct elf_image img;
+    struct elf_cfg *cfg;
+    struct elf_block *blk;
+    struct x86_insn insn;
+    Elf_Sym *sym;
+    Elf_Addr start, t;
+    u_char *code, *mark;
+    size_t len, avail, off, o, *work;
+    int bits, n, nwork = 0, nexits = 0, i;
+
+    if (elf_map (elf_file, &img) < 0) {
+        return NULL;
+    }
+    bits = (img.ehdr->e_ident[EI_CLASS] == ELFCLASS64) ? 64 : 32;
+
+    sym = elf_find_sym (&img, func_name);
+    if (!sym || !sym->st_size ||
+        !(code = elf_vaddr (&img, sym->st_value, &avail)) ||
+        (avail < sym->st_size)) {
+        elf_unmap (&img);
+        return NULL;
+    }
+    start = sym->st_value;
+    len = sym->st_size;
+
+    cfg = arena_alloc (a, sizeof (struct elf_cfg));
+    memset (cfg, 0, sizeof (struct elf_cfg));
+    cfg->start = start;
+    cfg->len = len;
+
+    mark = calloc (len, 1);
+    // each leader is queued once, and each jcc's fall through once more
+    work = malloc ((2 * len + 1) * sizeof (size_t));
+    if (!mark || !work) {
+        fprintf (stderr, "fossa: elf_get_cfg(): Not enough memory\n");
+        exit (1);
+    }
+
+    // Decode along every path from the entry point, marking where the
+    // instructions and blocks start.  The exits are only counted here
+    work[nwork++] = 0;
+    mark[0] |= ELF_CFG_LEADER;
+    while (nwork) {
+        off = work[--nwork];
+        for (;;) {
+            if (off >= len) {
+                // ran off the end of the function
+                cfg->incomplete = 1;
+                break;
+            }
+            if (mark[off] & ELF_CFG_INSN) {
+                mark[off] |= ELF_CFG_LEADER;
+                break;
+            }
+
+            n = x86_decode (code + off, len - off, start + off, bits, &insn);
+            if (!n) {
+                cfg->incomplete = 1;
+                mark[off] |= ELF_CFG_INSN | ELF_CFG_END;
+                break;
+            }
+            mark[off] |= ELF_CFG_INSN;
+
+            if (insn.flow == X86_NEXT ||
+                ((insn.flow == X86_CALL || insn.flow == X86_CALL_IND) &&
+                 !elf_call_noreturn (&img, &insn, bits))) {
+                off += n;
+                continue;
+            }
+
+            mark[off] |= ELF_CFG_END;
+            t = insn.target - start;
+            switch (insn.flow) {
+            case X86_JCC:
+                if (off + n < len) {
+                    mark[off + n] |= ELF_CFG_LEADER;
+                }
+                work[nwork++] = off + n;
+                // fall through
+            case X86_JMP:
+                if (t < len) {
+                    if (!(mark[t] & ELF_CFG_LEADER)) {
+                        mark[t] |= ELF_CFG_LEADER;
+                        work[nwork++] = t;
+                    }
+                } else {
+                    nexits++;
+                }
+                break;
+            case X86_JMP_IND:
+                cfg->incomplete = 1;
+                nexits++;
+                break;
+            case X86_TRAP:
+                break;
+            default:
+                // ret, or a call that doesn't come back
+                nexits++;
+                break;
+            }
+            break;
+        }
+    }
+
+    // One block per leader, running to the last instruction before the
+    // next leader (or a gap in the code, or an instruction ending it)
+    for (off=0; off<len; off++) {
+        cfg->nblocks += ((mark[off] & (ELF_CFG_INSN | ELF_CFG_LEADER)) ==
+                         (ELF_CFG_INSN | ELF_CFG_LEADER));
+    }
+    cfg->block = arena_alloc (a, (cfg->nblocks + 1) * sizeof (struct elf_block));
+    cfg->exit = arena_alloc (a, (nexits + 1) * sizeof (struct elf_exit));
+
+    cfg->nblocks = 0;
+    for (off=0; off<len; off++) {
+        if ((mark[off] & (ELF_CFG_INSN | ELF_CFG_LEADER)) !=
+            (ELF_CFG_INSN | ELF_CFG_LEADER)) {
+            continue;
+        }
+
+        blk = &cfg->block[cfg->nblocks++];
+        blk->start = start + off;
+        blk->succ[0] = blk->succ[1] = -1;
+        blk->loop_header = 0;
+
+        for (o=off; ; o+=n) {
+            n = x86_decode (code + o, len - o, start + o, bits, &insn);
+            if (!n || (mark[o] & ELF_CFG_END) || (o + n >= len) ||
+                ((mark[o + n] & (ELF_CFG_INSN | ELF_CFG_LEADER)) != ELF_CFG_INSN)) {
+                break;
+            }
+        }
+        blk->last = start + o;
+        blk->end = start + o + (n ? n : 1);
+    }
+
+    // Join the blocks up, and note the exits
+    for (i=0; i<cfg->nblocks; i++) {
+        blk = &cfg->block[i];
+        off = blk->last - start;
+        n = x86_decode (code + off, len - off, blk->last, bits, &insn);
+        if (!n) {
+            continue;
+        }
+
+        // ran into the next block
+        if (!(mark[off] & ELF_CFG_END)) {
+            blk->succ[0] = elf_cfg_block (cfg, blk->end);
+            continue;
+        }
+
+        switch (insn.flow) {
+        case X86_JCC:
+            blk->succ[0] = elf_cfg_block (cfg, blk->end);
+            if (insn.target - start < len) {
+                blk->succ[1] = elf_cfg_block (cfg, insn.target);
+            } else {
+                elf_cfg_exit (cfg, nexits, blk->last, ELF_EXIT_TAIL);
+            }
+            break;
+        case X86_JMP:
+            if (insn.target - start < len) {
+                blk->succ[0] = elf_cfg_block (cfg, insn.target);
+            } else {
+                elf_cfg_exit (cfg, nexits, blk->last, ELF_EXIT_TAIL);
+            }
+            break;
+        case X86_JMP_IND:
+            elf_cfg_exit (cfg, nexits, blk->last, ELF_EXIT_JMP_IND);
+            break;
+        case X86_RET:
+            elf_cfg_exit (cfg, nexits, blk->last, ELF_EXIT_RET);
+            break;
+        case X86_CALL:
+        case X86_CALL_IND:
+            elf_cfg_exit (cfg, nexits, blk->last, ELF_EXIT_NORETURN);
+            break;
+        default:
+            break;
+        }
+    }
+
+    elf_cfg_loops (a, cfg);
+
+    free (mark);
+    free (work);
+    elf_unmap (&img);
+
+    return cfg;
+}
@@ -19,11 +19,54 @@
 #define _elf_tools_h_
 
 #include "fossa.h"
+#include "arena.h"
+
+// How control can leave a function
+enum elf_exit_kind {
+    ELF_EXIT_RET,           /* ret                                    */
+    ELF_EXIT_TAIL,          /* jmp or jcc to outside the function     */
+    ELF_EXIT_JMP_IND,       /* jmp *r/m: may or may not leave         */
+    ELF_EXIT_NORETURN       /* call to exit(), abort() and the like   */
+};
+
+struct elf_exit {
+    Elf_Addr addr;          /* of the instruction control leaves by   */
+    enum elf_exit_kind kind;
+};
+
+// A basic block: the instructions from start up to end, the last one
+// at last.  Successors are indices into elf_cfg.block, -1 for none:
+// succ[0] is the fall through (or the jmp target), succ[1] the jcc
+// target.
+struct elf_block {
+    Elf_Addr start;
+    Elf_Addr end;
+    Elf_Addr last;
+    int succ[2];
+    int loop_header;        /* the target of a back edge              */
+};
+
+// A function's control flow graph, as decoded from the ELF file
+struct elf_cfg {
+    Elf_Addr start;
+    Elf_Addr len;
+    struct elf_block *block;    /* sorted by start, entry block first */
+    int nblocks;
+    struct elf_exit *exit;
+    int nexits;
+    Elf_Addr *loop;             /* loop header addresses              */
+    int nloops;
+    int incomplete;         /* some code couldn't be followed (indirect
+                               jump, didn't decode, ran off the end)  */
+};
 
 u_char*
 elf_load (char* elf_file);
 
-void
+int
 elf_get_func (char* elf_file, const char *func_name, Elf_Addr *func_start, Elf_Addr *func_len);
 
+struct elf_cfg*
+elf_get_cfg (struct arena *a, char *elf_file, const char *func_name);
+
 #endif /*#ifndef _elf_tools_h_ */
@@ -18,32 +18,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include "fossa.h"
 #include "options.h"
 #include "ptrace_wrap.h"
-#include "elf_tools.h"
 #include "child_tools.h"
-#include "inject.h"
 #include "hash.h"
-
-// TODO: Add for-loop detection to step_till_ret()
-//       for programmers who like to put large
-//       cuda memory initialization loops right
-//       there in main()  (cough... CUDA SDK)
+#include "agent.h"
+#include "session.h"
+#include "daemon.h"
+#include "bench.h"
+#include "stats.h"
+#include "isolate.h"
+#include "batch.h"
 
 
 //#define DEBUG
 
-struct toolbox {
-    Elf_Addr start;
-    Elf_Addr end;
-    Elf_Addr set_project;
-    Elf_Addr set_plan;
-    Elf_Addr set_tuner;
-    Elf_Addr check_plan;
-};
-
 #if defined (DEBUG)
 void
 dbg_step_print (pid_t pid, int i)
@@ -64,260 +58,127 @@ dbg_step_print (pid_t pid, int i)
 #endif
 
 
-void
-set_mode (struct fossa_options* opt, int planless)
-{
-    // NOTE
-    // planless = 0     ( a plan exists)
-    // planless = 1     (no plan exists)
-    // opt->mode = 0    (CUZMEM_RUN)
-    // opt->mode = 1    (CUZMEM_TUNE)
-
-    // no plan and run mode?  no sir!
-    if (planless && (opt->mode == 0)) {
-        printf (
-            "---------------------------------------------------------------------------\n"
-            "  fossa does not have an optimized memory configuration for `%s'\n"
-            "  Performance may be poor.  Run fossa in tune mode (--tune) to optimize \n"
-            "---------------------------------------------------------------------------\n\n",
-            opt->child_prg
-        );
-        sleep (1);
-        opt->tuner = 0;     // use "no tune" tuner
-        opt->mode = 1;      // enter tuning mode
-    }
-    // we want to tune and we already have a plan
-    else if (!planless && (opt->mode == 1)) {
-        opt->mode = 1;
-    }
-    // are planless, want to tune?  ok
-    // not planless, want to run? ok, same thing
-    else {
-        opt->mode = planless;
-    }
-}
-
-
-void
-init_main (pid_t pid, Elf_Addr *main_start)
+// fossa --agent: nothing is traced.  Tell the agent what the tracer
+// would have injected and become the child
+static int
+fossa_agent (struct fossa_options *opt, char **envp)
 {
-    int found=0;
-    long old_opcode, eip;
-    unsigned char tmp_opcode[8];
-
-    // set breakpoint @ start of main() prologue
-    old_opcode = pt_set_breakpoint (pid, *main_start);
-
-    // run to breakpoint
-    pt_continue (pid);
-
-    // remove the breakpoint
-    pt_rm_breakpoint (pid, old_opcode);
-
-#if _arch_x86_64_
-    (*main_start)++;
-#endif
-}
-
-
-Elf_Addr
-step_till_ret (pid_t pid)
-{
-    unsigned char opcode;
-    long inst = 0x00;
-    long old_inst;
-    long eip;
-
-    while (opcode != 0xc3) {
-        eip = pt_get_eip (pid);
-        inst = pt_get_instruction (pid);
-        opcode = (unsigned char)inst;
-//        fprintf (stderr, "%lx: %lx\n", eip, opcode);
-//        sleep (1);
-
-        // next opcode is call (don't step into, step over)
-        // the call instruction is 5 bytes
-        if (opcode == 0xe8) {
-//            fprintf (stderr, "stepping over\n");
-            pt_stepover (pid, 5);
-        }
-        // also deal with calls to register contents
-        // these are usually dlsym calls such as: call *%eax
-        // these call instructions are just 2 bytes
-        else if (opcode == 0xff) {
-            opcode = (unsigned char)(inst >> 8);
-            if ( (opcode == 0xd0) ||    /*  call *%eax   */
-                 (opcode == 0xd3) ||    /*  call *%ebx   */
-                 (opcode == 0xd1) ||    /*  call *%ecx   */
-                 (opcode == 0xd2) ||    /*  call *%edx   */
-                 (opcode == 0x10) ||    /*  call *(%eax) */
-                 (opcode == 0x13) ||    /*  call *(%ebx) */
-                 (opcode == 0x11) ||    /*  call *(%ecx) */
-                 (opcode == 0x12) ||    /*  call *(%edx) */
-                 (opcode == 0x18) ||    /* lcall *(%eax) */
-                 (opcode == 0x1b) ||    /* lcall *(%ebx) */
-                 (opcode == 0x19) ||    /* lcall *(%ecx) */
-                 (opcode == 0x1a)       /* lcall *(%edx) */
-               )
-            {
-//                fprintf (stderr, "stepping over\n");
-                pt_stepover (pid, 2);
-            }
-        }
-        else if (opcode != 0xc3) {
-            pt_singlestep (pid);
-        }
-        else if (opcode == 0xc3) {
-            // replace ret with int3
-            eip = pt_get_eip (pid);
-            pt_set_breakpoint (pid, eip);
-            return eip;
-        }
-        else {
-            fprintf (stderr, "execution path tracer is confused (?!) quitting...\n\n");
-            exit (1);
-        }
-    }
-
-    return 0;
-}
-
+    char project[FILENAME_MAX + 32], plan[128], mode[32], tuner[32];
+    char *agent_env[] = { project, plan, mode, tuner, NULL };
+    char *plan_hash = hash (opt);
+
+    snprintf (project, sizeof (project), AGENT_ENV_PROJECT "=fossa/%s",
+              opt->child_prg);
+    snprintf (plan, sizeof (plan), AGENT_ENV_PLAN "=%s", plan_hash);
+    snprintf (mode, sizeof (mode), AGENT_ENV_MODE "=%u", opt->mode);
+    snprintf (tuner, sizeof (tuner), AGENT_ENV_TUNER "=%u", opt->tuner);
+    free (plan_hash);
 
-struct toolbox*
-create_toolbox (pid_t pid)
-{
-    struct toolbox* tbox = malloc (sizeof (struct toolbox));
-
-    printf ("fossa: Searching child's symbol table for instruments... ");
-    tbox->start       = child_dlsym (pid, "cuzmem_start"       , "libcuzmem.so");
-    tbox->end         = child_dlsym (pid, "cuzmem_end"         , "libcuzmem.so");
-    tbox->set_project = child_dlsym (pid, "cuzmem_set_project" , "libcuzmem.so");
-    tbox->set_plan    = child_dlsym (pid, "cuzmem_set_plan"    , "libcuzmem.so");
-    tbox->set_tuner   = child_dlsym (pid, "cuzmem_set_tuner"   , "libcuzmem.so");
-    tbox->check_plan  = child_dlsym (pid, "cuzmem_check_plan"  , "libcuzmem.so");
-
-    if ( (!tbox->start)       ||
-         (!tbox->end)         ||
-         (!tbox->set_project) ||
-         (!tbox->set_plan)    ||
-         (!tbox->set_tuner)   ||
-         (!tbox->check_plan) )
-    {
-        printf ("FAILED!\n\n");
-        printf ("  Please make sure libcuzmem.so (included with fossa) is in your\n"
-                "  library path and is locatable by ld.so\n\n");
-        exit (1);
+    if (isolate_prep (opt, stderr) < 0) {
+        return 1;
     }
 
-    printf ("success.\n");
+    child_exec_agent (opt->child_argv, envp, opt, agent_env);
 
-    return tbox;
+    fprintf (stderr, "fossa: cannot run `%s': %s\n", opt->child_prg,
+             strerror (errno));
+    return 1;
 }
 
 
 int
 main (int argc, char* argv[], char* envp[])
 {
-    pid_t pid;
-    int i, iter, planless;
-    char* plan_hash;
-    int tuning = 1;
-    char project[FILENAME_MAX];
-    Elf_Addr main_start, ret_addr;
+    int ret, timeout;
+    sigset_t chld;
+    struct timespec ts;
     struct fossa_options opt;
-    struct toolbox* tbox;
-    struct code_injection *inj_start, *inj_end,
-                          *inj_set_project, *inj_set_plan,
-                          *inj_check_plan, *inj_set_tuner;
+    struct session *sess;
+    struct pt_event ev;
 
 
-    opt.mode = 0;       // make run mode the default mode
-    opt.tuner = 1;      // genetic tuner is default
-    opt.oom_adj = 0;
+    init_options (&opt);
 
     // initialization
     parse_cmdline (&opt, argc, argv);
-    elf_get_func (opt.child_argv[0], "main", &main_start, NULL);
-    pid = child_fork (opt.child_argv, envp, opt.oom_adj);
-    init_main (pid, &main_start);
-    tbox = create_toolbox (pid);
-    plan_hash = hash (&opt);
-
-    // setup project directory for this child program
-    sprintf (project, "fossa/%s", opt.child_prg);
-
-    // launch check_plan injection to see if this program has a plan
-    inj_check_plan  = inject_build_checkplan (tbox->check_plan, project, plan_hash);
-    planless = inject (pid, main_start, inj_check_plan);
-
-    // adjust the operation mode based on plan status
-    set_mode (&opt, planless);
-
-    // build the rest of the injections
-    inj_start       = inject_build_start     (tbox->start, opt.mode);
-    inj_end         = inject_build_end       (tbox->end);
-    inj_set_project = inject_build_prjpln    (tbox->set_project, project);
-    inj_set_plan    = inject_build_prjpln    (tbox->set_plan, plan_hash);
-    inj_set_tuner   = inject_build_settuner  (tbox->set_tuner, opt.tuner);
-    free (plan_hash);
 
-    // set the plan, the project, and the tuner
-    inject (pid, main_start, inj_set_project);
-    inject (pid, main_start, inj_set_plan);
-    inject (pid, main_start, inj_set_tuner);
+    if (opt.daemon_sock) {
+        return fossa_daemon (opt.daemon_sock);
+    }
 
+    if (opt.bench) {
+        return fossa_bench (opt.bench);
+    }
 
-    iter=0;
-    while (tuning) {
-        if (opt.mode == 1 && opt.tuner != 0) {
-            printf ("fossa: Tuning Iteration: %03i\n", iter);
-            printf ("----------------------------\n", iter);
-        }
+    if (opt.agent) {
+        return fossa_agent (&opt, envp);
+    }
 
-        // inject the start()
-        inject (pid, main_start, inj_start);
+    if (opt.submit_sock) {
+        return fossa_submit (opt.submit_sock, &opt, envp);
+    }
+
+    if (opt.stats_path) {
+        stats_enable ();
+    }
 
-        // resume the child
-        // it will run until it hits the int3 @ end of main()
-        if (iter == 0) {
-            ret_addr = step_till_ret (pid);
-        } else {
-            pt_continue (pid);
+    if (opt.batch) {
+        ret = fossa_batch (&opt, argc, argv, envp);
+        if (opt.stats_path) {
+            stats_print (stderr);
+            stats_write_json (opt.stats_path);
         }
+        return ret;
+    }
 
-        // hit int3 @ end of main()
-        // move PC back to start of main() so that we can
-        // be sure we have enough room to inject code :-)
-        pt_set_eip (pid, main_start);
+    // fossa shares the child's CPUs, so it doesn't disturb anyone else
+    // (and its own wake-ups land where the child's caches are)
+    if (isolate_pin (0, &opt, stderr) < 0) {
+        return 1;
+    }
 
-        // now, we inject the end() call
-        tuning = inject (pid, main_start, inj_end);
+    // launch the child and follow it through
+    // check_plan, set_*, start, main(), end
+    sess = session_create (&opt, envp, stdout);
+    if (!sess) {
+        return 1;
+    }
 
-        if (!tuning) {
-            // we are done.
-            // remove the int3 @ the end of main()
-            if (opt.mode == 1 && opt.tuner != 0) {
-                printf ("fossa: Tuning Complete\n");
+    // with a pass being timed, the wait for the child is bounded: its
+    // stops are then also taken as SIGCHLDs, which the child launched
+    // must not have blocked
+    sigemptyset (&chld);
+    sigaddset (&chld, SIGCHLD);
+    sigprocmask (SIG_BLOCK, &chld, NULL);
+
+    // once fossa lets go of the child, it is still ours to wait for:
+    // its exit status is fossa's.  With --fork, the child being driven
+    // changes from pass to pass
+    while (sess->state != SESSION_DONE) {
+        timeout = session_timeout (sess);
+        if (sess->state == SESSION_DONE) {
+            break;
+        }
+        if (timeout >= 0) {
+            if (!pt_poll (&ev)) {
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000000;
+                sigtimedwait (&chld, NULL, &ts);
+                continue;
             }
-
-            // jump back just after the breakpoint
-            pt_set_eip (pid, ret_addr+1);
-
-            // restore main() ret instruction & rewind eip
-            pt_rm_breakpoint (pid, 0xc3);
-
-            // let main() return
-            pt_detach (pid);
+        } else if (pt_wait (-1, &ev) < 0) {
+            break;
         }
-
-        iter++;
+        session_event (sess, &ev);
     }
 
+    ret = sess->status;
+    session_destroy (sess);
 
-    inject_destroy (inj_start);
-    inject_destroy (inj_end);
-    free (tbox);
+    if (opt.stats_path) {
+        stats_print (stderr);
+        stats_write_json (opt.stats_path);
+    }
 
-    return 0;
+    return ret;
 }
-
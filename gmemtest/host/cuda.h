@@ -0,0 +1,73 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Host-memory stand-in for the CUDA runtime, for boxes without a GPU:
+// just enough of it for the check programs, and for fossa to be run
+// against them (--jobs included) on any machine.  "Device" memory is
+// malloc()ed and capped at FOSSA_CUDART_MEM bytes (1 GiB if unset).
+#ifndef _cuda_h_
+#define _cuda_h_
+
+#include <stddef.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    cudaSuccess = 0,
+    cudaErrorMemoryAllocation = 2,
+    cudaErrorInvalidValue = 11,
+    cudaErrorInvalidDevice = 10,
+    cudaErrorInvalidDevicePointer = 17
+} cudaError_t;
+
+enum cudaMemcpyKind {
+    cudaMemcpyHostToHost = 0,
+    cudaMemcpyHostToDevice = 1,
+    cudaMemcpyDeviceToHost = 2,
+    cudaMemcpyDeviceToDevice = 3,
+    cudaMemcpyDefault = 4
+};
+
+typedef void* cudaStream_t;
+
+cudaError_t cudaMalloc (void** ptr, size_t size);
+cudaError_t cudaFree (void* ptr);
+cudaError_t cudaMallocHost (void** ptr, size_t size);
+cudaError_t cudaFreeHost (void* ptr);
+cudaError_t cudaMemcpy (void* dst, const void* src, size_t count,
+                        enum cudaMemcpyKind kind);
+cudaError_t cudaMemcpyAsync (void* dst, const void* src, size_t count,
+                             enum cudaMemcpyKind kind, cudaStream_t stream);
+cudaError_t cudaMemset (void* ptr, int value, size_t count);
+cudaError_t cudaMemGetInfo (size_t* free, size_t* total);
+cudaError_t cudaGetDeviceCount (int* count);
+cudaError_t cudaSetDevice (int device);
+cudaError_t cudaGetDevice (int* device);
+cudaError_t cudaDeviceSynchronize (void);
+cudaError_t cudaThreadSynchronize (void);
+cudaError_t cudaDeviceReset (void);
+cudaError_t cudaGetLastError (void);
+cudaError_t cudaPeekAtLastError (void);
+const char* cudaGetErrorString (cudaError_t error);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif
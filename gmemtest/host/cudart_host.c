@@ -0,0 +1,266 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The CUDA runtime stand-in (see cuda.h).  How much "device" memory is
+// in use is kept in a shared mapping made when the library is loaded,
+// so that the fork()s fossa --fork/--jobs makes of a program all draw
+// on the one device, as they would on a GPU.
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cuda.h"
+
+#define CUDART_HOST_MEM (1UL << 30)
+
+// every allocation carries its size in front of it
+struct block {
+    size_t size;
+    size_t pad;
+};
+
+static volatile size_t *used;
+static size_t total = CUDART_HOST_MEM;
+static cudaError_t last_error = cudaSuccess;
+
+
+static void __attribute__ ((constructor))
+cudart_host_init (void)
+{
+    char *mem = getenv ("FOSSA_CUDART_MEM");
+
+    if (mem && strtoul (mem, NULL, 0)) {
+        total = strtoul (mem, NULL, 0);
+    }
+
+    used = mmap (NULL, sizeof (*used), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (used == MAP_FAILED) {
+        used = NULL;
+    }
+}
+
+
+static cudaError_t
+cudart_host_error (cudaError_t error)
+{
+    if (error != cudaSuccess) {
+        last_error = error;
+    }
+    return error;
+}
+
+
+cudaError_t
+cudaMalloc (void** ptr, size_t size)
+{
+    struct block *b;
+
+    if (!ptr) {
+        return cudart_host_error (cudaErrorInvalidValue);
+    }
+    *ptr = NULL;
+
+    if (!used) {
+        return cudart_host_error (cudaErrorMemoryAllocation);
+    }
+
+    if (__sync_add_and_fetch (used, size) > total) {
+        __sync_sub_and_fetch (used, size);
+        return cudart_host_error (cudaErrorMemoryAllocation);
+    }
+
+    b = malloc (sizeof (struct block) + size);
+    if (!b) {
+        __sync_sub_and_fetch (used, size);
+        return cudart_host_error (cudaErrorMemoryAllocation);
+    }
+    b->size = size;
+    *ptr = b + 1;
+
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaFree (void* ptr)
+{
+    struct block *b;
+
+    if (!ptr) {
+        return cudaSuccess;
+    }
+
+    b = (struct block*)ptr - 1;
+    __sync_sub_and_fetch (used, b->size);
+    free (b);
+
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaMallocHost (void** ptr, size_t size)
+{
+    if (!ptr) {
+        return cudart_host_error (cudaErrorInvalidValue);
+    }
+
+    *ptr = malloc (size);
+    if (!*ptr) {
+        return cudart_host_error (cudaErrorMemoryAllocation);
+    }
+
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaFreeHost (void* ptr)
+{
+    free (ptr);
+    return cudaSuccess;
+}
+
+
+// host and "device" share an address space, so every kind of copy is
+// the same copy
+cudaError_t
+cudaMemcpy (void* dst, const void* src, size_t count, enum cudaMemcpyKind kind)
+{
+    if (count && (!dst || !src)) {
+        return cudart_host_error (cudaErrorInvalidValue);
+    }
+
+    memmove (dst, src, count);
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaMemcpyAsync (void* dst, const void* src, size_t count,
+                 enum cudaMemcpyKind kind, cudaStream_t stream)
+{
+    return cudaMemcpy (dst, src, count, kind);
+}
+
+
+cudaError_t
+cudaMemset (void* ptr, int value, size_t count)
+{
+    if (count && !ptr) {
+        return cudart_host_error (cudaErrorInvalidDevicePointer);
+    }
+
+    memset (ptr, value, count);
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaMemGetInfo (size_t* free, size_t* total_mem)
+{
+    size_t in_use = used ? *used : total;
+
+    *free = (in_use < total) ? total - in_use : 0;
+    *total_mem = total;
+
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaGetDeviceCount (int* count)
+{
+    *count = 1;
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaSetDevice (int device)
+{
+    if (device != 0) {
+        return cudart_host_error (cudaErrorInvalidDevice);
+    }
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaGetDevice (int* device)
+{
+    *device = 0;
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaDeviceSynchronize (void)
+{
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaThreadSynchronize (void)
+{
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaDeviceReset (void)
+{
+    return cudaSuccess;
+}
+
+
+cudaError_t
+cudaGetLastError (void)
+{
+    cudaError_t error = last_error;
+
+    last_error = cudaSuccess;
+    return error;
+}
+
+
+cudaError_t
+cudaPeekAtLastError (void)
+{
+    return last_error;
+}
+
+
+const char*
+cudaGetErrorString (cudaError_t error)
+{
+    switch (error) {
+    case cudaSuccess:
+        return "no error";
+    case cudaErrorMemoryAllocation:
+        return "out of memory";
+    case cudaErrorInvalidValue:
+        return "invalid argument";
+    case cudaErrorInvalidDevice:
+        return "invalid device ordinal";
+    case cudaErrorInvalidDevicePointer:
+        return "invalid device pointer";
+    }
+    return "unknown error";
+}
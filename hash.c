@@ -43,6 +43,13 @@ hash (struct fossa_options *opt)
         strcat (input, " ");
     }
 
+    // a plan for one function is no plan for all of main()
+    // (C++ names get long: keep to what input has room for)
+    if (opt->roi) {
+        strncat (input, "--roi ", sizeof (input) - strlen (input) - 1);
+        strncat (input, opt->roi, sizeof (input) - strlen (input) - 1);
+    }
+
     // Length of message to hash
     input_len = strlen (input);
 
@@ -22,7 +22,9 @@
 
 #include "fossa.h"
 #include "ptrace_wrap.h"
+#include "arena.h"
 #include "inject.h"
+#include "x86_decode.h"
 
 //#define DEBUG
 
@@ -59,11 +61,11 @@ patch_addr (unsigned char* buf, long addr)
 
 
 struct code_injection*
-inject_build_start (Elf_Addr addr, unsigned int mode)
+inject_build_start (struct arena *a, Elf_Addr addr, unsigned int mode)
 {
     struct code_injection *inject;
 
-    inject = malloc (sizeof (struct code_injection));
+    inject = arena_alloc (a, sizeof (struct code_injection));
 
     inject->returns = 0;
 #if _arch_i386_
@@ -77,7 +79,7 @@ inject_build_start (Elf_Addr addr, unsigned int mode)
 #endif
 
     inject->size = inject->length * sizeof (unsigned char);
-    inject->code = malloc (inject->size);
+    inject->code = arena_alloc (a, inject->size);
 
 #if _arch_i386_
     memcpy (inject->code, 
@@ -87,7 +89,7 @@ inject_build_start (Elf_Addr addr, unsigned int mode)
         "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx */
         "\xff\xd3"                      /* call   *%ebx             */
         "\xcc",                         /* int3                     */
-        inject->size
+        inject->length
     );
     *(inject->code + 11) = (unsigned char)(mode & 0xFF);
 #elif _arch_x86_64_
@@ -99,7 +101,7 @@ inject_build_start (Elf_Addr addr, unsigned int mode)
         "\xbf\x01\x00\x00\x00"          /* mov    $0x1, %edi             */
         "\xff\xd0"                      /* callq  *%rax                  */
         "\xcc",                         /* int3                          */
-        inject->size
+        inject->length
     );
     *(inject->code + 16) = (unsigned char)(mode & 0xFF);
 #endif
@@ -111,11 +113,11 @@ inject_build_start (Elf_Addr addr, unsigned int mode)
 
 
 struct code_injection*
-inject_build_end (Elf_Addr addr)
+inject_build_end (struct arena *a, Elf_Addr addr)
 {
     struct code_injection *inject;
 
-    inject = malloc (sizeof (struct code_injection));
+    inject = arena_alloc (a, sizeof (struct code_injection));
 
     inject->returns = 1;        /* does injection return a value? */
 #if _arch_i386_                 /****** i386 CODE ATTRIBUTES ******/
@@ -129,14 +131,14 @@ inject_build_end (Elf_Addr addr)
 #endif                          /**********************************/
 
     inject->size = inject->length * sizeof (unsigned char);
-    inject->code = malloc (inject->size);
+    inject->code = arena_alloc (a, inject->size);
 
 #if _arch_i386_
     memcpy (inject->code, 
         "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx */
         "\xff\xd3"                      /* call   *%ebx             */
         "\xcc",                         /* int3                     */
-        inject->size
+        inject->length
     );
 #elif _arch_x86_64_
     memcpy (inject->code, 
@@ -145,7 +147,7 @@ inject_build_end (Elf_Addr addr)
         "\x78\x56\x34\x12"
         "\xff\xd0"                      /* callq  *%rax                  */
         "\xcc",                         /* int3                          */
-        inject->size
+        inject->length
     );
 #endif
 
@@ -155,24 +157,16 @@ inject_build_end (Elf_Addr addr)
 }
 
 
-void
-inject_destroy (struct code_injection* inj)
-{
-    free (inj->code);
-    free (inj);
-}
-
-
 // cuzmem_set_project () and cuzmem_set_plan() share the
 // exact same calling convention, so we can resuse this
 // for both
 struct code_injection*
-inject_build_prjpln (Elf_Addr addr, char* name)
+inject_build_prjpln (struct arena *a, Elf_Addr addr, char* name)
 {
     struct code_injection *inject;
     unsigned int str_len = strlen (name)+1;
 
-    inject = malloc (sizeof (struct code_injection));
+    inject = arena_alloc (a, sizeof (struct code_injection));
 
     inject->returns = 0;        /* does injection return a value? */
 #if _arch_i386_                 /****** i386 CODE ATTRIBUTES ******/
@@ -187,7 +181,7 @@ inject_build_prjpln (Elf_Addr addr, char* name)
 
     // leave room to tack the string onto the end of the machine code
     inject->size = (inject->length + str_len) * sizeof (unsigned char);
-    inject->code = malloc (inject->size);
+    inject->code = arena_alloc (a, inject->size);
 
     // NOTE: in inject() I pass the program counter into eax/rax in
     //       order to make this simple
@@ -198,7 +192,7 @@ inject_build_prjpln (Elf_Addr addr, char* name)
         "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx   */
         "\xff\xd3"                      /* call   *%ebx               */
         "\xcc",                         /* int3                       */
-        inject->size
+        inject->length
     );
 #elif _arch_x86_64_
     memcpy (inject->code, 
@@ -208,7 +202,7 @@ inject_build_prjpln (Elf_Addr addr, char* name)
         "\x78\x56\x34\x12"
         "\xff\xd0"                      /* callq  *%rax                  */
         "\xcc",                         /* int3                          */
-        inject->size
+        inject->length
     );
 #endif
 
@@ -224,15 +218,30 @@ inject_build_prjpln (Elf_Addr addr, char* name)
 }
 
 
+// cuzmem_save (path), cuzmem_load (path): the same call as
+// cuzmem_set_project()'s, but the tuner says whether it went well
+struct code_injection*
+inject_build_path (struct arena *a, Elf_Addr addr, char* path)
+{
+    struct code_injection *inject;
+
+    inject = inject_build_prjpln (a, addr, path);
+    inject->returns = 1;
+
+    return inject;
+}
+
+
 struct code_injection*
-inject_build_checkplan (Elf_Addr addr, char* proj, char* plan)
+inject_build_checkplan (struct arena *a, Elf_Addr addr,
+                        char* proj, char* plan)
 {
     struct code_injection *inject;
     unsigned int proj_len = strlen (proj)+1;
     unsigned int plan_len = strlen (plan)+1;
     unsigned int str_len = proj_len + plan_len;
 
-    inject = malloc (sizeof (struct code_injection));
+    inject = arena_alloc (a, sizeof (struct code_injection));
 
     inject->returns = 1;        /* does injection return a value? */
 #if _arch_i386_                 /****** i386 CODE ATTRIBUTES ******/
@@ -247,7 +256,7 @@ inject_build_checkplan (Elf_Addr addr, char* proj, char* plan)
 
     // leave room to tack the string onto the end of the machine code
     inject->size = (inject->length + str_len) * sizeof (unsigned char);
-    inject->code = malloc (inject->size);
+    inject->code = arena_alloc (a, inject->size);
 
     // NOTE: in inject() I pass the program counter into eax/rax in
     //       order to make this simple
@@ -260,7 +269,7 @@ inject_build_checkplan (Elf_Addr addr, char* proj, char* plan)
         "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx   */
         "\xff\xd3"                      /* call   *%ebx               */
         "\xcc",                         /* int3                       */
-        inject->size
+        inject->length
     );
     *(inject->code + 5) = inject->length + proj_len;
 #elif _arch_x86_64_
@@ -272,7 +281,7 @@ inject_build_checkplan (Elf_Addr addr, char* proj, char* plan)
         "\x78\x56\x34\x12"
         "\xff\xd0"                      /* callq  *%rax                  */
         "\xcc",                         /* int3                          */
-        inject->size
+        inject->length
     );
     *(inject->code + 7) = inject->length + proj_len+1;
 #endif
@@ -290,11 +299,11 @@ inject_build_checkplan (Elf_Addr addr, char* proj, char* plan)
 
 
 struct code_injection*
-inject_build_settuner (Elf_Addr addr, unsigned int tuner)
+inject_build_settuner (struct arena *a, Elf_Addr addr, unsigned int tuner)
 {
     struct code_injection *inject;
 
-    inject = malloc (sizeof (struct code_injection));
+    inject = arena_alloc (a, sizeof (struct code_injection));
 
     inject->returns = 0;
 #if _arch_i386_
@@ -308,7 +317,7 @@ inject_build_settuner (Elf_Addr addr, unsigned int tuner)
 #endif
 
     inject->size = inject->length * sizeof (unsigned char);
-    inject->code = malloc (inject->size);
+    inject->code = arena_alloc (a, inject->size);
 
 #if _arch_i386_
     memcpy (inject->code, 
@@ -316,7 +325,7 @@ inject_build_settuner (Elf_Addr addr, unsigned int tuner)
         "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx */
         "\xff\xd3"                      /* call   *%ebx             */
         "\xcc",                         /* int3                     */
-        inject->size
+        inject->length
     );
     *(inject->code + 3) = (unsigned char)(tuner & 0xFF);
 #elif _arch_x86_64_
@@ -327,7 +336,7 @@ inject_build_settuner (Elf_Addr addr, unsigned int tuner)
         "\xbf\xff\x00\x00\x00"          /* mov    $0xff, %edi            */
         "\xff\xd0"                      /* callq  *%rax                  */
         "\xcc",                         /* int3                          */
-        inject->size
+        inject->length
     );
     *(inject->code + 11) = (unsigned char)(tuner & 0xFF);
 #endif
@@ -339,17 +348,326 @@ inject_build_settuner (Elf_Addr addr, unsigned int tuner)
 
 
 
-int
-inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
+// __cxa_atexit (func, NULL, NULL): have the child call func() as it
+// exits, whichever way it gets there.  Returns 0 on success.
+struct code_injection*
+inject_build_atexit (struct arena *a, Elf_Addr addr, Elf_Addr func)
 {
-    int i;
-    int ret;
-    struct user_regs_struct child_regs, tmp_regs;
-    unsigned char *backup = malloc (inject->size);
-    unsigned char *stack = NULL;
+    struct code_injection *inject;
+
+    inject = arena_alloc (a, sizeof (struct code_injection));
+
+    inject->returns = 1;
+#if _arch_i386_
+    inject->length = 31;
+    inject->pidx = 24;
+    inject->nsparms = 3;
+#elif _arch_x86_64_
+    inject->length = 27;
+    inject->pidx = 16;
+    inject->nsparms = 0;
+#endif
+
+    inject->size = inject->length * sizeof (unsigned char);
+    inject->code = arena_alloc (a, inject->size);
+
+#if _arch_i386_
+    memcpy (inject->code, 
+        "\xc7\x04\x24\x78\x56\x34\x12"  /* movl   $0x12345678, (%esp)   */
+        "\xc7\x44\x24\x04\x00\x00\x00"  /* movl   $0x0, 0x4(%esp)       */
+        "\x00"
+        "\xc7\x44\x24\x08\x00\x00\x00"  /* movl   $0x0, 0x8(%esp)       */
+        "\x00"
+        "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx     */
+        "\xff\xd3"                      /* call   *%ebx                 */
+        "\xcc",                         /* int3                         */
+        inject->length
+    );
+    patch_addr (inject->code + 3, func);
+#elif _arch_x86_64_
+    memcpy (inject->code, 
+        "\x48\xbf"                      /* mov $0x1234567812345678, %rdi */
+        "\x78\x56\x34\x12"
+        "\x78\x56\x34\x12"
+        "\x31\xf6"                      /* xor    %esi, %esi             */
+        "\x31\xd2"                      /* xor    %edx, %edx             */
+        "\x48\xb8"                      /* mov $0x1234567812345678, %rax */
+        "\x78\x56\x34\x12"
+        "\x78\x56\x34\x12"
+        "\xff\xd0"                      /* callq  *%rax                  */
+        "\xcc",                         /* int3                          */
+        inject->length
+    );
+    patch_addr (inject->code + 2, func);
+#endif
+
+    patch_addr (inject->code + inject->pidx, addr);
+
+    return inject;
+}
+
+
+// fork (): takes nothing and returns a value, the same as
+// cuzmem_end() does
+struct code_injection*
+inject_build_fork (struct arena *a, Elf_Addr addr)
+{
+    return inject_build_end (a, addr);
+}
+
+
+// cuzmem_report (candidate, score): tell the tuner how a candidate did
+struct code_injection*
+inject_build_report (struct arena *a, Elf_Addr addr, int candidate,
+                     int score)
+{
+    struct code_injection *inject;
+
+    inject = arena_alloc (a, sizeof (struct code_injection));
+
+    inject->returns = 0;
+#if _arch_i386_
+    inject->length = 23;
+    inject->pidx = 16;
+    inject->nsparms = 2;
+#elif _arch_x86_64_
+    inject->length = 23;
+    inject->pidx = 12;
+    inject->nsparms = 0;
+#endif
+
+    inject->size = inject->length * sizeof (unsigned char);
+    inject->code = arena_alloc (a, inject->size);
+
+#if _arch_i386_
+    memcpy (inject->code, 
+        "\xc7\x04\x24\x78\x56\x34\x12"  /* movl   $0x12345678, (%esp)   */
+        "\xc7\x44\x24\x04\x78\x56\x34"  /* movl   $0x12345678, 0x4(%esp) */
+        "\x12"
+        "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx     */
+        "\xff\xd3"                      /* call   *%ebx                 */
+        "\xcc",                         /* int3                         */
+        inject->length
+    );
+    memcpy (inject->code + 3, &candidate, 4);
+    memcpy (inject->code + 11, &score, 4);
+#elif _arch_x86_64_
+    memcpy (inject->code, 
+        "\xbf\x78\x56\x34\x12"          /* mov    $0x12345678, %edi      */
+        "\xbe\x78\x56\x34\x12"          /* mov    $0x12345678, %esi      */
+        "\x48\xb8"                      /* mov $0x1234567812345678, %rax */
+        "\x78\x56\x34\x12"
+        "\x78\x56\x34\x12"
+        "\xff\xd0"                      /* callq  *%rax                  */
+        "\xcc",                         /* int3                          */
+        inject->length
+    );
+    memcpy (inject->code + 1, &candidate, 4);
+    memcpy (inject->code + 6, &score, 4);
+#endif
+
+    patch_addr (inject->code + inject->pidx, addr);
+
+    return inject;
+}
+
+
+// fflush (NULL): write out whatever the child's stdio has buffered
+struct code_injection*
+inject_build_fflush (struct arena *a, Elf_Addr addr)
+{
+    struct code_injection *inject;
+
+    inject = arena_alloc (a, sizeof (struct code_injection));
+
+    inject->returns = 0;
+#if _arch_i386_
+    inject->length = 15;
+    inject->pidx = 8;
+    inject->nsparms = 1;
+#elif _arch_x86_64_
+    inject->length = 15;
+    inject->pidx = 4;
+    inject->nsparms = 0;
+#endif
+
+    inject->size = inject->length * sizeof (unsigned char);
+    inject->code = arena_alloc (a, inject->size);
+
+#if _arch_i386_
+    memcpy (inject->code, 
+        "\xc7\x04\x24\x00\x00\x00\x00"  /* movl   $0x0, (%esp)      */
+        "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx */
+        "\xff\xd3"                      /* call   *%ebx             */
+        "\xcc",                         /* int3                     */
+        inject->length
+    );
+#elif _arch_x86_64_
+    memcpy (inject->code, 
+        "\x31\xff"                      /* xor    %edi, %edi             */
+        "\x48\xb8"                      /* mov $0x1234567812345678, %rax */
+        "\x78\x56\x34\x12"
+        "\x78\x56\x34\x12"
+        "\xff\xd0"                      /* callq  *%rax                  */
+        "\xcc",                         /* int3                          */
+        inject->length
+    );
+#endif
+
+    patch_addr (inject->code + inject->pidx, addr);
+
+    return inject;
+}
+
+
+// waitpid (-1, NULL, WNOHANG): collect a child that has gone, if any
+struct code_injection*
+inject_build_waitpid (struct arena *a, Elf_Addr addr)
+{
+    struct code_injection *inject;
+
+    inject = arena_alloc (a, sizeof (struct code_injection));
+
+    inject->returns = 1;
+#if _arch_i386_
+    inject->length = 31;
+    inject->pidx = 24;
+    inject->nsparms = 3;
+#elif _arch_x86_64_
+    inject->length = 25;
+    inject->pidx = 14;
+    inject->nsparms = 0;
+#endif
+
+    inject->size = inject->length * sizeof (unsigned char);
+    inject->code = arena_alloc (a, inject->size);
+
+#if _arch_i386_
+    memcpy (inject->code, 
+        "\xc7\x04\x24\xff\xff\xff\xff"  /* movl   $0xffffffff, (%esp)   */
+        "\xc7\x44\x24\x04\x00\x00\x00"  /* movl   $0x0, 0x4(%esp)       */
+        "\x00"
+        "\xc7\x44\x24\x08\x01\x00\x00"  /* movl   $0x1, 0x8(%esp)       */
+        "\x00"
+        "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx     */
+        "\xff\xd3"                      /* call   *%ebx                 */
+        "\xcc",                         /* int3                         */
+        inject->length
+    );
+#elif _arch_x86_64_
+    memcpy (inject->code, 
+        "\xbf\xff\xff\xff\xff"          /* mov    $0xffffffff, %edi      */
+        "\x31\xf6"                      /* xor    %esi, %esi             */
+        "\xba\x01\x00\x00\x00"          /* mov    $0x1, %edx             */
+        "\x48\xb8"                      /* mov $0x1234567812345678, %rax */
+        "\x78\x56\x34\x12"
+        "\x78\x56\x34\x12"
+        "\xff\xd0"                      /* callq  *%rax                  */
+        "\xcc",                         /* int3                          */
+        inject->length
+    );
+#endif
+
+    patch_addr (inject->code + inject->pidx, addr);
+
+    return inject;
+}
+
+
+// malloc (size): a block of the child's own (--zygote).  The pointer
+// comes back whole in the return register, which inject_finish() cuts
+// down to an int, so the caller reads it from there itself
+struct code_injection*
+inject_build_malloc (struct arena *a, Elf_Addr addr, unsigned int size)
+{
+    struct code_injection *inject;
+
+    inject = arena_alloc (a, sizeof (struct code_injection));
+
+    inject->returns = 1;
+#if _arch_i386_
+    inject->length = 15;
+    inject->pidx = 8;
+    inject->nsparms = 1;
+#elif _arch_x86_64_
+    inject->length = 18;
+    inject->pidx = 7;
+    inject->nsparms = 0;
+#endif
+
+    inject->size = inject->length * sizeof (unsigned char);
+    inject->code = arena_alloc (a, inject->size);
+
+#if _arch_i386_
+    memcpy (inject->code, 
+        "\xc7\x04\x24\x78\x56\x34\x12"  /* movl   $0x12345678, (%esp)   */
+        "\xbb\x78\x56\x34\x12"          /* mov    $0x12345678, %ebx     */
+        "\xff\xd3"                      /* call   *%ebx                 */
+        "\xcc",                         /* int3                         */
+        inject->length
+    );
+    memcpy (inject->code + 3, &size, 4);
+#elif _arch_x86_64_
+    memcpy (inject->code, 
+        "\xbf\x78\x56\x34\x12"          /* mov    $0x12345678, %edi      */
+        "\x48\xb8"                      /* mov $0x1234567812345678, %rax */
+        "\x78\x56\x34\x12"
+        "\x78\x56\x34\x12"
+        "\xff\xd0"                      /* callq  *%rax                  */
+        "\xcc",                         /* int3                          */
+        inject->length
+    );
+    memcpy (inject->code + 1, &size, 4);
+#endif
+
+    patch_addr (inject->code + inject->pidx, addr);
+
+    return inject;
+}
+
+
+// Where to plant the injections in a function the child is stopped at
+// the entry of.  On x86_64 a one-byte push %rbp there is left to run
+// ahead of them (inject_begin() lines the stack up for it); anything
+// else, such as an optimized function's first instruction or an
+// endbr64, is written over from the entry on.
+Elf_Addr
+inject_site (pid_t pid, Elf_Addr entry)
+{
+#if _arch_x86_64_
+    unsigned char code[16];
+    struct x86_insn insn;
+
+    if ((pt_read (pid, entry, code, sizeof (code)) == sizeof (code)) &&
+        (x86_decode (code, sizeof (code), entry, 64, &insn) == 1) &&
+        (code[0] == 0x55)) {
+        return entry + 1;
+    }
+#endif
+
+    return entry;
+}
+
+
+// Back up the child's registers and the code at addr, then plant the
+// injection there.  The child is left stopped; once it is resumed it
+// runs the injection up to the int3 at its end, at which point
+// inject_finish() must be called to collect the result and put
+// everything back the way it was.
+void
+inject_begin (pid_t pid, Elf_Addr addr, struct code_injection* inject,
+              struct inject_ctx* ctx)
+{
+    struct user_regs_struct tmp_regs;
+
+    ctx->backup = arena_alloc (ctx->arena, inject->length);
+    ctx->stack = NULL;
 
     // backup registers
-    pt_get_regs (pid, &child_regs);
+    pt_get_regs (pid, &ctx->regs);
+    if (ctx->fp) {
+        pt_get_fpregs (pid, &ctx->fpregs);
+    }
 
 #if _arch_i386_
     // on i386 we use the stack for parameter
@@ -357,17 +675,17 @@ inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
     // TODO: Actually grow the stack for this in the event
     // the program has an empty (or too small) stack
     if (inject->nsparms != 0) {
-        stack = malloc (inject->nsparms * sizeof(Elf_Addr));
-        pt_peek (pid, child_regs.esp, stack, inject->nsparms * sizeof(Elf_Addr));
+        ctx->stack = arena_alloc (ctx->arena, inject->nsparms * sizeof(Elf_Addr));
+        pt_peek (pid, ctx->regs.esp, ctx->stack, inject->nsparms * sizeof(Elf_Addr));
 #if defined (DEBUG)
-        printf ("Stack [esp 0x%08lx]:\n", child_regs.esp);
-        dbg_print_mem (pid, child_regs.esp, inject->nsparms * sizeof(Elf_Addr));
+        printf ("Stack [esp 0x%08lx]:\n", ctx->regs.esp);
+        dbg_print_mem (pid, ctx->regs.esp, inject->nsparms * sizeof(Elf_Addr));
 #endif
     }
 #endif
 
     // backup code we will be replacing
-    pt_peek (pid, addr, backup, inject->length);
+    pt_peek (pid, addr, ctx->backup, inject->length);
 
 #if defined (DEBUG)
     printf ("Backed up:\n");
@@ -376,8 +694,24 @@ inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
 
     // i tend to hide data at the end of injections
     // so, let's pass the program counter into eax
-    // to make relative addressing easier
-    pt_set_eax (pid, pt_get_eip (pid));
+    // to make relative addressing easier.  the offsets
+    // count from addr-1, where the child stands when it
+    // comes in through main()'s push %rbp, so eax gets
+    // that even if the child is stopped at addr itself
+    pt_set_eax (pid, addr - 1);
+
+#if _arch_x86_64_
+    // the SysV ABI wants %rsp 16-byte aligned at our call, or SSE spills
+    // in the callee fault.  if the child enters the injection through
+    // main()'s push %rbp (eip = addr-1), that push moves %rsp one word
+    pt_get_regs (pid, &tmp_regs);
+    if (tmp_regs.rip == addr) {
+        tmp_regs.rsp &= ~0xfUL;
+    } else {
+        tmp_regs.rsp = ((tmp_regs.rsp - 8) & ~0xfUL) + 8;
+    }
+    pt_set_regs (pid, &tmp_regs);
+#endif
 
     // inject
     pt_poke (pid, addr, inject->code, inject->length);
@@ -386,11 +720,17 @@ inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
     printf ("Injected:\n");
     dbg_print_mem (pid, addr, inject->length);
 #endif
+}
 
-    // resume until child hits int3 @ end of injection
-    pt_continue (pid);
 
-    // Note: Child is paused from here until we pt_continue () it
+// The child has hit the int3 at the end of the injection.  Get the
+// injection's return value (if it has one) and restore the child.
+int
+inject_finish (pid_t pid, Elf_Addr addr, struct code_injection* inject,
+               struct inject_ctx* ctx)
+{
+    int ret = 0;
+    struct user_regs_struct tmp_regs;
 
     // get return value from injection (if it returns)
     if (inject->returns) {
@@ -409,15 +749,18 @@ inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
     }
 
     // restore registers
-    pt_set_regs (pid, &child_regs);
+    pt_set_regs (pid, &ctx->regs);
+    if (ctx->fp) {
+        pt_set_fpregs (pid, &ctx->fpregs);
+    }
 
     // restore overwritten code
-    pt_poke (pid, addr, backup, inject->size);
+    pt_poke (pid, addr, ctx->backup, inject->length);
 
     // restore the stack on i386 (32-bit parm passing)
 #if _arch_i386_
     if (inject->nsparms != 0) {
-        pt_poke (pid, child_regs.esp, stack, inject->nsparms * sizeof(Elf_Addr));
+        pt_poke (pid, ctx->regs.esp, ctx->stack, inject->nsparms * sizeof(Elf_Addr));
     }
 #endif
 
@@ -427,12 +770,30 @@ inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
     dbg_print_mem (pid, addr, inject->length);
 #endif
 
-    free (backup);
-    free (stack);
+    ctx->backup = NULL;
+    ctx->stack = NULL;
 
-    if (inject->returns) {
-        return ret;
-    } else {
-        return 0;
-    }
+    return ret;
+}
+
+
+int
+inject (pid_t pid, Elf_Addr addr, struct code_injection* inject)
+{
+    int ret;
+    struct inject_ctx ctx;
+
+    ctx.arena = arena_create (256);
+    ctx.fp = 0;
+    inject_begin (pid, addr, inject, &ctx);
+
+    // resume until child hits int3 @ end of injection
+    pt_continue (pid);
+
+    // Note: Child is paused from here until we pt_continue () it
+
+    ret = inject_finish (pid, addr, inject, &ctx);
+    arena_destroy (ctx.arena);
+
+    return ret;
 }
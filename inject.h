@@ -18,6 +18,10 @@
 #ifndef _inject_h_
 #define _inject_h_
 
+#include <sys/user.h>
+#include "fossa.h"
+#include "arena.h"
+
 struct code_injection {
     unsigned char *code;    /* machine code           */
     unsigned int pidx;      /* index of address patch */
@@ -27,28 +31,73 @@ struct code_injection {
     size_t size;            /* size of machine code   */
 };
 
+// state of an injection that is in flight.  The caller provides the
+// arena the backups are taken from; they are only needed until
+// inject_finish() has put them back.  The floating point registers
+// only need saving when the child is stopped where they may hold
+// arguments or a return value (other than at main()).
+struct inject_ctx {
+    struct user_regs_struct regs;   /* child's registers to restore */
+    unsigned char *backup;          /* code overwritten by us       */
+    unsigned char *stack;           /* stack overwritten (i386)     */
+    struct arena *arena;            /* backups are allocated here   */
+    int fp;                         /* save the x87/SSE regs, too   */
+    struct user_fpregs_struct fpregs;
+};
+
 void
 patch_addr (unsigned char* buf, long addr);
 
 struct code_injection*
-inject_build_start (Elf_Addr addr, unsigned int mode);
+inject_build_start (struct arena *a, Elf_Addr addr, unsigned int mode);
 
 struct code_injection*
-inject_build_end (Elf_Addr addr);
+inject_build_end (struct arena *a, Elf_Addr addr);
 
 struct code_injection*
-inject_build_prjpln (Elf_Addr addr, char* name);
+inject_build_prjpln (struct arena *a, Elf_Addr addr, char* name);
 
 struct code_injection*
-inject_build_checkplan (Elf_Addr addr, char* proj, char* plan);
+inject_build_path (struct arena *a, Elf_Addr addr, char* path);
 
 struct code_injection*
-inject_build_settuner (Elf_Addr addr, unsigned int tuner);
+inject_build_checkplan (struct arena *a, Elf_Addr addr,
+                        char* proj, char* plan);
 
-int
-inject (pid_t pid, Elf_Addr addr, struct code_injection* inject);
+struct code_injection*
+inject_build_settuner (struct arena *a, Elf_Addr addr, unsigned int tuner);
+
+struct code_injection*
+inject_build_atexit (struct arena *a, Elf_Addr addr, Elf_Addr func);
+
+struct code_injection*
+inject_build_fork (struct arena *a, Elf_Addr addr);
+
+struct code_injection*
+inject_build_report (struct arena *a, Elf_Addr addr, int candidate,
+                     int score);
+
+struct code_injection*
+inject_build_fflush (struct arena *a, Elf_Addr addr);
+
+struct code_injection*
+inject_build_waitpid (struct arena *a, Elf_Addr addr);
+
+struct code_injection*
+inject_build_malloc (struct arena *a, Elf_Addr addr, unsigned int size);
+
+Elf_Addr
+inject_site (pid_t pid, Elf_Addr entry);
 
 void
-inject_destroy (struct code_injection* inj);
+inject_begin (pid_t pid, Elf_Addr addr, struct code_injection* inject,
+              struct inject_ctx* ctx);
+
+int
+inject_finish (pid_t pid, Elf_Addr addr, struct code_injection* inject,
+               struct inject_ctx* ctx);
+
+int
+inject (pid_t pid, Elf_Addr addr, struct code_injection* inject);
 
 #endif /* #ifndef _inject_h_ */
@@ -0,0 +1,336 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// What the child is shut away in, so that tuning passes are timed the
+// same from one run to the next, and so that they can't starve the
+// rest of the node: the CPUs (or NUMA node) it may run on, a cgroup v2
+// with cpu.max / memory.max set, and its oom_score_adj.
+//
+// isolate_prep() does what needs doing once, in fossa, and reports
+// what can't be done.  isolate_enter() is then called by the child on
+// itself before it exec()s, and everything it sets is inherited by
+// all the program ever runs (threads, --fork copies and their own).
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "isolate.h"
+
+#define ISOLATE_CGROUP_ROOT "/sys/fs/cgroup"
+
+
+// Parse a CPU list ("0-3,8,10-11", as in /sys) into set
+static int
+isolate_cpulist (const char *list, cpu_set_t *set)
+{
+    char *end;
+    long a, b;
+
+    CPU_ZERO (set);
+
+    while (*list) {
+        a = b = strtol (list, &end, 10);
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            b = strtol (list, &end, 10);
+            if ((end == list) || (b < a)) {
+                return -1;
+            }
+        }
+        if ((a < 0) || (b >= CPU_SETSIZE)) {
+            return -1;
+        }
+        for (; a <= b; a++) {
+            CPU_SET (a, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end && (*end != '\n')) {
+            return -1;
+        } else {
+            break;
+        }
+        list = end;
+    }
+
+    return CPU_COUNT (set) ? 0 : -1;
+}
+
+
+// The CPUs the child is to be kept on: --cpus, or the NUMA node's
+static int
+isolate_cpus (struct fossa_options *opt, cpu_set_t *set)
+{
+    char fn[FILENAME_MAX], list[1024];
+    FILE *fp;
+    int ok;
+
+    if (opt->cpus) {
+        return isolate_cpulist (opt->cpus, set);
+    }
+
+    sprintf (fn, "/sys/devices/system/node/node%i/cpulist", opt->numa_node);
+    fp = fopen (fn, "r");
+    if (!fp) {
+        return -1;
+    }
+    ok = (fgets (list, sizeof (list), fp) != NULL);
+    fclose (fp);
+
+    return ok ? isolate_cpulist (list, set) : -1;
+}
+
+
+// The same, saying what is wrong with them on out
+static int
+isolate_cpus_check (struct fossa_options *opt, cpu_set_t *set, FILE *out)
+{
+    if (isolate_cpus (opt, set) == 0) {
+        return 0;
+    }
+
+    if (opt->cpus) {
+        fprintf (out, "fossa: invalid CPU list `%s'\n", opt->cpus);
+    } else {
+        fprintf (out, "fossa: no CPUs on NUMA node %i\n", opt->numa_node);
+    }
+
+    return -1;
+}
+
+
+// Where the cgroup v2 hierarchy is mounted: /sys/fs/cgroup, unless
+// the node runs a hybrid setup that puts it elsewhere
+static void
+isolate_cgroup_root (char *root, size_t size)
+{
+    char dev[256], dir[FILENAME_MAX], type[64];
+    FILE *fp = fopen ("/proc/self/mounts", "r");
+
+    snprintf (root, size, "%s", ISOLATE_CGROUP_ROOT);
+    if (!fp) {
+        return;
+    }
+
+    while (fscanf (fp, "%255s %4095s %63s %*[^\n]", dev, dir, type) == 3) {
+        if (!strcmp (type, "cgroup2")) {
+            snprintf (root, size, "%s", dir);
+            break;
+        }
+    }
+    fclose (fp);
+}
+
+
+// The --cgroup directory: as given if absolute, else under the root.
+// Returns 0, or -1 (ENAMETOOLONG) if it doesn't fit in path
+static int
+isolate_cgroup_path (struct fossa_options *opt, char *path, size_t size)
+{
+    char root[FILENAME_MAX];
+    int n;
+
+    if (opt->cgroup[0] == '/') {
+        n = snprintf (path, size, "%s", opt->cgroup);
+    } else {
+        isolate_cgroup_root (root, sizeof (root));
+        n = snprintf (path, size, "%s/%s", root, opt->cgroup);
+    }
+
+    if ((n < 0) || (n >= size)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+isolate_write (const char *dir, const char *file, const char *val)
+{
+    char fn[FILENAME_MAX];
+    FILE *fp;
+    int ret;
+
+    snprintf (fn, sizeof (fn), "%s/%s", dir, file);
+    fp = fopen (fn, "w");
+    if (!fp) {
+        return -1;
+    }
+    ret = (fprintf (fp, "%s\n", val) < 0);
+    ret |= (fclose (fp) != 0);
+
+    return ret ? -1 : 0;
+}
+
+
+// Make the cgroup and set its limits.  The controllers they need are
+// switched on in its parent first; if that isn't ours to do, setting
+// the limits fails and says so.
+static int
+isolate_cgroup (struct fossa_options *opt, FILE *out)
+{
+    char path[FILENAME_MAX], parent[FILENAME_MAX], cpu_max[64], *p;
+
+    if ((isolate_cgroup_path (opt, path, sizeof (path)) < 0) ||
+        ((mkdir (path, 0755) < 0) && (errno != EEXIST))) {
+        fprintf (out, "fossa: cannot make cgroup `%s': %s\n", path,
+                 strerror (errno));
+        return -1;
+    }
+
+    snprintf (parent, sizeof (parent), "%s", path);
+    p = strrchr (parent, '/');
+    if (p && (p != parent)) {
+        *p = '\0';
+        if (opt->cpu_max) {
+            isolate_write (parent, "cgroup.subtree_control", "+cpu");
+        }
+        if (opt->mem_max) {
+            isolate_write (parent, "cgroup.subtree_control", "+memory");
+        }
+    }
+
+    // cpu.max is "quota period"; on the command line it is quota[,period]
+    if (opt->cpu_max) {
+        snprintf (cpu_max, sizeof (cpu_max), "%s", opt->cpu_max);
+        if ((p = strchr (cpu_max, ','))) {
+            *p = ' ';
+        }
+        if (isolate_write (path, "cpu.max", cpu_max) < 0) {
+            fprintf (out, "fossa: cannot set cpu.max of `%s': %s\n", path,
+                     strerror (errno));
+            return -1;
+        }
+    }
+
+    if (opt->mem_max && (isolate_write (path, "memory.max", opt->mem_max) < 0)) {
+        fprintf (out, "fossa: cannot set memory.max of `%s': %s\n", path,
+                 strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Check the CPUs and node are there and set up the cgroup.  Returns
+// -1 (having said why on out) if the child can't be run as asked.
+int
+isolate_prep (struct fossa_options *opt, FILE *out)
+{
+    cpu_set_t set;
+
+    if ((opt->cpus || (opt->numa_node >= 0)) &&
+        (isolate_cpus_check (opt, &set, out) < 0)) {
+        return -1;
+    }
+
+    if (opt->cgroup && (isolate_cgroup (opt, out) < 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Keep process pid (0: ourselves) on the CPUs asked for, if any
+int
+isolate_pin (pid_t pid, struct fossa_options *opt, FILE *out)
+{
+    cpu_set_t set;
+
+    if (!opt->cpus && (opt->numa_node < 0)) {
+        return 0;
+    }
+
+    if (isolate_cpus_check (opt, &set, out) < 0) {
+        return -1;
+    }
+
+    if (sched_setaffinity (pid, sizeof (set), &set) < 0) {
+        fprintf (out, "fossa: cannot pin to CPUs: %s\n", strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// The oom killer's take on us.  oom_adj is long deprecated; it is only
+// used on kernels too old to have oom_score_adj (scaled as they do it)
+static void
+isolate_oom (int oom_score)
+{
+    FILE *fp;
+
+    fp = fopen ("/proc/self/oom_score_adj", "w");
+    if (fp) {
+        fprintf (fp, "%i\n", oom_score);
+        fclose (fp);
+        return;
+    }
+
+    fp = fopen ("/proc/self/oom_adj", "w");
+    if (fp) {
+        fprintf (fp, "%i\n", (oom_score == -1000) ? -17 : oom_score * 17 / 1000);
+        fclose (fp);
+    }
+}
+
+
+// Called by the child on itself, before it exec()s the program (or
+// drops root).  What can't be done was reported by isolate_prep()
+// already, or only takes sudo (oom_score_adj < 0)
+void
+isolate_enter (struct fossa_options *opt)
+{
+    char path[FILENAME_MAX];
+    unsigned long nodes;
+
+    isolate_oom (opt->oom_score);
+    isolate_pin (0, opt, stderr);
+
+    // its memory comes from the node it runs on
+    if ((opt->numa_node >= 0) && (opt->numa_node < 8 * sizeof (nodes))) {
+        nodes = 1UL << opt->numa_node;
+        syscall (SYS_set_mempolicy, MPOL_BIND, &nodes, 8 * sizeof (nodes) + 1);
+    }
+
+    // "0" stands for whoever writes it
+    if (opt->cgroup) {
+        if ((isolate_cgroup_path (opt, path, sizeof (path)) < 0) ||
+            (isolate_write (path, "cgroup.procs", "0") < 0)) {
+            fprintf (stderr, "fossa: cannot join cgroup `%s': %s\n", path,
+                     strerror (errno));
+        }
+    }
+}
@@ -0,0 +1,34 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _isolate_h_
+#define _isolate_h_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "options.h"
+
+int
+isolate_prep (struct fossa_options *opt, FILE *out);
+
+void
+isolate_enter (struct fossa_options *opt);
+
+int
+isolate_pin (pid_t pid, struct fossa_options *opt, FILE *out);
+
+#endif /* #ifndef _isolate_h_ */
@@ -21,6 +21,7 @@
 
 #include "fossa.h"
 #include "options.h"
+#include "drift.h"
 
 void
 print_usage (void)
@@ -30,6 +31,37 @@ print_usage (void)
     "Options:\n"
     " --tune       Generate an optimized memory allocation plan for cuda_program\n"
     " --oom val    Adjust cuda_program's oom_adj value (-17 to +15). [requires sudo]\n"
+    " --oom-score val  Set cuda_program's oom_score_adj (-1000 to 1000) instead\n"
+    " --cpus list  Keep cuda_program and fossa on these CPUs (e.g. 2-3,6)\n"
+    " --numa-node n  Keep them on NUMA node n's CPUs and cuda_program on its memory\n"
+    " --cgroup dir   Run cuda_program in this cgroup v2 (made if need be)\n"
+    " --cpu-max quota[,period]  Set the cgroup's cpu.max\n"
+    " --mem-max bytes           Set the cgroup's memory.max\n"
+    " --step       Find main()'s return by stepping through it (slow)\n"
+    " --agent      Don't trace cuda_program: a preloaded agent wraps its main()\n"
+    " --roi sym    Tune around the first call to function sym instead of main()\n"
+    " --reps n     Make that call n times per tuning iteration\n"
+    " --fork       Run each tuning iteration in a fork of cuda_program at main()\n"
+    " --jobs n     Run up to n of those tuning iterations at once\n"
+    " --samples n  Time a promising candidate up to n times before trusting it\n"
+    " --race f     Cut short any of those over f times the quickest one's time\n"
+    " --tune-budget s  Stop tuning after s seconds, keeping the best plan found\n"
+    " --checkpoint file  Save tuning progress to file after every iteration\n"
+    " --resume     Carry on tuning from that file (default: fossa-<plan>.ckpt)\n"
+    " --online     Have each planned run try out a candidate, in a fork, and\n"
+    "              adopt it as the plan once it proves quicker\n"
+    " --drift act  Watch planned runs for slowing down since tuning; if they\n"
+    "              have: warn, retune next run, or run planless until re-tuned\n"
+    "\n"
+    " --daemon sock  Run as a tracer daemon, accepting jobs on unix socket sock\n"
+    " --submit sock  Run cuda_program under the fossa daemon listening on sock\n"
+    " --batch file   Run the jobs in file, one per line: [options] cuda_program\n"
+    "                [cuda_program options], with the options above as defaults\n"
+    " --batch-jobs n Run up to n of them at once (default: one per CPU)\n"
+    " --zygote       Start each batch job as a fork() of its program, kept at\n"
+    "                main() with libraries loaded and libcuzmem found\n"
+    " --bench n      Time n traces of a simulated program and exit\n"
+    " --stats file   Report tracer statistics on exit, also as JSON to file\n"
     "\n"
     " --version    Display version and license information\n"
     " --help       Display this information\n"
@@ -92,6 +124,19 @@ get_child_prg (char* argv0)
     }
 }
 
+// What the options are until the command line says otherwise
+void
+init_options (struct fossa_options *opt)
+{
+    memset (opt, 0, sizeof (struct fossa_options));
+    opt->mode = 0;      // make run mode the default mode
+    opt->tuner = 1;     // genetic tuner is default
+    opt->numa_node = -1;
+    opt->reps = 1;
+    opt->jobs = 1;
+    opt->samples = 1;
+}
+
 void
 parse_cmdline (struct fossa_options *opt, int argc, char* argv[])
 {
@@ -120,10 +165,97 @@ parse_cmdline (struct fossa_options *opt, int argc, char* argv[])
         else if (!strcmp (argv[i], "--tune")) {
             opt->mode = 1;
         }
+        else if (!strcmp (argv[i], "--step")) {
+            opt->step = 1;
+        }
+        else if (!strcmp (argv[i], "--agent")) {
+            opt->agent = 1;
+        }
+        else if (!strcmp (argv[i], "--fork")) {
+            opt->fork = 1;
+        }
+        else if (!strcmp (argv[i], "--jobs")) {
+            check_syntax (i++, argc, argv);
+            opt->jobs = atoi (argv[i]);
+            if (opt->jobs <= 0) {
+                fprintf (stderr, "fossa: invalid number of jobs\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--samples")) {
+            check_syntax (i++, argc, argv);
+            opt->samples = atoi (argv[i]);
+            if (opt->samples <= 0) {
+                fprintf (stderr, "fossa: invalid number of samples\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--race")) {
+            check_syntax (i++, argc, argv);
+            opt->race = atof (argv[i]);
+            if (opt->race < 1) {
+                fprintf (stderr, "fossa: invalid racing factor\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--tune-budget")) {
+            check_syntax (i++, argc, argv);
+            opt->budget = atof (argv[i]);
+            if (opt->budget <= 0) {
+                fprintf (stderr, "fossa: invalid tuning budget\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--checkpoint")) {
+            check_syntax (i++, argc, argv);
+            opt->ckpt = argv[i];
+        }
+        else if (!strcmp (argv[i], "--resume")) {
+            opt->resume = 1;
+        }
+        else if (!strcmp (argv[i], "--online")) {
+            opt->online = 1;
+        }
+        else if (!strcmp (argv[i], "--drift")) {
+            check_syntax (i++, argc, argv);
+            if (!strcmp (argv[i], "warn")) {
+                opt->drift = DRIFT_WARN;
+            }
+            else if (!strcmp (argv[i], "retune")) {
+                opt->drift = DRIFT_RETUNE;
+            }
+            else if (!strcmp (argv[i], "planless")) {
+                opt->drift = DRIFT_PLANLESS;
+            }
+            else {
+                fprintf (stderr, "fossa: invalid drift action\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--roi")) {
+            check_syntax (i++, argc, argv);
+            opt->roi = argv[i];
+        }
+        else if (!strcmp (argv[i], "--reps")) {
+            check_syntax (i++, argc, argv);
+            opt->reps = atoi (argv[i]);
+            if (opt->reps <= 0) {
+                fprintf (stderr, "fossa: invalid number of repetitions\n");
+                print_usage ();
+                exit (1);
+            }
+        }
         else if (!strcmp (argv[i], "--oom")) {
             check_syntax (i++, argc, argv);
+            // kept as the oom_score_adj it stands for, as the kernel does
             if ((atoi(argv[i]) < 16) && (atoi(argv[i]) > -18)) {
-                opt->oom_adj = atoi(argv[i]);
+                opt->oom_score = (atoi(argv[i]) == -17) ? -1000
+                                                        : atoi(argv[i]) * 1000 / 17;
             }
             else {
                 fprintf (stderr, "fossa: invalid oom_adj value\n");
@@ -131,6 +263,83 @@ parse_cmdline (struct fossa_options *opt, int argc, char* argv[])
                 exit (1);
             }
         }
+        else if (!strcmp (argv[i], "--oom-score")) {
+            check_syntax (i++, argc, argv);
+            if ((atoi(argv[i]) <= 1000) && (atoi(argv[i]) >= -1000)) {
+                opt->oom_score = atoi(argv[i]);
+            }
+            else {
+                fprintf (stderr, "fossa: invalid oom_score_adj value\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--cpus")) {
+            check_syntax (i++, argc, argv);
+            opt->cpus = argv[i];
+        }
+        else if (!strcmp (argv[i], "--numa-node")) {
+            check_syntax (i++, argc, argv);
+            opt->numa_node = atoi (argv[i]);
+            if (opt->numa_node < 0) {
+                fprintf (stderr, "fossa: invalid NUMA node\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--cgroup")) {
+            check_syntax (i++, argc, argv);
+            opt->cgroup = argv[i];
+        }
+        else if (!strcmp (argv[i], "--cpu-max")) {
+            check_syntax (i++, argc, argv);
+            opt->cpu_max = argv[i];
+        }
+        else if (!strcmp (argv[i], "--mem-max")) {
+            check_syntax (i++, argc, argv);
+            opt->mem_max = argv[i];
+        }
+        else if (!strcmp (argv[i], "--daemon")) {
+            check_syntax (i++, argc, argv);
+            opt->daemon_sock = argv[i];
+            // the daemon gets its programs from its clients
+            return;
+        }
+        else if (!strcmp (argv[i], "--bench")) {
+            check_syntax (i++, argc, argv);
+            opt->bench = atoi (argv[i]);
+            if (opt->bench <= 0) {
+                fprintf (stderr, "fossa: invalid number of benchmark runs\n");
+                print_usage ();
+                exit (1);
+            }
+            // the simulated program takes the place of cuda_program
+            return;
+        }
+        else if (!strcmp (argv[i], "--stats")) {
+            check_syntax (i++, argc, argv);
+            opt->stats_path = argv[i];
+        }
+        else if (!strcmp (argv[i], "--submit")) {
+            check_syntax (i++, argc, argv);
+            opt->submit_sock = argv[i];
+        }
+        else if (!strcmp (argv[i], "--batch")) {
+            check_syntax (i++, argc, argv);
+            opt->batch = argv[i];
+        }
+        else if (!strcmp (argv[i], "--batch-jobs")) {
+            check_syntax (i++, argc, argv);
+            opt->batch_jobs = atoi (argv[i]);
+            if (opt->batch_jobs <= 0) {
+                fprintf (stderr, "fossa: invalid number of batch jobs\n");
+                print_usage ();
+                exit (1);
+            }
+        }
+        else if (!strcmp (argv[i], "--zygote")) {
+            opt->zygote = 1;
+        }
         else if (!strcmp (argv[i], "--version")) {
             print_version ();
         }
@@ -147,6 +356,21 @@ parse_cmdline (struct fossa_options *opt, int argc, char* argv[])
         print_usage ();
     }
 
+    // the jobs bring their own programs
+    if (opt->batch) {
+        if (argv[i] != NULL) {
+            fprintf (stderr, "fossa: --batch takes its programs from `%s'\n",
+                     opt->batch);
+            exit (1);
+        }
+        return;
+    }
+
+    if (opt->zygote) {
+        fprintf (stderr, "fossa: --zygote is for --batch\n");
+        exit (1);
+    }
+
     // opt->child_prg is just the program name
     // the full path lives in opt->argv[0]
 
@@ -158,5 +382,45 @@ parse_cmdline (struct fossa_options *opt, int argc, char* argv[])
     } else {
         print_usage ();
     }
+
+    // the agent only knows how to wrap main(), once
+    if (opt->agent && (opt->roi || (opt->reps > 1) || opt->fork ||
+                       (opt->jobs > 1) || opt->race || opt->budget ||
+                       opt->ckpt || opt->resume || opt->online || opt->drift)) {
+        fprintf (stderr, "fossa: --roi, --reps, --fork, --jobs, --race, "
+                         "--tune-budget, --checkpoint, --resume, --online and "
+                         "--drift need tracing, not --agent\n");
+        exit (1);
+    }
+
+    // a pass can only be cut short if it is a copy of the child
+    if (opt->race && !opt->fork && (opt->jobs < 2) && !opt->online) {
+        fprintf (stderr, "fossa: --race needs --fork, --jobs or --online\n");
+        exit (1);
+    }
+
+    // --online tries its candidates in runs that have a plan, one a run
+    if (opt->online && ((opt->mode == 1) || (opt->jobs > 1) || opt->budget)) {
+        fprintf (stderr, "fossa: --online is for planned runs, not --tune, "
+                         "--jobs or --tune-budget\n");
+        exit (1);
+    }
+
+    if ((opt->cpu_max || opt->mem_max) && !opt->cgroup) {
+        fprintf (stderr, "fossa: --cpu-max and --mem-max need --cgroup\n");
+        exit (1);
+    }
+
+    if (opt->cpus && (opt->numa_node >= 0)) {
+        fprintf (stderr, "fossa: --cpus or --numa-node, not both\n");
+        exit (1);
+    }
+
+    // only with --jobs (or --online) does fossa know one candidate
+    // from another
+    if ((opt->samples > 1) && (opt->jobs < 2) && !opt->online) {
+        fprintf (stderr, "fossa: --samples needs --jobs or --online\n");
+        exit (1);
+    }
 }
 
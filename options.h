@@ -26,9 +26,40 @@ struct fossa_options {
     char* child_prg;
     char** child_argv;
     int child_argc;
-    int oom_adj;
+    int oom_score;          /* --oom, --oom-score: its oom_score_adj */
+    char* cpus;             /* --cpus: CPUs to keep it (and us) on   */
+    int numa_node;          /* --numa-node: or a node's (-1: any)    */
+    char* cgroup;           /* --cgroup: cgroup v2 to run it in      */
+    char* cpu_max;          /* --cpu-max, --mem-max: the cgroup's    */
+    char* mem_max;          /*   limits                              */
+    char* daemon_sock;      /* --daemon: serve jobs on this socket  */
+    char* submit_sock;      /* --submit: hand job to this daemon    */
+    char* batch;            /* --batch: run the jobs listed in this */
+    int batch_jobs;         /* --batch-jobs: that many at once      */
+    int zygote;             /* --zygote: fork them from warm copies */
+    int bench;              /* --bench: # of simulated runs to time */
+    char* stats_path;       /* --stats: write JSON statistics here  */
+    int step;               /* --step: find main()'s ret by stepping */
+    int agent;              /* --agent: preload the agent, no ptrace */
+    char* roi;              /* --roi: function to tune (NULL: main)  */
+    int reps;               /* --reps: calls of it per pass          */
+    int fork;               /* --fork: run each pass in a fork()     */
+    int jobs;               /* --jobs: passes to run at once         */
+    double budget;          /* --tune-budget: seconds to tune for    */
+    double race;            /* --race: cut passes this much slower   */
+    int samples;            /* --samples: most runs of a candidate   */
+    char* ckpt;             /* --checkpoint: save tuning state here  */
+    int resume;             /* --resume: and pick it up from there   */
+    int online;             /* --online: try a candidate per run     */
+    int drift;              /* --drift: DRIFT_*, or 0 not to watch   */
 };
 
+char*
+get_child_prg (char* argv0);
+
+void
+init_options (struct fossa_options *opt);
+
 void
 parse_cmdline (struct fossa_options *opt, int argc, char* argv[]);
 
@@ -15,256 +15,1444 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> 
 #include <errno.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stddef.h>
 
 #include "fossa.h"
 #include "ptrace_wrap.h"
 
+#ifndef TRAP_HWBKPT
+#define TRAP_HWBKPT 4
+#endif
+
+// offset of debug register i within struct user (for PTRACE_POKEUSER)
+#define PT_DR_OFFSET(i) \
+    (offsetof (struct user, u_debugreg) + (i) * sizeof (long))
+#define PT_DR_SLOTS 4
+
+// Per-thread state.  The register file is fetched at most once per stop
+// and only written back (if it was changed) when the thread is resumed.
+// /proc/<pid>/mem is kept open so repeated transfers don't pay for open().
+//
+// Every thread of a traced process has an entry, tied to the others by
+// tgid (the pid of the process's initial thread, the "leader").  Whenever
+// one thread stops for a reason the caller has to see, all the others are
+// stopped as well, so that code and breakpoints can be changed without
+// anything running underneath us; they are all let go again together.
+struct pt_tracee {
+    pid_t pid;
+    pid_t tgid;
+    int mem_fd;
+    int regs_valid;
+    int regs_dirty;
+    struct user_regs_struct regs;
+
+    int traced;             /* leader: pt_trace_threads() was called  */
+    int forking;            /* leader: its fork()s are followed       */
+    int held;               /* leader: all threads held for caller    */
+    int started;            /* initial SIGSTOP of a new thread seen   */
+    int running;            /* resumed, and no stop collected yet     */
+    int req;                /* how the thread was last resumed        */
+    int stop_expected;      /* we sent it a SIGSTOP that's still due  */
+    int pending_sig;        /* signal to deliver when resumed         */
+    int has_status;         /* collected wait status not yet handled  */
+    int status;
+
+    unsigned long dr7;      /* our copy of the debug control register */
+    int failed;             /* a ptrace call on it failed             */
+    pid_t forked_by;        /* leader: whose fork() it is, till adopted */
+};
+
+static struct pt_tracee *tracees = NULL;
+static int num_tracees = 0;
+
+
+// Look a thread up without creating an entry for it
+static struct pt_tracee*
+pt_find (pid_t pid)
+{
+    int i;
+
+    for (i=0; i<num_tracees; i++) {
+        if (tracees[i].pid == pid) {
+            return &tracees[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+// Which process does a thread we know nothing about belong to?
+static pid_t
+pt_proc_tgid (pid_t pid)
+{
+    FILE *fp;
+    char fn[FILENAME_MAX];
+    char line[128];
+    pid_t tgid = pid;
+
+    sprintf (fn, "/proc/%i/status", pid);
+    fp = fopen (fn, "r");
+    if (!fp) {
+        return pid;
+    }
+
+    while (fgets (line, sizeof (line), fp)) {
+        if (sscanf (line, "Tgid: %i", &tgid) == 1) {
+            break;
+        }
+    }
+    fclose (fp);
+
+    return tgid;
+}
+
+
+static struct pt_tracee*
+pt_tracee (pid_t pid);
+
+
+// The real backend: ptrace() and friends
+
+static int
+pt_mem_fd (pid_t pid)
+{
+    char fn[FILENAME_MAX];
+    struct pt_tracee *t = pt_tracee (pid);
+
+    if (t->mem_fd < 0) {
+        sprintf (fn, "/proc/%i/mem", pid);
+        t->mem_fd = open (fn, O_RDWR);
+    }
+
+    return t->mem_fd;
+}
+
+
+// We try to move the whole block with a single process_vm_readv(), then
+// fall back to /proc/<pid>/mem and finally to word sized PTRACE_PEEKTEXTs
+// for whatever is left over.
+static ssize_t
+pt_real_read (pid_t pid, Elf_Addr addr, void *vptr, size_t len)
+{
+    ssize_t n;
+    size_t done = 0;
+    long word;
+    unsigned char *ptr = (unsigned char *)vptr;
+    struct iovec local, remote;
+    int fd;
+
+    local.iov_base = ptr;
+    local.iov_len = len;
+    remote.iov_base = (void *)addr;
+    remote.iov_len = len;
+
+    n = process_vm_readv (pid, &local, 1, &remote, 1, 0);
+    if (n > 0) {
+        done = n;
+    }
+
+    if ((done < len) && ((fd = pt_mem_fd (pid)) >= 0)) {
+        n = pread (fd, ptr + done, len - done, addr + done);
+        if (n > 0) {
+            done += n;
+        }
+    }
+
+    while (done < len) {
+        errno = 0;
+        word = ptrace (PTRACE_PEEKTEXT, pid, addr + done, NULL);
+        if ((word == -1) && errno) {
+            break;
+        }
+
+        n = (len - done < sizeof (word)) ? len - done : sizeof (word);
+        memcpy (ptr + done, &word, n);
+        done += n;
+    }
+
+    return done;
+}
+
+
+// process_vm_writev() honors page protections, so writes into .text
+// (breakpoints, injections) land in /proc/<pid>/mem, which does not.
+static ssize_t
+pt_real_write (pid_t pid, Elf_Addr addr, void *vptr, size_t len)
+{
+    ssize_t n;
+    size_t done = 0;
+    long word;
+    unsigned char *ptr = (unsigned char *)vptr;
+    struct iovec local, remote;
+    int fd;
+
+    local.iov_base = ptr;
+    local.iov_len = len;
+    remote.iov_base = (void *)addr;
+    remote.iov_len = len;
+
+    n = process_vm_writev (pid, &local, 1, &remote, 1, 0);
+    if (n > 0) {
+        done = n;
+    }
+
+    if ((done < len) && ((fd = pt_mem_fd (pid)) >= 0)) {
+        n = pwrite (fd, ptr + done, len - done, addr + done);
+        if (n > 0) {
+            done += n;
+        }
+    }
+
+    while (done < len) {
+        n = len - done;
+
+        // partial word at the tail: read-modify-write so that we
+        // don't clobber the bytes that follow the buffer
+        if (n < sizeof (word)) {
+            errno = 0;
+            word = ptrace (PTRACE_PEEKTEXT, pid, addr + done, NULL);
+            if ((word == -1) && errno) {
+                break;
+            }
+        } else {
+            n = sizeof (word);
+        }
+
+        memcpy (&word, ptr + done, n);
+        if (ptrace (PTRACE_POKETEXT, pid, addr + done, word) < 0) {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+
+static int
+pt_real_get_regs (pid_t pid, struct user_regs_struct *regs)
+{
+    return ptrace (PTRACE_GETREGS, pid, NULL, regs);
+}
+
+
+static int
+pt_real_set_regs (pid_t pid, struct user_regs_struct *regs)
+{
+    return ptrace (PTRACE_SETREGS, pid, NULL, regs);
+}
+
+
+static int
+pt_real_get_fpregs (pid_t pid, struct user_fpregs_struct *fpregs)
+{
+    return ptrace (PTRACE_GETFPREGS, pid, NULL, fpregs);
+}
+
+
+static int
+pt_real_set_fpregs (pid_t pid, struct user_fpregs_struct *fpregs)
+{
+    return ptrace (PTRACE_SETFPREGS, pid, NULL, fpregs);
+}
+
+
+static int
+pt_real_set_dr (pid_t pid, int i, unsigned long val)
+{
+    return ptrace (PTRACE_POKEUSER, pid, PT_DR_OFFSET (i), val);
+}
+
+
+static int
+pt_real_resume (pid_t pid, int request, int sig)
+{
+    return ptrace (request, pid, NULL, sig);
+}
+
+
+static int
+pt_real_stop (pid_t tgid, pid_t pid)
+{
+    return syscall (SYS_tgkill, tgid, pid, SIGSTOP);
+}
+
+
+static pid_t
+pt_real_wait (int *status, int options)
+{
+    pid_t pid;
+
+    do {
+        pid = waitpid (-1, status, options | __WALL);
+    } while ((pid < 0) && (errno == EINTR));
+
+    return pid;
+}
+
+
+static int
+pt_real_siginfo (pid_t pid, siginfo_t *si)
+{
+    return ptrace (PTRACE_GETSIGINFO, pid, NULL, si);
+}
+
+
+static int
+pt_real_eventmsg (pid_t pid, unsigned long *msg)
+{
+    return ptrace (PTRACE_GETEVENTMSG, pid, NULL, msg);
+}
+
+
+static int
+pt_real_setoptions (pid_t pid, int options)
+{
+    return ptrace (PTRACE_SETOPTIONS, pid, NULL, options);
+}
+
+
+static struct pt_backend pt_real = {
+    "ptrace",
+    pt_real_read,
+    pt_real_write,
+    pt_real_get_regs,
+    pt_real_set_regs,
+    pt_real_get_fpregs,
+    pt_real_set_fpregs,
+    pt_real_set_dr,
+    pt_real_resume,
+    pt_real_stop,
+    pt_real_wait,
+    pt_real_siginfo,
+    pt_real_eventmsg,
+    pt_real_setoptions,
+    pt_proc_tgid
+};
+
+static struct pt_backend *backend = &pt_real;
+
+
+// Switch to another backend (see sim.c).  Must be done before
+// any tracee is touched.
+void
+pt_set_backend (struct pt_backend *b)
+{
+    backend = b ? b : &pt_real;
+}
+
+
+// The backend in use, for anyone who wants to layer on top of it
+struct pt_backend*
+pt_get_backend (void)
+{
+    return backend;
+}
+
+
+// Note: creating an entry may move the table, so don't hold
+// on to pointers into it across calls that can add threads
+static struct pt_tracee*
+pt_tracee (pid_t pid)
+{
+    struct pt_tracee *t = pt_find (pid);
+
+    if (t) {
+        return t;
+    }
+
+    tracees = realloc (tracees, (num_tracees+1) * sizeof (struct pt_tracee));
+    t = &tracees[num_tracees++];
+    memset (t, 0, sizeof (struct pt_tracee));
+    t->pid = pid;
+    t->tgid = backend->tgid (pid);
+    t->mem_fd = -1;
+    t->started = (t->tgid == pid);
+    t->req = PTRACE_CONT;
+
+    return t;
+}
+
+
+static void
+pt_drop (pid_t pid)
+{
+    struct pt_tracee *t = pt_find (pid);
+
+    if (!t) {
+        return;
+    }
+
+    if (t->mem_fd >= 0) {
+        close (t->mem_fd);
+    }
+    *t = tracees[--num_tracees];
+}
+
+
+// Drop everything we know about a tracee and its threads
+// (it exited or was detached)
+void
+pt_forget (pid_t pid)
+{
+    int i = 0;
+
+    while (i < num_tracees) {
+        if ((tracees[i].tgid == pid) || (tracees[i].pid == pid)) {
+            pt_drop (tracees[i].pid);
+        } else {
+            i++;
+        }
+    }
+}
+
+
+// Has a ptrace call failed on the process or any of its threads?  The
+// caller then gives up on it, rather than fossa giving up altogether
+int
+pt_failed (pid_t pid)
+{
+    int i;
+
+    for (i=0; i<num_tracees; i++) {
+        if (((tracees[i].tgid == pid) || (tracees[i].pid == pid)) &&
+            tracees[i].failed) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Get the cached register file, loading it if this is the
+// first access since the child last stopped
+static struct user_regs_struct*
+pt_regs (pid_t pid)
+{
+    struct pt_tracee *t = pt_tracee (pid);
+
+    if (!t->regs_valid) {
+        if (backend->get_regs (pid, &t->regs) < 0) {
+            fprintf (stderr, "CRITICAL ERROR: ptrace getregs failed (%i)\n",
+                     errno);
+            memset (&t->regs, 0, sizeof (struct user_regs_struct));
+            t->failed = 1;
+        }
+        t->regs_valid = 1;
+        t->regs_dirty = 0;
+    }
+
+    return &t->regs;
+}
+
+
+static void
+pt_regs_dirty (pid_t pid)
+{
+    pt_tracee (pid)->regs_dirty = 1;
+}
+
+
+// Write back modified registers and invalidate the cache.
+// Must be called before the child is allowed to run.
+static void
+pt_regs_flush (pid_t pid)
+{
+    struct pt_tracee *t = pt_tracee (pid);
+
+    if (t->regs_valid && t->regs_dirty && !t->failed) {
+        if (backend->set_regs (pid, &t->regs) < 0) {
+            fprintf (stderr, "CRITICAL ERROR: ptrace setregs failed (%i)\n",
+                     errno);
+            t->failed = 1;
+        }
+    }
+
+    t->regs_valid = 0;
+    t->regs_dirty = 0;
+}
+
 void
 pt_attach (pid_t pid)
 {
-    int s;
+    int s;
+
+    if ((ptrace (PTRACE_ATTACH, pid, NULL, NULL)) < 0) {
+        fprintf (stderr, "Critical Failure: ptrace attach unsuccessful.\n");
+        exit(1);
+    }
+
+    waitpid (pid, NULL, WUNTRACED);
+}
+
+
+// Have the kernel attach us to every thread the (stopped) child creates
+// from now on.  Threads then show up in pt_wait() like the child itself.
+void
+pt_trace_threads (pid_t pid)
+{
+    if (backend->setoptions (pid, PTRACE_O_TRACECLONE) < 0) {
+        fprintf (stderr, "Critical Failure: ptrace setoptions unsuccessful.\n");
+        pt_tracee (pid)->failed = 1;
+        return;
+    }
+
+    pt_tracee (pid)->traced = 1;
+}
+
+
+// Have the kernel attach us to the processes the (stopped) child
+// fork()s, too, or stop doing so.  A new process is held at its first
+// stop until it is taken on with pt_adopt().
+void
+pt_trace_forks (pid_t pid, int on)
+{
+    long options = PTRACE_O_TRACECLONE | (on ? PTRACE_O_TRACEFORK : 0);
+
+    if (backend->setoptions (pid, options) < 0) {
+        fprintf (stderr, "Critical Failure: ptrace setoptions unsuccessful.\n");
+        pt_tracee (pid)->failed = 1;
+        return;
+    }
+
+    pt_tracee (pid)->forking = on;
+}
+
+
+// Let go of the child and all of its threads, which must be stopped.
+// Returns 0, or -1 if it can't be let go as it is: a ptrace call on it
+// failed, so it may not be as it was left (it is then still traced)
+int
+pt_detach (pid_t pid)
+{
+    int i;
+    struct pt_tracee *t;
+
+    if (pt_failed (pid)) {
+        return -1;
+    }
+
+    for (i=0; i<num_tracees; i++) {
+        t = &tracees[i];
+        if ((t->tgid != pid) || (t->pid == pid)) {
+            continue;
+        }
+        pt_regs_flush (t->pid);
+        backend->resume (t->pid, PTRACE_DETACH, t->pending_sig);
+    }
+
+    pt_regs_flush (pid);
+
+    if (pt_failed (pid) || (backend->resume (pid, PTRACE_DETACH, 0) < 0)) {
+        fprintf (stderr, "Critical Failure: ptrace detach unsuccessful.\n");
+        pt_tracee (pid)->failed = 1;
+        return -1;
+    }
+
+    pt_forget (pid);
+
+    return 0;
+}
+
+
+void
+pt_allow_trace (void)
+{
+    ptrace (PTRACE_TRACEME, NULL, NULL);
+}
+
+
+// Set a thread running again.  Only the thread itself is touched.  One
+// that a ptrace call has failed on stays put: what was done to it can't
+// be trusted, so it is only fit to be killed.
+static int
+pt_restart (pid_t pid, int request, int sig)
+{
+    struct pt_tracee *t;
+
+    pt_regs_flush (pid);
+
+    if (pt_tracee (pid)->failed) {
+        return -1;
+    }
+    if (backend->resume (pid, request, sig) < 0) {
+        return -1;
+    }
+
+    t = pt_tracee (pid);
+    t->running = 1;
+    t->req = request;
+
+    return 0;
+}
+
+
+// Set a collected wait status aside to be handed out later
+static void
+pt_stash (pid_t pid, int status)
+{
+    struct pt_tracee *t = pt_tracee (pid);
+
+    t->has_status = 1;
+    t->status = status;
+}
+
+
+// Collect the next state change of any of our threads (belonging to
+// process tgid, or to anybody if tgid is -1).  Statuses that were set
+// aside earlier are handed out before anything new is asked of the kernel.
+static pid_t
+pt_reap (pid_t tgid, int *status, int options)
+{
+    int i;
+
+    for (i=0; i<num_tracees; i++) {
+        if (tracees[i].has_status &&
+            ((tgid < 0) || (tracees[i].tgid == tgid))) {
+            tracees[i].has_status = 0;
+            *status = tracees[i].status;
+            return tracees[i].pid;
+        }
+    }
+
+    return backend->wait (status, options);
+}
+
+
+static int
+pt_held (pid_t tgid)
+{
+    struct pt_tracee *t = pt_find (tgid);
+
+    return (t && t->held);
+}
+
+
+// Is a fork() of one of ours due?
+static int
+pt_forking (void)
+{
+    int i;
+
+    for (i=0; i<num_tracees; i++) {
+        if (tracees[i].forking) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Deal with the state changes that are part of following threads
+// around and that nobody outside of this file needs to hear about:
+// thread creation and exit, the SIGSTOP each new thread starts with
+// and the SIGSTOPs we send ourselves.  Returns 1 if the status was
+// consumed here.
+static int
+pt_absorb (pid_t pid, int status)
+{
+    struct pt_tracee *t = pt_find (pid);
+    struct pt_tracee *leader;
+    unsigned long msg;
+    pid_t tgid;
+    int sig;
+
+    if (!t) {
+        t = pt_tracee (pid);
+    }
+    tgid = t->tgid;
+
+    // not a thread of anything we trace (e.g. a clone() that
+    // made a new process rather than a new thread): let it be.
+    // Children that we detached from still report their exit.
+    leader = pt_find (tgid);
+    if (!leader || !leader->traced) {
+        // unless it is a process we are following a fork() into, that
+        // stopped before its parent got to tell us about it
+        if (WIFSTOPPED (status) && (WSTOPSIG (status) == SIGSTOP) &&
+            (pid == tgid) && pt_forking ()) {
+            t->traced = 1;
+            t->held = 1;
+            t->running = 0;
+            return 1;
+        }
+        if (WIFSTOPPED (status)) {
+            backend->resume (pid, PTRACE_DETACH, 0);
+        } else if (pid == tgid) {
+            return 0;
+        }
+        pt_drop (pid);
+        return 1;
+    }
+
+    if (WIFEXITED (status) || WIFSIGNALED (status)) {
+        if (pid == tgid) {
+            t->running = 0;
+            return 0;
+        }
+        pt_drop (pid);
+        return 1;
+    }
+
+    if (!WIFSTOPPED (status)) {
+        return 1;
+    }
+
+    t->running = 0;
+    sig = WSTOPSIG (status);
+
+    // a new thread: make an entry for it, unless it already stopped
+    // and we got to know it that way, and let its creator carry on
+    if ((status >> 8) == (SIGTRAP | (PTRACE_EVENT_CLONE << 8))) {
+        backend->eventmsg (pid, &msg);
+        if (!pt_find ((pid_t)msg)) {
+            t = pt_tracee ((pid_t)msg);
+            t->running = (t->tgid == tgid);
+        }
+        pt_restart (pid, pt_find (pid)->req, 0);
+        return 1;
+    }
+
+    // a new process: keep it at its first stop, which is still to come
+    // if it is not known yet or its stop has only been set aside
+    if ((status >> 8) == (SIGTRAP | (PTRACE_EVENT_FORK << 8))) {
+        backend->eventmsg (pid, &msg);
+        t = pt_find ((pid_t)msg);
+        if (!t || t->has_status) {
+            t = pt_tracee ((pid_t)msg);
+            t->started = 0;
+            t->running = !t->has_status;
+        }
+        t->traced = 1;
+        t->held = 1;
+        t->forked_by = tgid;
+        pt_restart (pid, pt_find (pid)->req, 0);
+        return 1;
+    }
+
+    // a new thread's first stop, or a stop that we asked for
+    if ((sig == SIGSTOP) && (!t->started || t->stop_expected)) {
+        t->started = 1;
+        t->stop_expected = 0;
+        if (!pt_held (tgid)) {
+            pt_restart (pid, PTRACE_CONT, 0);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Bring every thread of process tgid other than the one given to a stop
+// and keep them there.  Anything they run into on the way is remembered
+// and replayed when they are resumed: signals are delivered then, and
+// threads that hit an int3 are backed up so that they trap on it again.
+static void
+pt_stop_threads (pid_t tgid, pid_t except)
+{
+    int i, status, more;
+    pid_t pid;
+    struct pt_tracee *t;
+    siginfo_t si;
+
+    pt_tracee (tgid)->held = 1;
+
+    for (i=0; i<num_tracees; i++) {
+        t = &tracees[i];
+        if ((t->tgid == tgid) && (t->pid != except) &&
+            t->running && t->started && !t->stop_expected) {
+            backend->stop (tgid, t->pid);
+            t->stop_expected = 1;
+        }
+    }
 
-    if ((ptrace (PTRACE_ATTACH, pid, NULL, NULL)) < 0) {
-        fprintf (stderr, "Critical Failure: ptrace attach unsuccessful.\n");
-        exit(1);
+    while (1) {
+        more = 0;
+        for (i=0; i<num_tracees; i++) {
+            t = &tracees[i];
+            if ((t->tgid == tgid) && (t->running ||
+                (t->has_status && WIFSTOPPED (t->status)))) {
+                more = 1;
+            }
+        }
+        if (!more) {
+            break;
+        }
+
+        pid = pt_reap (tgid, &status, 0);
+        if (pid < 0) {
+            break;
+        }
+
+        t = pt_find (pid);
+        if (!t || (t->tgid != tgid)) {
+            t = pt_tracee (pid);
+            if (t->tgid != tgid) {
+                pt_stash (pid, status);
+                continue;
+            }
+        }
+
+        if (pt_absorb (pid, status)) {
+            continue;
+        }
+
+        // the process is gone (its initial thread is always the last
+        // one to be reported); the caller hears about it next time
+        if (!WIFSTOPPED (status)) {
+            pt_stash (pid, status);
+            break;
+        }
+
+        // it stopped for some other reason before our SIGSTOP got to it.
+        // An int3 has already been executed and must be backed up over;
+        // a debug register fires before the instruction, so it simply
+        // fires again.
+        if (WSTOPSIG (status) == SIGTRAP &&
+            backend->siginfo (pid, &si) == 0 &&
+            (si.si_code == SI_KERNEL || si.si_code == TRAP_HWBKPT))
+        {
+            if (si.si_code == SI_KERNEL) {
+                pt_rewind_eip (pid, 1);
+            }
+        } else {
+            pt_tracee (pid)->pending_sig = WSTOPSIG (status);
+        }
+        pt_restart (pid, PTRACE_CONT, 0);
     }
+}
 
-    waitpid (pid, NULL, WUNTRACED);
+
+// Turn a wait status into a pt_event.  Returns 0 if the status was
+// only of interest to us and there is nothing to report.
+static int
+pt_decode (pid_t pid, int status, struct pt_event *ev)
+{
+    pid_t tgid;
+
+    if (pt_absorb (pid, status)) {
+        return 0;
+    }
+    tgid = pt_tracee (pid)->tgid;
+
+    ev->pid = tgid;
+    ev->tid = pid;
+    ev->status = status;
+    ev->sig = 0;
+
+    if (WIFEXITED (status)) {
+        ev->type = PT_EVENT_EXIT;
+        ev->status = WEXITSTATUS (status);
+        return 1;
+    }
+    else if (WIFSIGNALED (status)) {
+        ev->type = PT_EVENT_KILLED;
+        ev->sig = WTERMSIG (status);
+        return 1;
+    }
+
+    pt_stop_threads (tgid, pid);
+
+    // our breakpoints only ever go where the initial thread runs,
+    // so a trap in any other thread is just a signal
+    ev->sig = WSTOPSIG (status);
+    if ((ev->sig == SIGTRAP) && (pid == tgid)) {
+        ev->type = PT_EVENT_STOP;
+    } else {
+        ev->type = PT_EVENT_SIGNAL;
+    }
+
+    return 1;
+}
+
+
+// Sleep in the kernel until the child (any of its threads) changes
+// state.  Unlike polling the child, this costs no CPU while the child is
+// running.  pid -1 waits for any child.  Returns 0 on success and -1 if
+// there is nothing to wait for.
+int
+pt_wait (pid_t pid, struct pt_event *ev)
+{
+    int status;
+    pid_t ret;
+
+    while (1) {
+        ret = pt_reap (pid, &status, 0);
+        if (ret < 0) {
+            return -1;
+        }
+
+        if ((pid > 0) && (pt_tracee (ret)->tgid != pid)) {
+            pt_stash (ret, status);
+            continue;
+        }
+
+        if (pt_decode (ret, status, ev)) {
+            return 0;
+        }
+    }
+}
+
+
+// Like pt_wait() for any child, but don't block.  Returns 1 if an
+// event was filled in and 0 if nothing is pending.
+int
+pt_poll (struct pt_event *ev)
+{
+    int status;
+    pid_t ret;
+
+    while ((ret = pt_reap (-1, &status, WNOHANG)) > 0) {
+        if (pt_decode (ret, status, ev)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Take on the process that a child being followed by pt_trace_forks()
+// has just fork()ed.  Returns once it has come to its first stop,
+// where it is left; -1 if it went away instead.
+int
+pt_adopt (pid_t pid)
+{
+    int status;
+    pid_t ret;
+
+    while (pt_find (pid) && !pt_find (pid)->started) {
+        ret = pt_reap (pid, &status, 0);
+        if (ret < 0) {
+            return -1;
+        }
+
+        if (pt_tracee (ret)->tgid != pid) {
+            pt_stash (ret, status);
+            continue;
+        }
+
+        if (!pt_absorb (ret, status)) {
+            pt_stash (ret, status);
+            return -1;
+        }
+    }
+
+    if (!pt_find (pid)) {
+        return -1;
+    }
+    pt_find (pid)->forked_by = 0;
+
+    return 0;
 }
 
 
+// Kill a process and collect what is left of it here, so that nobody
+// hears of its end.  A fork() of it that was never adopted goes too:
+// nobody else knows it is there.
 void
-pt_detach (pid_t pid)
+pt_kill (pid_t pid)
 {
-    if (ptrace (PTRACE_DETACH, pid, NULL, NULL) < 0) {
-        fprintf (stderr, "Critical Failure: ptrace detach unsuccessful.\n");
-        exit(1);
+    int status;
+    pid_t ret;
+    int i;
+
+    kill (pid, SIGKILL);
+
+    while ((ret = pt_reap (pid, &status, 0)) >= 0) {
+        if (pt_tracee (ret)->tgid != pid) {
+            pt_stash (ret, status);
+            continue;
+        }
+        if ((ret == pid) && !WIFSTOPPED (status)) {
+            break;
+        }
+    }
+
+    pt_forget (pid);
+
+    for (i=0; i<num_tracees; i++) {
+        if (tracees[i].forked_by == pid) {
+            pt_kill (tracees[i].pid);
+            i = -1;
+        }
     }
 }
 
 
+// Stop a running process wherever it is.  Unlike the SIGSTOPs we send
+// to bring threads to a halt, this one is reported: pt_wait() returns
+// it as a PT_EVENT_SIGNAL, and it is not to be delivered
 void
-pt_allow_trace (void)
+pt_interrupt (pid_t pid)
 {
-    ptrace (PTRACE_TRACEME, NULL, NULL);
+    backend->stop (pid, pid);
 }
 
+
+// Let go of the system call the thread was stopped in, so that the
+// kernel doesn't restart it (backing up the PC) when it is resumed
 void
-pt_continue (pid_t pid)
+pt_cancel_syscall (pid_t pid)
 {
-    int s;
-    long tmp;
-    struct user_regs_struct regs;
+    struct user_regs_struct *regs = pt_regs (pid);
+
+#if _arch_i386_
+    regs->orig_eax = -1;
+#elif _arch_x86_64_
+    regs->orig_rax = -1;
+#endif
 
-    if ((ptrace (PTRACE_CONT, pid, NULL, NULL)) < 0) {
-        if (errno) {
+    pt_regs_dirty (pid);
+}
+
+
+// Let the thread run (PTRACE_CONT or PTRACE_SINGLESTEP), delivering sig
+// to it if non-zero.  Dirty registers are written back first.  This does
+// not wait; the resulting stop is picked up with pt_wait().  Returns 0,
+// or -1 if the thread couldn't be resumed (pt_failed() then says so).
+//
+// On PTRACE_CONT the other threads of the process are let go too.  While
+// single-stepping they are kept stopped: a step never blocks on another
+// thread, and it keeps a step from costing a stop of the whole process.
+int
+pt_resume (pid_t pid, int request, int sig)
+{
+    int i;
+    pid_t tgid;
+    struct pt_tracee *t;
+
+    if (pt_restart (pid, request, sig) < 0) {
+        if (!pt_tracee (pid)->failed) {
             fprintf (
                 stderr,
-                "CRITICAL FAILURE: ptrace continue unsuccessful (%i)\n",
+                "CRITICAL FAILURE: ptrace resume unsuccessful (%i)\n",
                 errno
             );
+            pt_tracee (pid)->failed = 1;
         }
-        exit(1);
+        return -1;
     }
 
-    // block until child is stopped
-    do {
-        waitpid (pid, NULL, WNOHANG);
-        if (child_exited (pid)) { exit (0); }
-        ptrace (PTRACE_GETREGS, pid, NULL, &regs);
-    } while
-#if _arch_i386_
-        ( ptrace (PTRACE_PEEKDATA, pid, regs.eip, NULL) == -1 );
-#elif _arch_x86_64_
-        ( ptrace (PTRACE_PEEKDATA, pid, regs.rip, NULL) == -1 );
-#endif
+    if (request == PTRACE_SINGLESTEP) {
+        return 0;
+    }
+
+    tgid = pt_tracee (pid)->tgid;
+    if (pt_find (tgid)) {
+        pt_find (tgid)->held = 0;
+    }
+
+    for (i=0; i<num_tracees; i++) {
+        t = &tracees[i];
+        if ((t->tgid == tgid) && !t->running && !t->has_status) {
+            sig = t->pending_sig;
+            t->pending_sig = 0;
+            pt_restart (t->pid, PTRACE_CONT, sig);
+        }
+    }
 
+    return 0;
 }
 
 
-void 
-pt_peek (pid_t pid, Elf_Addr addr, void *vptr, unsigned int len)
+// Resume the child with the given ptrace request and block until it
+// traps.  Signals that the child receives along the way are passed
+// through to it.  Returns 0, or -1 if it couldn't be resumed or went
+// away instead.
+static int
+pt_resume_wait (pid_t pid, int request)
 {
-    int i, count;
-    long word;
-    unsigned long *ptr = (unsigned long *)vptr;
+    struct pt_event ev;
 
-    i = count = 0;
+    if (pt_resume (pid, request, 0) < 0) {
+        return -1;
+    }
 
-    while (count < len) {
-        word = ptrace (PTRACE_PEEKTEXT, pid, addr+count, NULL);
+    while (1) {
+        if (pt_wait (pid, &ev) < 0) {
+            pt_forget (pid);
+            return -1;
+        }
 
-        // ptrace returns -1 on errors... but we also could have peeked
-        // a -1 from memory.  So, some special checking is needed.
-        if (word == -1) {
-            if (errno) {
-                fprintf (stderr, "CRITICAL ERROR: pt_peek failed (%i)\n",
-                        errno);
-                exit (1);
-            }
+        switch (ev.type) {
+            case PT_EVENT_STOP:
+                return 0;
+            case PT_EVENT_SIGNAL:
+                if (pt_resume (ev.tid, (ev.tid == pid) ? request : PTRACE_CONT,
+                               ev.sig) < 0) {
+                    return -1;
+                }
+                break;
+            case PT_EVENT_EXIT:
+                pt_forget (pid);
+                return -1;
+            case PT_EVENT_KILLED:
+                pt_forget (pid);
+                fprintf (stderr, "fossa: child terminated by signal %i\n",
+                         ev.sig);
+                return -1;
         }
+    }
+}
+
+
+int
+pt_continue (pid_t pid)
+{
+    return pt_resume_wait (pid, PTRACE_CONT);
+}
+
 
-        count += sizeof(Elf_Addr);
-        ptr[i++] = word;
+// Read len bytes from the child's address space.
+// Returns the number of bytes actually read.
+ssize_t
+pt_read (pid_t pid, Elf_Addr addr, void *vptr, size_t len)
+{
+    return backend->read (pid, addr, vptr, len);
+}
+
+
+// Write len bytes into the child's address space (text included).
+// Returns bytes written.
+ssize_t
+pt_write (pid_t pid, Elf_Addr addr, void *vptr, size_t len)
+{
+    return backend->write (pid, addr, vptr, len);
+}
+
+
+// pt_read() and pt_write() of exactly len bytes.  On failure the tracee
+// is marked (pt_failed()) and -1 is returned; what couldn't be read
+// reads as zeroes, so pointers followed through it end there.
+int
+pt_peek (pid_t pid, Elf_Addr addr, void *vptr, unsigned int len)
+{
+    if (pt_read (pid, addr, vptr, len) != len) {
+        fprintf (stderr, "CRITICAL ERROR: pt_peek failed (%i)\n", errno);
+        memset (vptr, 0, len);
+        pt_tracee (pid)->failed = 1;
+        return -1;
     }
+
+    return 0;
 }
 
 
-void 
+int
 pt_poke (pid_t pid, Elf_Addr addr, void *vptr, unsigned int len)
 {
-    int i , count;
-    long word;
+    if (pt_write (pid, addr, vptr, len) != len) {
+        fprintf (stderr, "CRITICAL ERROR: pt_poke failed (%i)\n", errno);
+        pt_tracee (pid)->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Copy the NUL terminated string at addr into buf (at most size bytes,
+// always terminated).  Reads are done in chunks that never cross a page
+// boundary, so we stop as soon as the NUL shows up and never fault on an
+// unmapped page that follows a short string.
+// Returns the length of the string or -1 if it could not be read.
+int
+pt_read_str (pid_t pid, Elf_Addr addr, char *buf, size_t size)
+{
+    size_t done = 0;
+    size_t chunk;
+    ssize_t n;
+    char *nul;
+    long page = sysconf (_SC_PAGESIZE);
+
+    if (size == 0) {
+        return -1;
+    }
+
+    while (done < size - 1) {
+        chunk = page - ((addr + done) % page);
+        if (chunk > size - 1 - done) {
+            chunk = size - 1 - done;
+        }
 
-    i = count = 0;
+        n = pt_read (pid, addr + done, buf + done, chunk);
+        if (n <= 0) {
+            buf[done] = '\0';
+            return (done > 0) ? (int)done : -1;
+        }
 
-    while (count < len) {
-        memcpy (&word, vptr+count, sizeof(word));
-        word = ptrace (PTRACE_POKETEXT, pid, addr+count, word);
-        count += sizeof (Elf_Addr);
+        nul = memchr (buf + done, '\0', n);
+        if (nul) {
+            return nul - buf;
+        }
+        done += n;
     }
+
+    buf[done] = '\0';
+    return done;
 }
 
+
 // Given an address into the child's address space,
 // this function will "stringify" up to 256 characters
 // starting at the specifed address.
 char *
 pt_get_str (pid_t pid, Elf_Addr addr)
 {
-        long ptr[256];
-        int len = 256;
         char* string = (char*)malloc (sizeof(char) * 256);
 
-        pt_peek (pid, addr, ptr, len);
-
         bzero (string, sizeof(char) * 256);
+        pt_read_str (pid, addr, string, 256);
 
-        strncpy (string, (char*)ptr, strlen((char*)ptr));
         return string;
 }
 
-void
+int
 pt_singlestep (pid_t pid)
 {
-    int s;
-    long word;
-    struct user_regs_struct regs;
-
-    word = ptrace (PTRACE_SINGLESTEP, pid, NULL, NULL);
+    return pt_resume_wait (pid, PTRACE_SINGLESTEP);
+}
 
-    if (word != 0) {
-        fprintf (stderr, "CRITICAL ERROR: single stepping failed!\n");
-        exit (1);
-    }
+void
+pt_get_regs (pid_t pid, struct user_regs_struct* regs)
+{
+    memcpy (regs, pt_regs (pid), sizeof (struct user_regs_struct));
+}
 
-    // block until child is stopped
-    do {
-        waitpid (pid, NULL, WNOHANG);
-        if (child_exited (pid)) { exit (0); }
-        ptrace (PTRACE_GETREGS, pid, NULL, &regs) ;
-    } while
-#if _arch_i386_
-        ( ptrace (PTRACE_PEEKDATA, pid, regs.eip, NULL) == -1 );
-#elif _arch_x86_64_
-        ( ptrace (PTRACE_PEEKDATA, pid, regs.rip, NULL) == -1 );
-#endif
 
+void
+pt_set_regs (pid_t pid, struct user_regs_struct* regs)
+{
+    memcpy (pt_regs (pid), regs, sizeof (struct user_regs_struct));
+    pt_regs_dirty (pid);
 }
 
+
+// The x87/SSE registers aren't cached: they are only ever saved and
+// put back whole, around a call fossa makes in the child
 void
-pt_get_regs (pid_t pid, struct user_regs_struct* regs)
+pt_get_fpregs (pid_t pid, struct user_fpregs_struct* fpregs)
 {
-    ptrace (PTRACE_GETREGS, pid, NULL, regs);
+    if (backend->get_fpregs (pid, fpregs) < 0) {
+        fprintf (stderr, "CRITICAL ERROR: ptrace getfpregs failed (%i)\n",
+                 errno);
+        memset (fpregs, 0, sizeof (struct user_fpregs_struct));
+        pt_tracee (pid)->failed = 1;
+    }
 }
 
 
 void
-pt_set_regs (pid_t pid, struct user_regs_struct* regs)
+pt_set_fpregs (pid_t pid, struct user_fpregs_struct* fpregs)
 {
-    ptrace (PTRACE_SETREGS, pid, NULL, regs);
+    if (backend->set_fpregs (pid, fpregs) < 0) {
+        fprintf (stderr, "CRITICAL ERROR: ptrace setfpregs failed (%i)\n",
+                 errno);
+        pt_tracee (pid)->failed = 1;
+    }
 }
 
 long
 pt_set_breakpoint (pid_t pid, Elf_Addr addr)
 {
-    long word;
-
-    word = ptrace (PTRACE_PEEKTEXT, pid, addr, NULL);
-    if (word == -1) {
-        if (errno) {
-            fprintf (stderr,
-                    "CRITICAL ERROR: pt_set_breakpoint failed (%i)\n", errno);
-            exit (1);
-        }
+    unsigned char opcode;
+    unsigned char int3 = 0xcc;
+
+    // only the first byte is replaced; the rest of the
+    // word may be live code that we must not touch
+    if ((pt_read (pid, addr, &opcode, 1) != 1) ||
+        (pt_write (pid, addr, &int3, 1) != 1)) {
+        fprintf (stderr,
+                "CRITICAL ERROR: pt_set_breakpoint failed (%i)\n", errno);
+        pt_tracee (pid)->failed = 1;
+        return 0;
     }
-    ptrace (PTRACE_POKETEXT, pid, addr, 0xcc);
 
-    return word;
+    return opcode;
 }
 
 void
 pt_rm_breakpoint (pid_t pid, long old_opcode)
 {
     long eip;
+    unsigned char opcode = (unsigned char)old_opcode;
 
     pt_rewind_eip (pid, 1);
     eip = pt_get_eip (pid);
-    ptrace (PTRACE_POKETEXT, pid, eip, old_opcode);
+    pt_poke (pid, eip, &opcode, 1);
+}
+
+// Arm a free debug register of the thread as an execution breakpoint
+// on addr.  Returns the register used, or -1 if none could be had.
+static int
+pt_hw_set (pid_t pid, Elf_Addr addr)
+{
+    struct pt_tracee *t = pt_tracee (pid);
+    unsigned long dr7;
+    int i;
+
+    for (i=0; i<PT_DR_SLOTS; i++) {
+        if (!(t->dr7 & (1UL << (i*2)))) {
+            break;
+        }
+    }
+    if (i == PT_DR_SLOTS) {
+        return -1;
+    }
+
+    // local enable bit for slot i; its R/W and LEN fields are left
+    // at 0, which means "break on instruction execution"
+    dr7 = t->dr7 | (1UL << (i*2));
+
+    if ((backend->set_dr (pid, i, addr) < 0) ||
+        (backend->set_dr (pid, 7, dr7) < 0)) {
+        return -1;
+    }
+    t->dr7 = dr7;
+
+    return i;
+}
+
+
+static void
+pt_hw_clear (pid_t pid, int slot)
+{
+    struct pt_tracee *t = pt_tracee (pid);
+
+    t->dr7 &= ~(1UL << (slot*2));
+
+    if (backend->set_dr (pid, 7, t->dr7) < 0) {
+        fprintf (stderr,
+                "CRITICAL ERROR: clearing debug register failed (%i)\n",
+                errno);
+        t->failed = 1;
+    }
+}
+
+
+// Set a breakpoint on addr for this thread.  If hw is set and one of the
+// debug registers DR0-DR3 is free, it is used; the text is then left
+// alone, which spares us the copy-on-write of the page and the
+// rewind/restore when the breakpoint is removed.  Otherwise an int3 is
+// written.  Either kind is reported as a SIGTRAP stop of the thread.
+void
+pt_insert_breakpoint (pid_t pid, Elf_Addr addr, int hw,
+                      struct pt_breakpoint *bp)
+{
+    bp->addr = addr;
+    bp->slot = hw ? pt_hw_set (pid, addr) : -1;
+    bp->opcode = 0;
+
+    if (bp->slot < 0) {
+        bp->opcode = pt_set_breakpoint (pid, addr);
+    }
+}
+
+
+// Take a breakpoint out again.  If the thread is sitting just past the
+// int3 (i.e. it has just hit it), it is moved back onto addr, so that
+// either way it resumes with the instruction at addr.
+void
+pt_remove_breakpoint (pid_t pid, struct pt_breakpoint *bp)
+{
+    unsigned char opcode = (unsigned char)bp->opcode;
+
+    if (bp->slot >= 0) {
+        pt_hw_clear (pid, bp->slot);
+    } else {
+        if (pt_get_eip (pid) == bp->addr + 1) {
+            pt_set_eip (pid, bp->addr);
+        }
+        pt_poke (pid, bp->addr, &opcode, 1);
+    }
+
+    bp->addr = 0;
 }
 
 void
 pt_rewind_eip (pid_t pid, int i)
 {
-    struct user_regs_struct regs;
+    struct user_regs_struct *regs = pt_regs (pid);
 
-    ptrace (PTRACE_GETREGS, pid, NULL, &regs);
-    
 #if _arch_i386_
-    regs.eip -= i;
+    regs->eip -= i;
 #elif _arch_x86_64_
-    regs.rip -= i;
+    regs->rip -= i;
 #endif
 
-    ptrace (PTRACE_SETREGS, pid, NULL, &regs);
+    pt_regs_dirty (pid);
 }
 
 void
 pt_set_eip (pid_t pid, Elf_Addr addr)
 {
-    struct user_regs_struct regs;
+    struct user_regs_struct *regs = pt_regs (pid);
 
-    ptrace (PTRACE_GETREGS, pid, NULL, &regs);
-    
 #if _arch_i386_
-    regs.eip = addr;
+    regs->eip = addr;
 #elif _arch_x86_64_
-    regs.rip = addr;
+    regs->rip = addr;
 #endif
 
-    ptrace (PTRACE_SETREGS, pid, NULL, &regs);
+    pt_regs_dirty (pid);
 }
 
 long
 pt_get_eip (pid_t pid)
 {
-    struct user_regs_struct regs;
+    struct user_regs_struct *regs = pt_regs (pid);
+
+#if _arch_i386_
+    return regs->eip;
+#elif _arch_x86_64_
+    return regs->rip;
+#endif
+
+}
+
+void
+pt_set_esp (pid_t pid, Elf_Addr addr)
+{
+    struct user_regs_struct *regs = pt_regs (pid);
+
+#if _arch_i386_
+    regs->esp = addr;
+#elif _arch_x86_64_
+    regs->rsp = addr;
+#endif
+
+    pt_regs_dirty (pid);
+}
+
+long
+pt_get_esp (pid_t pid)
+{
+    struct user_regs_struct *regs = pt_regs (pid);
 
-    ptrace (PTRACE_GETREGS, pid, NULL, &regs);
-    
 #if _arch_i386_
-    return regs.eip;
+    return regs->esp;
 #elif _arch_x86_64_
-    return regs.rip;
+    return regs->rsp;
 #endif
 
 }
@@ -272,17 +1460,15 @@ pt_get_eip (pid_t pid)
 void
 pt_set_eax (pid_t pid, Elf_Addr addr)
 {
-    struct user_regs_struct regs;
+    struct user_regs_struct *regs = pt_regs (pid);
 
-    ptrace (PTRACE_GETREGS, pid, NULL, &regs);
-    
 #if _arch_i386_
-    regs.eax = addr;
+    regs->eax = addr;
 #elif _arch_x86_64_
-    regs.rax = addr;
+    regs->rax = addr;
 #endif
 
-    ptrace (PTRACE_SETREGS, pid, NULL, &regs);
+    pt_regs_dirty (pid);
 }
 
 long
@@ -291,7 +1477,7 @@ pt_get_instruction (pid_t pid)
     long eip = pt_get_eip (pid);
     long inst;
 
-    pt_peek (pid, eip, &inst, 1);
+    pt_peek (pid, eip, &inst, sizeof (inst));
 
     return inst;
 }
@@ -306,24 +1492,3 @@ pt_stepover (pid_t pid, unsigned int step_bytes)
     pt_continue (pid);
     pt_rm_breakpoint (pid, old_inst);
 }
-
-int
-child_exited (pid_t pid)
-{
-    // This is a part of a nasty hack to get around wait not
-    // working properly when ptracing a willing child process
-
-    int fd;
-    char fn[FILENAME_MAX];
-
-    sprintf (fn, "/proc/%i/status", pid);
-    fd = open (fn, O_RDONLY);
-
-    if (fd < 0) {
-        close (fd);
-        return 1;
-    } else {
-        close (fd);
-        return 0;
-    }
-}
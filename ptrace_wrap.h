@@ -19,30 +19,125 @@
 #define _ptrace_wrap_h_
 
 #include "fossa.h"
+#include <signal.h>
+#include <sys/types.h>
 #include <sys/user.h>
 
+// While the caller has an event in hand, every thread of the
+// process that reported it is stopped.
+enum pt_event_type {
+    PT_EVENT_STOP,          /* trapped: breakpoint, single-step, exec */
+    PT_EVENT_SIGNAL,        /* stopped on delivery of another signal  */
+    PT_EVENT_EXIT,          /* exited normally                        */
+    PT_EVENT_KILLED         /* terminated by a signal                 */
+};
+
+struct pt_breakpoint {
+    Elf_Addr addr;          /* where it is (0 once removed)           */
+    int slot;               /* debug register used, -1 for an int3    */
+    long opcode;            /* byte under the int3                    */
+};
+
+struct pt_event {
+    enum pt_event_type type;
+    pid_t pid;              /* who the event belongs to               */
+    pid_t tid;              /* the thread that stopped                */
+    int sig;                /* stop or termination signal             */
+    int status;             /* exit status (PT_EVENT_EXIT)            */
+};
+
+// Everything ptrace_wrap does to a tracee goes through one of these.
+// The default backend is the real thing (ptrace(), waitpid(), ...);
+// sim.c provides an in-process simulated tracee for benchmarking.
+// Calls return < 0 on failure, like the system calls they stand for.
+struct pt_backend {
+    const char *name;
+    ssize_t (*read)       (pid_t pid, Elf_Addr addr, void *buf, size_t len);
+    ssize_t (*write)      (pid_t pid, Elf_Addr addr, void *buf, size_t len);
+    int     (*get_regs)   (pid_t pid, struct user_regs_struct *regs);
+    int     (*set_regs)   (pid_t pid, struct user_regs_struct *regs);
+    int     (*get_fpregs) (pid_t pid, struct user_fpregs_struct *fpregs);
+    int     (*set_fpregs) (pid_t pid, struct user_fpregs_struct *fpregs);
+    int     (*set_dr)     (pid_t pid, int i, unsigned long val);
+    int     (*resume)     (pid_t pid, int request, int sig);  /* CONT, SINGLESTEP, DETACH */
+    int     (*stop)       (pid_t tgid, pid_t pid);            /* send thread a SIGSTOP   */
+    pid_t   (*wait)       (int *status, int options);         /* waitpid (-1, ...)       */
+    int     (*siginfo)    (pid_t pid, siginfo_t *si);
+    int     (*eventmsg)   (pid_t pid, unsigned long *msg);
+    int     (*setoptions) (pid_t pid, int options);
+    pid_t   (*tgid)       (pid_t pid);                        /* process of a thread     */
+};
+
 void
-pt_attach (pid_t pid);
+pt_set_backend (struct pt_backend *b);
+
+struct pt_backend*
+pt_get_backend (void);
 
 void
+pt_attach (pid_t pid);
+
+int
 pt_detach (pid_t pid);
 
 void
 pt_allow_trace (void);
 
 void
+pt_forget (pid_t pid);
+
+void
+pt_trace_threads (pid_t pid);
+
+void
+pt_trace_forks (pid_t pid, int on);
+
+int
+pt_adopt (pid_t pid);
+
+void
+pt_kill (pid_t pid);
+
+void
+pt_interrupt (pid_t pid);
+
+void
+pt_cancel_syscall (pid_t pid);
+
+int
+pt_wait (pid_t pid, struct pt_event *ev);
+
+int
+pt_poll (struct pt_event *ev);
+
+int
+pt_failed (pid_t pid);
+
+int
+pt_resume (pid_t pid, int request, int sig);
+
+int
 pt_continue (pid_t pid);
 
-void 
+ssize_t
+pt_read (pid_t pid, Elf_Addr addr, void *vptr, size_t len);
+
+ssize_t
+pt_write (pid_t pid, Elf_Addr addr, void *vptr, size_t len);
+
+int
 pt_peek (pid_t pid, Elf_Addr addr, void *vptr, unsigned int len);
 
-void 
+int
 pt_poke (pid_t pid, Elf_Addr addr, void *vptr, unsigned int len);
 
+int
+pt_read_str (pid_t pid, Elf_Addr addr, char *buf, size_t size);
+
 char *
 pt_get_str (pid_t pid, Elf_Addr addr);
 
-void
+int
 pt_singlestep (pid_t pid);
 
 void
@@ -51,12 +146,25 @@ pt_get_regs (pid_t pid, struct user_regs_struct* regs);
 void
 pt_set_regs (pid_t pid, struct user_regs_struct* regs);
 
+void
+pt_get_fpregs (pid_t pid, struct user_fpregs_struct* fpregs);
+
+void
+pt_set_fpregs (pid_t pid, struct user_fpregs_struct* fpregs);
+
 long
 pt_set_breakpoint (pid_t pid, Elf_Addr addr);
 
 void
 pt_rm_breakpoint (pid_t pid, long old_opcode);
 
+void
+pt_insert_breakpoint (pid_t pid, Elf_Addr addr, int hw,
+                      struct pt_breakpoint *bp);
+
+void
+pt_remove_breakpoint (pid_t pid, struct pt_breakpoint *bp);
+
 void
 pt_rewind_eip (pid_t pid, int i);
 
@@ -66,6 +174,12 @@ pt_set_eip (pid_t pid, Elf_Addr addr);
 long
 pt_get_eip (pid_t pid);
 
+void
+pt_set_esp (pid_t pid, Elf_Addr addr);
+
+long
+pt_get_esp (pid_t pid);
+
 void
 pt_set_eax (pid_t pid, Elf_Addr addr);
 
@@ -75,7 +189,4 @@ pt_get_instruction (pid_t pid);
 void
 pt_stepover (pid_t pid, unsigned int step_bytes);
 
-int
-child_exited (pid_t pid);
-
 #endif /* #ifndef _ptrace_wrap_h_ */
@@ -0,0 +1,75 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "samples.h"
+
+// one-sided 95% points of Student's t, for 1 to 30 degrees of freedom
+static const double t95[] = {
+    6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812,
+    1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725,
+    1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697
+};
+
+
+void
+samples_add (struct samples *s, double x)
+{
+    double d = x - s->mean;
+
+    s->n++;
+    s->mean += d / s->n;
+    s->m2 += d * (x - s->mean);
+}
+
+
+// the sample variance (0 until there are two samples)
+double
+samples_var (struct samples *s)
+{
+    return (s->n > 1) ? s->m2 / (s->n - 1) : 0;
+}
+
+
+// Is a's mean below b's, with 95% confidence?  Welch's t-test, which
+// doesn't take the two to be equally noisy.  Both need two samples.
+int
+samples_less (struct samples *a, struct samples *b)
+{
+    double va, vb, se2, d, df, t;
+
+    if ((a->n < 2) || (b->n < 2) || (a->mean >= b->mean)) {
+        return 0;
+    }
+
+    va = samples_var (a) / a->n;
+    vb = samples_var (b) / b->n;
+    se2 = va + vb;
+    d = b->mean - a->mean;
+
+    // no spread at all: any difference is a real one
+    if (se2 == 0) {
+        return 1;
+    }
+
+    // Welch-Satterthwaite degrees of freedom
+    df = se2 * se2 / (va * va / (a->n - 1) + vb * vb / (b->n - 1));
+    t = (df < 1) ? t95[0] :
+        (df <= 30) ? t95[(int)df - 1] : 1.645;
+
+    // d / sqrt(se2) > t, without needing libm
+    return d * d > t * t * se2;
+}
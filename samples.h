@@ -0,0 +1,38 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _samples_h_
+#define _samples_h_
+
+// Running sample statistics (Welford's), for telling candidates apart
+// from a handful of noisy timings
+struct samples {
+    int n;
+    double mean;
+    double m2;              /* sum of squared deviations from the mean */
+};
+
+void
+samples_add (struct samples *s, double x);
+
+double
+samples_var (struct samples *s);
+
+int
+samples_less (struct samples *a, struct samples *b);
+
+#endif /* #ifndef _samples_h_ */
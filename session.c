@@ -0,0 +1,2293 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/prctl.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "ptrace_wrap.h"
+#include "elf_tools.h"
+#include "child_tools.h"
+#include "arena.h"
+#include "inject.h"
+#include "hash.h"
+#include "stats.h"
+#include "x86_decode.h"
+#include "isolate.h"
+#include "session.h"
+#include "checkpoint.h"
+
+// How much code session_step() looks ahead
+#define SESSION_CODE_WINDOW     128
+
+// The biggest loop session_step() will work out the exits of
+#define SESSION_MAX_LOOP        65536
+
+#if _arch_i386_
+#define SESSION_BITS            32
+#elif _arch_x86_64_
+#define SESSION_BITS            64
+#endif
+
+
+void
+set_mode (struct session *s, int planless)
+{
+    struct fossa_options *opt = &s->opt;
+
+    // NOTE
+    // planless = 0     ( a plan exists)
+    // planless = 1     (no plan exists)
+    // opt->mode = 0    (CUZMEM_RUN)
+    // opt->mode = 1    (CUZMEM_TUNE)
+
+    // --drift: a plan that planned runs found to have slowed down is
+    // tuned again, or done without, as asked
+    if (!planless && (opt->mode == 0) && s->drift.stale) {
+        if (opt->drift == DRIFT_RETUNE) {
+            fprintf (s->out, "fossa: the plan for `%s' has gone stale, "
+                             "tuning it again\n", opt->child_prg);
+            opt->mode = 1;
+            return;
+        }
+        if (opt->drift == DRIFT_PLANLESS) {
+            fprintf (s->out, "fossa: the plan for `%s' has gone stale, "
+                             "running without it\n", opt->child_prg);
+            planless = 1;
+        }
+    }
+
+    // no plan and run mode?  no sir!
+    if (planless && (opt->mode == 0)) {
+        fprintf (s->out,
+            "---------------------------------------------------------------------------\n"
+            "  fossa does not have an optimized memory configuration for `%s'\n"
+            "  Performance may be poor.  Run fossa in tune mode (--tune) to optimize \n"
+            "---------------------------------------------------------------------------\n\n",
+            opt->child_prg
+        );
+        // don't hold up every other job sharing our tracer
+        if (!s->shared) {
+            sleep (1);
+        }
+        opt->tuner = 0;     // use "no tune" tuner
+        opt->mode = 1;      // enter tuning mode
+    }
+    // we want to tune and we already have a plan
+    else if (!planless && (opt->mode == 1)) {
+        opt->mode = 1;
+    }
+    // are planless, want to tune?  ok
+    // not planless, want to run? ok, same thing
+    else {
+        opt->mode = planless;
+    }
+}
+
+
+struct toolbox*
+create_toolbox (struct arena *a, pid_t pid, struct sym_cache *syms, FILE *out)
+{
+    struct toolbox* tbox = arena_alloc (a, sizeof (struct toolbox));
+
+    // the optional instruments are looked up as they are needed
+    memset (tbox, 0, sizeof (struct toolbox));
+
+    fprintf (out, "fossa: Searching child's symbol table for instruments... ");
+    tbox->start       = child_dlsym_cached (pid, "cuzmem_start"       , "libcuzmem.so", syms);
+    tbox->end         = child_dlsym_cached (pid, "cuzmem_end"         , "libcuzmem.so", syms);
+    tbox->set_project = child_dlsym_cached (pid, "cuzmem_set_project" , "libcuzmem.so", syms);
+    tbox->set_plan    = child_dlsym_cached (pid, "cuzmem_set_plan"    , "libcuzmem.so", syms);
+    tbox->set_tuner   = child_dlsym_cached (pid, "cuzmem_set_tuner"   , "libcuzmem.so", syms);
+    tbox->check_plan  = child_dlsym_cached (pid, "cuzmem_check_plan"  , "libcuzmem.so", syms);
+
+    if ( (!tbox->start)       ||
+         (!tbox->end)         ||
+         (!tbox->set_project) ||
+         (!tbox->set_plan)    ||
+         (!tbox->set_tuner)   ||
+         (!tbox->check_plan) )
+    {
+        fprintf (out, "FAILED!\n\n");
+        fprintf (out, "  Please make sure libcuzmem.so (included with fossa) is in your\n"
+                      "  library path and is locatable by ld.so\n\n");
+        return NULL;
+    }
+
+    fprintf (out, "success.\n");
+
+    return tbox;
+}
+
+
+// Give up on the child: it is killed and the session is over
+static void
+session_slots_kill (struct session *s);
+
+static void
+session_fail (struct session *s)
+{
+    session_slots_kill (s);
+    if (s->snap && (s->snap != s->pid)) {
+        pt_kill (s->snap);
+    }
+    s->snap = 0;
+    kill (s->pid, SIGKILL);
+    s->status = 1;
+    s->state = SESSION_DETACHED;
+}
+
+
+static void
+session_resume (struct session *s, int request)
+{
+    s->step_req = request;
+    pt_resume (s->pid, request, 0);
+}
+
+
+// Plant an injection at the start of main() and let the child run it.
+// The next trap is the int3 at the end of the injection.
+static void
+session_inject (struct session *s, struct code_injection *inj,
+                enum session_state next)
+{
+    s->inj = inj;
+
+    // whatever the last injection needed is done with by now
+    arena_reset (s->scratch);
+    inject_begin (s->pid, s->main_start, inj, &s->ictx);
+    s->state = next;
+    session_resume (s, PTRACE_CONT);
+}
+
+
+static int
+session_inject_finish (struct session *s)
+{
+    return inject_finish (s->pid, s->main_start, s->inj, &s->ictx);
+}
+
+
+// How far past main_start the injections write
+static unsigned int
+session_inject_span (struct session *s)
+{
+    struct code_injection *inj[] = {
+        s->inj_check_plan, s->inj_start, s->inj_end,
+        s->inj_set_project, s->inj_set_plan, s->inj_set_tuner,
+        s->inj_atexit, s->inj_fork, s->inj_reap, s->inj_flush,
+        s->inj_next, s->inj_score
+    };
+    unsigned int i, span = 0;
+
+    for (i=0; i<sizeof (inj) / sizeof (inj[0]); i++) {
+        if (inj[i] && (inj[i]->length > span)) {
+            span = inj[i]->length;
+        }
+    }
+
+    return span;
+}
+
+
+// Has the child just come back from running main() untraced?
+static int
+session_at_site (struct session *s)
+{
+    Elf_Addr eip = pt_get_eip (s->pid);
+
+    return s->site_bp.addr &&
+           ((eip == s->site_bp.addr) ||
+            ((s->site_bp.slot < 0) && (eip == s->site_bp.addr + 1)));
+}
+
+
+// Note the loop latch (backward branch) at addr.  Returns 1 if it
+// has been seen before.
+static int
+session_loop_seen (struct session *s, Elf_Addr addr)
+{
+    int i;
+
+    for (i=0; i<s->nloops; i++) {
+        if (s->loops[i] == addr) {
+            return 1;
+        }
+    }
+
+    s->loops[s->next_loop] = addr;
+    s->next_loop = (s->next_loop + 1) % SESSION_MAX_LOOPS;
+    if (s->nloops < SESSION_MAX_LOOPS) {
+        s->nloops++;
+    }
+
+    return 0;
+}
+
+
+// Let the child run around the loop from head to the backward branch
+// at latch (len bytes long) until it leaves.  The loop's body is
+// decoded and every way out of it gets a breakpoint: branches to
+// outside of it, rets, and falling out of the bottom.  Returns 0, or
+// -1 if the exits can't be told (the body is too big, has an indirect
+// jump, or doesn't decode).
+static int
+session_skip_loop (struct session *s, Elf_Addr head, Elf_Addr latch,
+                   int len)
+{
+    Elf_Addr exits[SESSION_MAX_EXITS];
+    Elf_Addr end = latch + len, x;
+    struct x86_insn insn;
+    unsigned char *code;
+    size_t size = end - head;
+    int i, n = 0, off, ilen;
+
+    if (size > SESSION_MAX_LOOP) {
+        return -1;
+    }
+
+    // nothing else lives in scratch while main() is traced
+    arena_reset (s->scratch);
+    code = arena_alloc (s->scratch, size);
+    if (pt_read (s->pid, head, code, size) != size) {
+        return -1;
+    }
+
+    for (off=0; off<size; off+=ilen) {
+        ilen = x86_decode (code + off, size - off, head + off,
+                           SESSION_BITS, &insn);
+        if (!ilen) {
+            return -1;
+        }
+
+        switch (insn.flow) {
+        case X86_JMP_IND:
+            return -1;
+        case X86_RET:
+            x = head + off;
+            break;
+        case X86_JMP:
+        case X86_JCC:
+            x = insn.target;
+            if ((x >= head) && (x < end)) {
+                x = 0;
+            }
+            break;
+        default:
+            x = 0;
+            break;
+        }
+
+        // the bottom of the loop
+        if ((head + off + ilen == end) && (insn.flow == X86_JCC)) {
+            if (n == SESSION_MAX_EXITS) {
+                return -1;
+            }
+            exits[n++] = end;
+        }
+
+        if (!x) {
+            continue;
+        }
+        for (i=0; (i < n) && (exits[i] != x); i++);
+        if (i == n) {
+            if (n == SESSION_MAX_EXITS) {
+                return -1;
+            }
+            exits[n++] = x;
+        }
+    }
+
+    if (off != size) {
+        return -1;
+    }
+
+    for (i=0; i<n; i++) {
+        pt_insert_breakpoint (s->pid, exits[i], 1, &s->exit_bp[i]);
+    }
+    s->nexits = n;
+    session_resume (s, PTRACE_CONT);
+
+    return 0;
+}
+
+
+// Run main() straight to the first of the exits found in its CFG.  A
+// call that never comes back needs no breakpoint, and an indirect jump
+// which turns out not to leave is simply stepped on from.  Returns 0,
+// or -1 if there is no CFG or too many exits to breakpoint them all.
+static int
+session_run_to_exits (struct session *s)
+{
+    struct elf_cfg *cfg = s->cfg;
+    int i, n = 0;
+
+    if (!cfg) {
+        return -1;
+    }
+
+    for (i=0; i<cfg->nexits; i++) {
+        n += (cfg->exit[i].kind != ELF_EXIT_NORETURN);
+    }
+    if (!n || (n > SESSION_MAX_EXITS)) {
+        return -1;
+    }
+
+    n = 0;
+    for (i=0; i<cfg->nexits; i++) {
+        if (cfg->exit[i].kind != ELF_EXIT_NORETURN) {
+            pt_insert_breakpoint (s->pid, cfg->exit[i].addr, 1,
+                                  &s->exit_bp[n++]);
+        }
+    }
+    s->nexits = n;
+    session_resume (s, PTRACE_CONT);
+
+    return 0;
+}
+
+
+// Advance the child along main()'s execution path a basic block at a
+// time.  The straight line code up to the next branch is run in one go
+// with a breakpoint on the branch; calls are stepped over, other
+// branches are single-stepped to find out where they go.  A loop is
+// gone around once; the next time its backward branch comes up, the
+// child runs until it leaves the loop.  Once main()'s ret is reached a
+// breakpoint is put on it and 1 is returned with the child left
+// stopped on it.
+static int
+session_step (struct session *s)
+{
+    pid_t pid = s->pid;
+    Elf_Addr eip = pt_get_eip (pid);
+    unsigned char code[SESSION_CODE_WINDOW];
+    struct x86_insn insn;
+    ssize_t n;
+    int off, len = 0;
+
+    // find the end of the block
+    n = pt_read (pid, eip, code, sizeof (code));
+    for (off=0; off<n; off+=len) {
+        len = x86_decode (code + off, n - off, eip + off, SESSION_BITS, &insn);
+        if (!len || (insn.flow != X86_NEXT)) {
+            break;
+        }
+    }
+
+    // run up to it (or up to whatever we couldn't make sense of)
+    if (off > 0) {
+        pt_insert_breakpoint (pid, eip + off, 1, &s->step_bp);
+        session_resume (s, PTRACE_CONT);
+        return 0;
+    }
+
+    // we are on the branch
+    if (!len) {
+        session_resume (s, PTRACE_SINGLESTEP);
+        return 0;
+    }
+
+    switch (insn.flow) {
+    case X86_RET:
+        // break on ret.  The injections are written over the start of
+        // main(), and running them across a debug register breakpoint
+        // would trip it, so a ret that close gets an int3 instead
+        if (s->site_bp.addr) {
+            pt_remove_breakpoint (pid, &s->site_bp);
+        }
+        s->ret_site = 0;
+        pt_insert_breakpoint (pid, eip,
+                              eip >= s->main_start + session_inject_span (s),
+                              &s->ret_bp);
+        return 1;
+
+    case X86_CALL:
+    case X86_CALL_IND:
+        // don't step into, step over
+        pt_insert_breakpoint (pid, eip + len, 1, &s->step_bp);
+        session_resume (s, PTRACE_CONT);
+        return 0;
+
+    case X86_JCC:
+    case X86_JMP:
+        // back around a loop we have already been through?  Then
+        // let it run until it comes out
+        if ((insn.target <= eip) && session_loop_seen (s, eip) &&
+            !session_skip_loop (s, insn.target, eip, len)) {
+            return 0;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    session_resume (s, PTRACE_SINGLESTEP);
+
+    return 0;
+}
+
+
+// Kick off a pass through main(), starting with the start() injection
+static void
+session_sched (struct session *s);
+
+static void
+session_online_lost (struct session *s);
+
+static double
+session_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// --tune-budget: has tuning had all the time it gets?
+static int
+session_spent (struct session *s)
+{
+    return s->budget_end && (session_now () >= s->budget_end);
+}
+
+// --checkpoint: save the tuner as process pid has it, to go on with
+// iteration iter.  Once a checkpoint can't be written, no more are tried
+static void
+session_checkpoint (struct session *s, pid_t pid, int iter)
+{
+    if (s->ckpt && (checkpoint_save (s, pid, iter) < 0)) {
+        fprintf (s->out, "fossa: cannot write checkpoint `%s': %s\n",
+                 s->ckpt, strerror (errno));
+        s->ckpt = NULL;
+    }
+}
+
+// Tuning is over.  Unless it was the budget that ran out, so is the
+// campaign, and there is nothing left to resume
+static void
+session_tuned (struct session *s)
+{
+    fprintf (s->out, "fossa: Tuning Complete\n");
+
+    // --drift: the plan is new, and so is its baseline
+    if (s->drift_path) {
+        drift_reset (&s->drift, s->best_cand ? &s->best_cand->time : NULL);
+        drift_save (s->drift_path, &s->drift);
+    }
+
+    if (!s->ckpt) {
+        return;
+    }
+    if (session_spent (s)) {
+        fprintf (s->out, "fossa: tuning can be resumed from `%s'\n", s->ckpt);
+        return;
+    }
+    checkpoint_drop (s);
+}
+
+static void
+session_iterate (struct session *s)
+{
+    if (s->opt.budget && !s->budget_end) {
+        s->budget_end = session_now () + s->opt.budget;
+    }
+
+    // --jobs: passes are started as the tuner hands out candidates
+    if (s->nslots) {
+        s->state = SESSION_IDLE;
+        session_sched (s);
+        return;
+    }
+
+    stats_phase ("iteration %03i", s->iter);
+
+    if (s->opt.mode == 1 && s->opt.tuner != 0) {
+        fprintf (s->out, "fossa: Tuning Iteration: %03i\n", s->iter);
+        fprintf (s->out, "----------------------------\n");
+    }
+
+    // --fork: the pass is run by a new child, forked off the snapshot
+    if (s->snap) {
+        pt_trace_forks (s->snap, 1);
+        session_inject (s, s->inj_fork, SESSION_FORK);
+        return;
+    }
+
+    session_inject (s, s->inj_start, SESSION_START);
+}
+
+
+// --fork: have every pass run in a fork() of the child as it is now,
+// at main()'s entry with everything but cuzmem_start() done, so each
+// one starts out the same.  Nothing is carried from one pass to the
+// next but libcuzmem's globals, which is where the tuner keeps what it
+// has learned.  Returns 0, or -1 if the child can't be forked.
+static int
+session_fork_setup (struct session *s)
+{
+    s->tbox->fork    = child_dlsym_cached (s->pid, "__fork"   , "libc.so", s->syms);
+    s->tbox->waitpid = child_dlsym_cached (s->pid, "__waitpid", "libc.so", s->syms);
+    s->tbox->fflush  = child_dlsym_cached (s->pid, "_IO_fflush", "libc.so", s->syms);
+    s->nkeep = child_lib_data (s->pid, "libcuzmem.so", s->keep,
+                                SESSION_MAX_SEGS);
+
+    if (!s->tbox->fork || !s->tbox->waitpid || !s->tbox->fflush ||
+        !s->nkeep) {
+        return -1;
+    }
+
+    // the passes are forked by the snapshot, so once it is gone, the
+    // last of them would be nobody's to wait for
+    prctl (PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+
+    s->inj_fork = inject_build_fork (s->arena, s->tbox->fork);
+    s->inj_reap = inject_build_waitpid (s->arena, s->tbox->waitpid);
+    s->inj_flush = inject_build_fflush (s->arena, s->tbox->fflush);
+    s->snap = s->pid;
+
+    return 0;
+}
+
+
+// --fork: copy libcuzmem's globals from this pass's child over to the
+// snapshot, a page at a time, leaving the pages that are the same
+static void
+session_fork_keep (struct session *s)
+{
+    unsigned char *now, *was;
+    size_t off, n, len, page = getpagesize ();
+    Elf_Addr addr;
+    int i;
+
+    for (i=0; i<s->nkeep; i++) {
+        addr = s->keep[i].addr;
+        len = s->keep[i].len;
+
+        arena_reset (s->scratch);
+        now = arena_alloc (s->scratch, len);
+        was = arena_alloc (s->scratch, len);
+        if ((pt_read (s->pid, addr, now, len) != len) ||
+            (pt_read (s->snap, addr, was, len) != len)) {
+            continue;
+        }
+
+        for (off=0; off<len; off+=n) {
+            n = page - ((addr + off) % page);
+            if (n > len - off) {
+                n = len - off;
+            }
+            if (memcmp (now + off, was + off, n)) {
+                pt_write (s->snap, addr + off, now + off, n);
+            }
+        }
+    }
+}
+
+
+// --fork: this pass's child is done with (the caller has seen to it).
+// Go back to the snapshot, collect the child there, and fork the next
+static void
+session_fork_next (struct session *s)
+{
+    s->stopping = 0;
+    s->pid = s->snap;
+    session_inject (s, s->inj_reap, SESSION_REAP);
+}
+
+
+// --fork: the pass's child was killed before cuzmem_end() got to score
+// the pass.  The snapshot is as it was, so the same plan gets another
+// go, up to a point
+static void
+session_fork_lost (struct session *s, int sig)
+{
+    fprintf (s->out, "fossa: iteration %03i lost (signal %i)\n", s->iter, sig);
+    pt_forget (s->pid);
+
+    if (s->online) {
+        session_online_lost (s);
+        return;
+    }
+
+    if (++s->lost == SESSION_MAX_LOST) {
+        fprintf (s->out, "fossa: giving up after %i lost iterations\n", s->lost);
+        s->pid = s->snap;
+        session_fail (s);
+        return;
+    }
+
+    session_fork_next (s);
+}
+
+
+// --fork: the pass's child is about to die of a fault in main().  Wind
+// it back to main()'s entry instead and have cuzmem_end() score the
+// pass, so the campaign moves on.  Returns 1 if it was.
+static int
+session_fork_crash (struct session *s, int sig)
+{
+    if (!s->snap || (s->pid == s->snap) ||
+        ((s->state != SESSION_START) && (s->state != SESSION_TRACE) &&
+         (s->state != SESSION_RUN))) {
+        return 0;
+    }
+
+    switch (sig) {
+    case SIGSEGV:
+    case SIGBUS:
+    case SIGILL:
+    case SIGFPE:
+    case SIGABRT:
+        break;
+    default:
+        return 0;
+    }
+
+    // one it deals with itself is none of ours
+    if (child_sig_caught (s->pid, sig)) {
+        return 0;
+    }
+
+    fprintf (s->out, "fossa: iteration %03i crashed (signal %i)\n", s->iter, sig);
+    if (s->online) {
+        pt_kill (s->pid);
+        session_online_lost (s);
+        return 1;
+    }
+    s->crashed = sig;
+    s->rep = 0;
+    pt_set_esp (s->pid, s->entry_sp);
+    pt_set_eip (s->pid, s->main_start);
+    if (s->parent) {
+        s->score = -1;
+        s->state = SESSION_SCORED;
+        session_sched (s->parent);
+        return 1;
+    }
+
+    session_inject (s, s->inj_end, SESSION_END);
+
+    return 1;
+}
+
+
+// --race, --tune-budget: the pass's child has stopped for the SIGSTOP
+// session_race() sent it.  If it is still in main(), it is wound back
+// and scored like a crashed pass; otherwise it made it after all.
+static void
+session_fork_raced (struct session *s)
+{
+    s->stopping = 0;
+
+    if (s->state != SESSION_RUN) {
+        pt_resume (s->pid, PTRACE_CONT, 0);
+        return;
+    }
+
+    if (s->online) {
+        pt_kill (s->pid);
+        session_online_lost (s);
+        return;
+    }
+
+    s->raced = 1;
+    s->rep = 0;
+    pt_cancel_syscall (s->pid);
+    pt_set_esp (s->pid, s->entry_sp);
+    pt_set_eip (s->pid, s->main_start);
+    session_inject (s, s->inj_end, SESSION_END);
+}
+
+
+// --jobs: run several passes at once, each of them a fork() of the
+// snapshot.  The tuner has to be up to it: cuzmem_next() picks the
+// candidate for the pass forked next, or returns -1 if it has none
+// until more results are in; cuzmem_score() rates a pass, where
+// cuzmem_end() would have; cuzmem_report() hands that back to the
+// tuner in the snapshot.  Returns 0, or -1 if libcuzmem lacks them.
+static int
+session_jobs_setup (struct session *s)
+{
+    s->tbox->next   = child_dlsym_cached (s->pid, "cuzmem_next"  , "libcuzmem.so", s->syms);
+    s->tbox->score  = child_dlsym_cached (s->pid, "cuzmem_score" , "libcuzmem.so", s->syms);
+    s->tbox->report = child_dlsym_cached (s->pid, "cuzmem_report", "libcuzmem.so", s->syms);
+
+    if (!s->tbox->next || !s->tbox->score || !s->tbox->report) {
+        return -1;
+    }
+
+    // both take nothing and return an int, like cuzmem_end()
+    s->inj_next  = inject_build_end (s->arena, s->tbox->next);
+    s->inj_score = inject_build_end (s->arena, s->tbox->score);
+    s->report = arena_create (64);
+    s->nslots = (s->opt.jobs < SESSION_MAX_JOBS) ? s->opt.jobs
+                                                 : SESSION_MAX_JOBS;
+
+    // --samples: a candidate can only be timed again if the tuner can
+    // be set back to it (cuzmem_repeat()).  cuzmem_best() hears which
+    // one fossa trusts to be quickest, if the tuner wants to know
+    if (s->opt.samples > 1) {
+        s->tbox->repeat = child_dlsym_cached (s->pid, "cuzmem_repeat",
+                                              "libcuzmem.so", s->syms);
+        s->tbox->best   = child_dlsym_cached (s->pid, "cuzmem_best"  ,
+                                              "libcuzmem.so", s->syms);
+        if (s->tbox->repeat) {
+            s->cands = arena_alloc (s->arena,
+                                    SESSION_MAX_CANDS * sizeof (struct cand));
+        } else {
+            fprintf (s->out, "fossa: libcuzmem can't go back to a candidate, "
+                             "each will be timed once\n");
+        }
+    }
+
+    return 0;
+}
+
+
+// --jobs: give a new pass's child a free slot.  It is driven as a
+// session of its own, sharing all that the snapshot's has set up.
+// Returns NULL if every slot is taken.
+static struct session*
+session_slot_new (struct session *s, pid_t pid)
+{
+    struct session *c;
+    struct arena *scratch;
+    int i;
+
+    for (i=0; (i < s->nslots) && s->slot[i] && s->slot[i]->pid; i++);
+
+    if (i == s->nslots) {
+        return NULL;
+    }
+    if (!s->slot[i]) {
+        s->slot[i] = arena_alloc (s->arena, sizeof (struct session));
+        s->slot[i]->scratch = arena_create (256);
+    }
+    c = s->slot[i];
+    scratch = c->scratch;
+
+    *c = *s;
+    c->parent = s;
+    c->nslots = 0;
+    c->pid = pid;
+    c->snap = s->pid;
+    c->scratch = scratch;
+    c->ictx.arena = scratch;
+    c->inj_end = s->inj_score;
+    c->candidate = s->next;
+    c->iter = s->iter++;
+
+    // the fork() injection is put back in it from backups of its own,
+    // as the snapshot's won't last
+    arena_reset (scratch);
+    c->fork_ctx.backup = arena_alloc (scratch, s->inj_fork->length);
+    memcpy (c->fork_ctx.backup, s->fork_ctx.backup, s->inj_fork->length);
+
+    c->state = SESSION_FORKED;
+
+    return c;
+}
+
+
+// --jobs: kill off whatever passes are running
+static void
+session_slots_kill (struct session *s)
+{
+    int i;
+
+    for (i=0; i<s->nslots; i++) {
+        if (s->slot[i] && s->slot[i]->pid) {
+            if (!s->slot[i]->gone) {
+                pt_kill (s->slot[i]->pid);
+            }
+            s->slot[i]->pid = 0;
+        }
+    }
+}
+
+
+// --jobs: a pass's child went away.  Killed, the pass is scored as a
+// failure; having exit()ed, it took the program with it, just as it
+// would have without --jobs
+static void
+session_slot_gone (struct session *c, struct pt_event *ev)
+{
+    struct session *s = c->parent;
+
+    pt_forget (c->pid);
+    c->gone = 1;
+
+    if ((ev->type == PT_EVENT_EXIT) && (c->state != SESSION_FLUSH)) {
+        session_slots_kill (s);
+        pt_kill (s->pid);
+        s->snap = 0;
+        s->status = ev->status;
+        s->state = SESSION_DONE;
+        return;
+    }
+
+    if (c->state != SESSION_FLUSH) {
+        fprintf (s->out, "fossa: iteration %03i lost (signal %i)\n",
+                 c->iter, ev->sig);
+        c->score = -1;
+    }
+    c->state = SESSION_SCORED;
+    session_sched (s);
+}
+
+
+// --samples: what is known of a candidate, NULL if there is no room
+static struct cand*
+session_cand (struct session *s, int candidate)
+{
+    struct cand *k;
+    int i;
+
+    for (i=0; i<s->ncands; i++) {
+        if (s->cands[i].candidate == candidate) {
+            return &s->cands[i];
+        }
+    }
+
+    if (s->ncands == SESSION_MAX_CANDS) {
+        return NULL;
+    }
+
+    k = &s->cands[s->ncands++];
+    memset (k, 0, sizeof (struct cand));
+    k->candidate = candidate;
+
+    return k;
+}
+
+
+// --samples: take in how the pass c went, and decide whether its
+// candidate is worth timing again: only one that might yet prove to
+// be quicker than the best so far is.  Being quicker takes a Welch
+// t-test passed at 95%, not a lucky run.  The first pass is a warm-up
+// (cold caches, page tables, ...) and isn't timed.  Returns 1 to time
+// it again, 2 if it has just become the best, 0 if it is done with.
+static int
+session_judge (struct session *s, struct session *c)
+{
+    struct cand *k = s->cands ? session_cand (s, c->candidate) : NULL;
+    struct cand *b = s->best_cand;
+
+    if (!k) {
+        return 0;
+    }
+
+    if (c->score < 0) {
+        k->failed = 1;
+        return 0;
+    }
+    k->score += c->score;
+    k->nscore++;
+    if (c->iter > s->iter0) {
+        samples_add (&k->time, c->elapsed);
+    }
+
+    if (k == b) {
+        return 0;
+    }
+
+    if (!b) {
+        if ((k->time.n < 2) && !session_spent (s)) {
+            return 1;
+        }
+        if (!k->time.n) {
+            return 0;
+        }
+        s->best_cand = k;
+        return 2;
+    }
+
+    if (samples_less (&k->time, &b->time)) {
+        s->best_cand = k;
+        return 2;
+    }
+
+    if ((k->time.n >= s->opt.samples) || session_spent (s) ||
+        (k->time.n && (k->time.mean >= b->time.mean))) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+// --jobs: the pass in slot s->cur is done with, and its child can go
+static void
+session_slot_done (struct session *s)
+{
+    struct session *c = s->slot[s->cur];
+
+    if (!c->gone) {
+        pt_kill (c->pid);
+    }
+    c->pid = 0;
+    s->starved = 0;
+    session_inject (s, s->inj_reap, SESSION_REAP);
+}
+
+
+// --jobs: tell the tuner how the candidate of the pass in slot s->cur
+// did: with --samples, its passes' mean score, or -1 if any failed
+static void
+session_report (struct session *s)
+{
+    struct session *c = s->slot[s->cur];
+    struct cand *k = s->cands ? session_cand (s, c->candidate) : NULL;
+    int score = c->score;
+
+    if (k && k->failed) {
+        score = -1;
+    } else if (k && k->nscore) {
+        score = k->score / k->nscore;
+    }
+
+    arena_reset (s->report);
+    session_inject (s, inject_build_report (s->report, s->tbox->report,
+                                            c->candidate, score),
+                    SESSION_REPORT);
+}
+
+
+// --jobs: find the snapshot something to do, if it is free.  Scores
+// are reported first, as the tuner may need them to come up with more
+// candidates; then free slots are filled.  Once the tuner has run dry
+// and no pass is left, the snapshot runs the last pass.
+static void
+session_sched (struct session *s)
+{
+    struct session *c;
+    int i, busy = 0;
+
+    if (s->state != SESSION_IDLE) {
+        return;
+    }
+
+    // --samples: the tuner is set to run a candidate again; nothing
+    // may come between that and the fork()
+    if (s->again) {
+        s->again = 0;
+        pt_trace_forks (s->pid, 1);
+        session_inject (s, s->inj_fork, SESSION_FORK);
+        return;
+    }
+
+    // cuzmem_repeat() and cuzmem_best() take just the one int, the
+    // other is left unread
+    for (i=0; i<s->nslots; i++) {
+        c = s->slot[i];
+        if (!c || !c->pid) {
+            continue;
+        }
+        if (c->state == SESSION_SCORED) {
+            s->cur = i;
+            arena_reset (s->report);
+            switch (session_judge (s, c)) {
+            case 1:
+                session_inject (s, inject_build_report (s->report, s->tbox->repeat,
+                                                        c->candidate, 0),
+                                SESSION_REPEAT);
+                return;
+            case 2:
+                if (s->tbox->best) {
+                    session_inject (s, inject_build_report (s->report, s->tbox->best,
+                                                            c->candidate, 0),
+                                    SESSION_BEST);
+                    return;
+                }
+                break;
+            }
+            session_report (s);
+            return;
+        }
+        busy++;
+    }
+
+    if (!s->starved && !session_spent (s) && (busy < s->nslots)) {
+        session_inject (s, s->inj_next, SESSION_NEXT);
+        return;
+    }
+
+    if (busy) {
+        return;
+    }
+
+    if (s->best_cand) {
+        fprintf (s->out, "fossa: quickest candidate: %i (%.6f s, mean of %i runs)\n",
+                 s->best_cand->candidate, s->best_cand->time.mean,
+                 s->best_cand->time.n);
+    }
+
+    // no pass finished main(), so the snapshot runs one last pass
+    // itself and is let go, as with --fork
+    s->nslots = 0;
+    s->snap = 0;
+    s->tuned = 1;
+    session_iterate (s);
+}
+
+
+// --drift: a planned run is over.  Put its time on the plan's record,
+// and see whether the plan still holds up
+static void
+session_drift (struct session *s)
+{
+    struct samples now;
+    struct drift *d = &s->drift;
+
+    drift_add (d, s->elapsed);
+    if (drift_check (d, &now)) {
+        fprintf (s->out, "fossa: `%s' has slowed down since it was tuned: "
+                         "main() takes %.6f s, against %.6f s\n",
+                 s->opt.child_prg, now.mean, d->base.mean);
+        if (!d->stale && (s->opt.drift == DRIFT_RETUNE)) {
+            fprintf (s->out, "fossa: its plan will be tuned again next run\n");
+        } else if (!d->stale && (s->opt.drift == DRIFT_PLANLESS)) {
+            fprintf (s->out, "fossa: its plan won't be used until it is "
+                             "tuned again\n");
+        }
+        d->stale = 1;
+    }
+
+    if (drift_save (s->drift_path, d) < 0) {
+        fprintf (s->out, "fossa: cannot write `%s': %s\n", s->drift_path,
+                 strerror (errno));
+    }
+}
+
+
+// Let the child run on its own from here.  A fork() of a --zygote is
+// the zygote's child, not ours, so its exit would only be ours to see
+// while it is traced: it stays so, left to run
+static void
+session_detach (struct session *s)
+{
+    // one that a ptrace call failed on is not let go as it is
+    if (pt_failed (s->pid) || (!s->zygote && (pt_detach (s->pid) < 0))) {
+        fprintf (s->out, "fossa: lost control of `%s'\n", s->opt.child_prg);
+        session_fail (s);
+        return;
+    }
+    if (s->zygote) {
+        session_resume (s, PTRACE_CONT);
+    }
+    s->state = SESSION_DETACHED;
+}
+
+
+// Let the child go on with main()'s return.  It is at main()'s entry,
+// back from the last injection
+static void
+session_let_go (struct session *s)
+{
+    // jump back to main()'s ret and take the breakpoint off it.
+    // If it's on the return site we are past the ret, so finish it off
+    stats_phase ("detach");
+    if (s->ret_site) {
+        pt_set_esp (s->pid, s->entry_sp + sizeof (Elf_Addr));
+    }
+    pt_set_eip (s->pid, s->ret_bp.addr);
+    pt_remove_breakpoint (s->pid, &s->ret_bp);
+
+    // let main() return
+    session_detach (s);
+}
+
+
+// --online: a production run that has a plan tries out one of the
+// tuner's candidates, in a fork() of the child at main()'s entry.
+// Should it crash, or take --race times as long as the plan, it is
+// killed and the plan is run in the snapshot instead: the run's work
+// gets done either way, and no run costs more than that.  What came
+// of it is kept on record under the plan's hash, for the next run to
+// go on from, with the tuner's state if libcuzmem can save and load
+// it (cuzmem_save(), cuzmem_load()).  The plan is timed first;
+// a candidate that then beats it by Welch's test (which takes two
+// runs of it, --samples at most) is made the plan by cuzmem_best().
+// Returns 0, or -1 if libcuzmem isn't up to it.
+static int
+session_online_setup (struct session *s)
+{
+    if (session_fork_setup (s)) {
+        return -1;
+    }
+
+    s->tbox->next   = child_dlsym_cached (s->pid, "cuzmem_next"  , "libcuzmem.so", s->syms);
+    s->tbox->score  = child_dlsym_cached (s->pid, "cuzmem_score" , "libcuzmem.so", s->syms);
+    s->tbox->report = child_dlsym_cached (s->pid, "cuzmem_report", "libcuzmem.so", s->syms);
+    s->tbox->repeat = child_dlsym_cached (s->pid, "cuzmem_repeat", "libcuzmem.so", s->syms);
+    s->tbox->best   = child_dlsym_cached (s->pid, "cuzmem_best"  , "libcuzmem.so", s->syms);
+
+    if (!s->tbox->next || !s->tbox->score || !s->tbox->report ||
+        !s->tbox->best) {
+        s->snap = 0;
+        return -1;
+    }
+
+    // the record has what fossa made of the candidates either way
+    s->tbox->save   = child_dlsym_cached (s->pid, "cuzmem_save"  , "libcuzmem.so", s->syms);
+    s->tbox->load   = child_dlsym_cached (s->pid, "cuzmem_load"  , "libcuzmem.so", s->syms);
+    if (!s->tbox->save || !s->tbox->load) {
+        s->tbox->save = s->tbox->load = 0;
+    }
+
+    s->inj_next  = inject_build_end (s->arena, s->tbox->next);
+    s->inj_score = inject_build_end (s->arena, s->tbox->score);
+    s->inj_try   = inject_build_start (s->arena, s->tbox->start, 1);
+    s->report = arena_create (64);
+    s->cands = arena_alloc (s->arena, SESSION_MAX_CANDS * sizeof (struct cand));
+
+    if (!s->ckpt) {
+        s->ckpt = checkpoint_path (s->arena, &s->opt, ".online");
+    }
+    if (!s->opt.race) {
+        s->opt.race = SESSION_ONLINE_RACE;
+    }
+    s->online = SESSION_ONLINE_PLAN;
+
+    return 0;
+}
+
+
+// --online: run the plan, without a fork() to fall back on
+static void
+session_online_plan (struct session *s)
+{
+    s->snap = 0;
+    s->online = SESSION_ONLINE_PLAN;
+    session_iterate (s);
+}
+
+
+// --online: the run is to try candidate, or, if the tuner has none
+// (-1), the plan
+static void
+session_online_try (struct session *s, int candidate)
+{
+    if (candidate < 0) {
+        fprintf (s->out, "fossa: no candidates left to try, running the plan\n");
+        session_online_plan (s);
+        return;
+    }
+
+    fprintf (s->out, "fossa: trying candidate %i against the plan (%.6f s)\n",
+             candidate, s->best);
+    s->candidate = candidate;
+    s->online = SESSION_ONLINE_TRY;
+    session_iterate (s);
+}
+
+
+// --online: what is this run to be?  Until the plan has been timed
+// twice, the plan.  Then a candidate that did better than it, though
+// not yet often enough to be trusted, goes again; failing that, the
+// tuner hands out a new one
+static void
+session_online (struct session *s)
+{
+    struct cand *plan = session_cand (s, SESSION_PLAN), *k;
+    int i, most = (s->opt.samples > 2) ? s->opt.samples : 2;
+
+    if (plan->time.n < 2) {
+        fprintf (s->out, "fossa: timing the plan\n");
+        session_online_plan (s);
+        return;
+    }
+
+    s->best = plan->time.mean;
+    for (i=0; s->tbox->repeat && (i<s->ncands); i++) {
+        k = &s->cands[i];
+        if ((k->candidate != SESSION_PLAN) && !k->failed &&
+            (k->time.n < most) && (k->time.mean < plan->time.mean)) {
+            s->candidate = k->candidate;
+            arena_reset (s->report);
+            session_inject (s, inject_build_report (s->report, s->tbox->repeat,
+                                                    k->candidate, 0),
+                            SESSION_REPEAT);
+            return;
+        }
+    }
+
+    session_inject (s, s->inj_next, SESSION_NEXT);
+}
+
+
+// --online: tell the tuner how the candidate did (-1: it failed)
+static void
+session_online_report (struct session *s)
+{
+    arena_reset (s->report);
+    session_inject (s, inject_build_report (s->report, s->tbox->report,
+                                            s->candidate, s->score),
+                    SESSION_REPORT);
+}
+
+
+// --online: the candidate didn't make it.  It crashed, ran over or was
+// killed (the caller has seen to its child).  The snapshot collects
+// the child, and the tuner there hears the candidate failed
+static void
+session_online_lost (struct session *s)
+{
+    struct cand *k = session_cand (s, s->candidate);
+
+    if (k) {
+        k->failed = 1;
+    }
+    s->score = -1;
+    s->crashed = 0;
+    s->raced = 0;
+    s->stopping = 0;
+    s->pid = s->snap;
+    session_inject (s, s->inj_reap, SESSION_REAP);
+}
+
+
+// --online: the run is over but for main()'s return.  Put it on
+// record, and let it return
+static void
+session_online_done (struct session *s)
+{
+    session_checkpoint (s, s->pid, s->iter + 1);
+    if (s->snap) {
+        pt_kill (s->snap);
+        s->snap = 0;
+    }
+    session_let_go (s);
+}
+
+
+// --online: main() is done with.  The plan's time simply goes on
+// record; a candidate's score is first told to the tuner
+static void
+session_online_end (struct session *s, int score)
+{
+    struct cand *k;
+
+    if (s->online == SESSION_ONLINE_PLAN) {
+        k = session_cand (s, SESSION_PLAN);
+        samples_add (&k->time, s->elapsed);
+        session_online_done (s);
+        return;
+    }
+
+    k = session_cand (s, s->candidate);
+    if (k) {
+        samples_add (&k->time, s->elapsed);
+        k->score += score;
+        k->nscore++;
+    }
+    s->score = score;
+    session_online_report (s);
+}
+
+
+// --online: the tuner has heard how the candidate did.  If it failed,
+// the snapshot runs the plan in its place.  If it has proven quicker
+// than the plan, it becomes the plan
+static void
+session_online_reported (struct session *s)
+{
+    struct cand *plan = session_cand (s, SESSION_PLAN);
+    struct cand *k = session_cand (s, s->candidate);
+
+    if (s->pid == s->snap) {
+        fprintf (s->out, "fossa: candidate %i failed, running the plan\n",
+                 s->candidate);
+        session_checkpoint (s, s->pid, s->iter + 1);
+        session_online_plan (s);
+        return;
+    }
+
+    if (k && samples_less (&k->time, &plan->time)) {
+        fprintf (s->out, "fossa: candidate %i is quicker than the plan "
+                         "(%.6f s to %.6f s), it is the plan now\n",
+                 k->candidate, k->time.mean, plan->time.mean);
+        plan->time = k->time;
+        s->best_cand = k;
+        arena_reset (s->report);
+        session_inject (s, inject_build_report (s->report, s->tbox->best,
+                                                k->candidate, 0),
+                        SESSION_BEST);
+        return;
+    }
+
+    session_online_done (s);
+}
+
+
+// Call main() again, as it was called the first time
+static void
+session_recall (struct session *s)
+{
+    pt_set_regs (s->pid, &s->entry_regs);
+    if (s->ictx.fp) {
+        pt_set_fpregs (s->pid, &s->entry_fpregs);
+    }
+}
+
+
+// main() is about to return.  Move PC back to start of main() so
+// that we can be sure we have enough room to inject code :-)
+// and inject the end() call
+static void
+session_main_done (struct session *s)
+{
+    struct session *r;
+    double elapsed;
+
+    // --reps: call it again, as it was called the first time, before
+    // this pass is over
+    if (++s->rep < s->opt.reps) {
+        session_recall (s);
+        s->state = SESSION_RUN;
+        session_resume (s, PTRACE_CONT);
+        return;
+    }
+    s->rep = 0;
+
+    // --race: the quickest pass yet sets the pace
+    r = s->parent ? s->parent : s;
+    elapsed = session_now () - s->pass_t0;
+    s->elapsed = elapsed;
+    if (!r->best || (elapsed < r->best)) {
+        r->best = elapsed;
+    }
+
+    // caught on the return site, main()'s ret has already popped the
+    // return address.  Put it back, so the stack is the same as at
+    // the ret (which is where --step catches it)
+    if (s->ret_site) {
+        pt_set_esp (s->pid, s->entry_sp);
+    }
+
+    pt_set_eip (s->pid, s->main_start);
+    session_inject (s, (s->online == SESSION_ONLINE_TRY) ? s->inj_score
+                                                         : s->inj_end,
+                    SESSION_END);
+}
+
+
+// cuzmem_start() is done: run main()
+static void
+session_run_main (struct session *s)
+{
+    s->pass_t0 = session_now ();
+
+    // with --step, the first pass finds main()'s ret: straight
+    // away, if every way out of main() could be told from its
+    // CFG, otherwise by walking main().  Should a loop it runs
+    // through leave some way other than at the bottom, the trace is
+    // lost: main() is then caught where it returns to instead
+    if (s->iter == s->iter0 && s->opt.step && !s->parent) {
+        pt_insert_breakpoint (s->pid, s->ret_addr, 1, &s->site_bp);
+        s->state = SESSION_TRACE;
+        if (!session_run_to_exits (s)) {
+            return;
+        }
+        if (session_step (s)) {
+            session_main_done (s);
+        }
+        return;
+    }
+
+    // otherwise the child is caught where main() returns to, so
+    // main() runs at full speed and stops exactly once, whatever
+    // way it goes.  The return site is nowhere near main(), so the
+    // injections can't trip a debug register breakpoint on it
+    if ((s->iter == s->iter0) || s->parent || !s->ret_bp.addr) {
+        pt_insert_breakpoint (s->pid, s->ret_addr, 1, &s->ret_bp);
+        s->ret_site = 1;
+    } else if (s->snap) {
+        // --fork: a new child is at main()'s entry already, but has
+        // none of our breakpoints
+        pt_insert_breakpoint (s->pid, s->ret_bp.addr, s->ret_site ||
+                              (s->ret_bp.addr >= s->main_start + session_inject_span (s)),
+                              &s->ret_bp);
+    } else {
+        session_recall (s);
+    }
+    s->state = SESSION_RUN;
+    session_resume (s, PTRACE_CONT);
+}
+
+
+// The child is stopped at main()'s entry.  Find libcuzmem in it and
+// ask whether this program has a plan
+static void
+session_at_main (struct session *s)
+{
+    // remember what main() was called with, to call it again with
+    // on the following passes, and where it returns to
+    pt_get_regs (s->pid, &s->entry_regs);
+    if (s->ictx.fp) {
+        pt_get_fpregs (s->pid, &s->entry_fpregs);
+    }
+    s->entry_sp = pt_get_esp (s->pid);
+    pt_peek (s->pid, s->entry_sp, &s->ret_addr, sizeof (Elf_Addr));
+
+    // from here on, main_start is where the injections go
+    s->main_start = inject_site (s->pid, s->main_start);
+
+    // --zygote: a fork()ed child has the zygote's
+    if (!s->tbox) {
+        s->tbox = create_toolbox (s->arena, s->pid, s->syms, s->out);
+    }
+    if (!s->tbox) {
+        session_fail (s);
+        return;
+    }
+    s->plan_hash = hash (&s->opt);
+
+    // setup project directory for this child program
+    sprintf (s->project, "fossa/%s", s->opt.child_prg);
+
+    // launch check_plan injection to see if this program has a plan
+    stats_phase ("check_plan");
+    s->inj_check_plan = inject_build_checkplan (s->arena,
+                                                s->tbox->check_plan,
+                                                s->project, s->plan_hash);
+    session_inject (s, s->inj_check_plan, SESSION_CHECK_PLAN);
+}
+
+
+static struct session*
+session_new (struct fossa_options *opt, pid_t pid, Elf_Addr main_start,
+             FILE *out)
+{
+    struct arena *arena = arena_create (4096);
+    struct session *s = arena_alloc (arena, sizeof (struct session));
+    char *func = opt->roi ? opt->roi : "main";
+
+    memset (s, 0, sizeof (struct session));
+    s->arena = arena;
+    s->scratch = arena_create (256);
+    s->ictx.arena = s->scratch;
+    // a function other than main() may take or return floating point
+    s->ictx.fp = (opt->roi != NULL);
+    s->opt = *opt;
+    s->out = out;
+    s->pid = pid;
+    s->main_start = main_start;
+
+    if (opt->ckpt || opt->resume) {
+        s->ckpt = checkpoint_path (s->arena, opt, ".ckpt");
+    }
+    if (opt->drift) {
+        s->drift_path = drift_path (s->arena, opt);
+    }
+
+    // --step can break on all of main()'s exits at once if it knows them
+    if (opt->step) {
+        s->cfg = elf_get_cfg (s->arena, opt->child_argv[0], func);
+    }
+
+    return s;
+}
+
+
+// A new session whose child a ptrace call failed on is no good: the
+// child is killed, and NULL returned in its place
+static struct session*
+session_check (struct session *s)
+{
+    if (!pt_failed (s->pid)) {
+        return s;
+    }
+
+    fprintf (s->out, "fossa: cannot trace `%s'\n", s->opt.child_prg);
+    pt_kill (s->pid);
+    session_destroy (s);
+
+    return NULL;
+}
+
+
+// Start driving a child that has been launched and is stopped before
+// main() (at main_start).  Every following step happens in
+// session_event() as the child traps.
+struct session*
+session_launch (struct fossa_options *opt, pid_t pid, Elf_Addr main_start,
+                FILE *out)
+{
+    struct session *s = session_new (opt, pid, main_start, out);
+
+    // set breakpoint @ start of main() prologue and run to it
+    pt_insert_breakpoint (s->pid, s->main_start, 1, &s->main_bp);
+    s->state = SESSION_TO_MAIN;
+    session_resume (s, PTRACE_CONT);
+
+    return session_check (s);
+}
+
+
+// --zygote: start driving a child that is stopped at main()'s entry
+// already, where tbox was found for it (in the process it was forked
+// from)
+struct session*
+session_adopt (struct fossa_options *opt, pid_t pid, Elf_Addr main_start,
+               struct toolbox *tbox, FILE *out)
+{
+    struct session *s = session_new (opt, pid, main_start, out);
+
+    s->tbox = arena_alloc (s->arena, sizeof (struct toolbox));
+    *s->tbox = *tbox;
+    s->zygote = 1;
+    session_at_main (s);
+
+    return session_check (s);
+}
+
+
+// Launch the child, whose main() is known to be at main_start, and
+// start it on its way there
+struct session*
+session_spawn (struct fossa_options *opt, char **envp, Elf_Addr main_start,
+               FILE *out)
+{
+    pid_t pid;
+
+    // the child is fenced in as asked before it is let loose
+    if (isolate_prep (opt, out) < 0) {
+        return NULL;
+    }
+
+    pid = child_fork (opt->child_argv, envp, opt);
+    if (pid < 0) {
+        return NULL;
+    }
+
+    return session_launch (opt, pid, main_start, out);
+}
+
+
+// Launch the child and start it on its way to main()
+struct session*
+session_create (struct fossa_options *opt, char **envp, FILE *out)
+{
+    Elf_Addr main_start = 0;
+    char *func = opt->roi ? opt->roi : "main";
+
+    // with --roi, the function named takes main()'s place: from here on
+    // "main()" is whichever function is being tuned
+    if (elf_get_func (opt->child_argv[0], func, &main_start, NULL) < 0) {
+        return NULL;
+    }
+    if (!main_start) {
+        fprintf (out, "fossa: cannot find %s() in `%s'\n", func, opt->child_prg);
+        return NULL;
+    }
+
+    return session_spawn (opt, envp, main_start, out);
+}
+
+
+// --roi: has a thread other than main()'s run into the function's
+// int3?  The injections can only be run in main()'s thread, so that
+// one can't be tuned: the breakpoint is taken out, and the thread
+// goes on as if it had never been there.  (A debug register
+// breakpoint is only ever set for main()'s thread.)
+static int
+session_roi_elsewhere (struct session *s, struct pt_event *ev)
+{
+    Elf_Addr addr = s->main_bp.addr;
+
+    if (!s->opt.roi || (s->state != SESSION_TO_MAIN) || !addr ||
+        (ev->tid == s->pid) || (ev->sig != SIGTRAP) ||
+        (pt_get_eip (ev->tid) != addr + 1)) {
+        return 0;
+    }
+
+    fprintf (s->out, "fossa: %s() was called in a thread other than "
+                     "main()'s, which --roi can't tune\n", s->opt.roi);
+    pt_remove_breakpoint (s->pid, &s->main_bp);
+    pt_set_eip (ev->tid, addr);
+    pt_resume (ev->tid, PTRACE_CONT, 0);
+
+    return 1;
+}
+
+
+// The child has stopped (or gone away).  Do whatever comes next.
+static void
+session_handle (struct session *s, struct pt_event *ev)
+{
+    int i, planless, tuning;
+    struct session *c;
+    pid_t pid;
+
+    // --fork: the snapshot is left be while a pass runs, unless it
+    // goes away.  --jobs passes are sessions of their own.  Anybody
+    // else is no concern of ours
+    if (ev->pid != s->pid) {
+        for (i=0; i<s->nslots; i++) {
+            c = s->slot[i];
+            if (c && (c->pid == ev->pid) && !c->gone) {
+                session_event (c, ev);
+                return;
+            }
+        }
+        if (s->snap && (ev->pid == s->snap) &&
+            (ev->type == PT_EVENT_EXIT || ev->type == PT_EVENT_KILLED)) {
+            fprintf (s->out, "fossa: lost the child's snapshot\n");
+            pt_forget (s->snap);
+            s->snap = 0;
+            session_fail (s);
+        }
+        return;
+    }
+
+    if (ev->type == PT_EVENT_EXIT || ev->type == PT_EVENT_KILLED) {
+        if (s->parent) {
+            session_slot_gone (s, ev);
+            return;
+        }
+
+        // --fork: a pass's child that crashed is scored as lost.  One
+        // that exited took the program with it, as it would have had
+        // the pass run in the child itself
+        if (s->snap && (s->pid != s->snap)) {
+            if (s->state == SESSION_FLUSH) {
+                pt_forget (s->pid);
+                session_fork_next (s);
+                return;
+            }
+            if (ev->type == PT_EVENT_KILLED) {
+                session_fork_lost (s, ev->sig);
+                return;
+            }
+            pt_kill (s->snap);
+            s->snap = 0;
+        }
+
+        if (ev->type == PT_EVENT_KILLED && s->state != SESSION_DETACHED) {
+            fprintf (s->out, "fossa: child terminated by signal %i\n", ev->sig);
+        }
+        // its exit status, unless session_fail() gave up on it first
+        if (s->state != SESSION_DETACHED || !s->status) {
+            s->status = (ev->type == PT_EVENT_EXIT) ? ev->status : 128 + ev->sig;
+        }
+
+        // --roi: a run that never got to the function tuned nothing,
+        // which is not to pass for success
+        if (s->state == SESSION_TO_MAIN && s->opt.roi) {
+            fprintf (s->out, "fossa: %s() was never reached in main()'s "
+                             "thread, nothing was tuned\n", s->opt.roi);
+            if (!s->status) {
+                s->status = 1;
+            }
+        }
+        session_slots_kill (s);
+        s->state = SESSION_DONE;
+        pt_forget (s->pid);
+        return;
+    }
+
+    // a snapshot that is waiting on its passes doesn't run, whatever
+    // comes its way
+    if (s->state == SESSION_IDLE) {
+        return;
+    }
+
+    // not ours: hand the signal over to the child and keep going.
+    // Other threads only ever get to run when main()'s thread is
+    // continued, so that is how they go back, too.
+    if (ev->type == PT_EVENT_SIGNAL) {
+        if (session_roi_elsewhere (s, ev)) {
+            return;
+        }
+        if (ev->tid == s->pid && s->stopping && ev->sig == SIGSTOP) {
+            session_fork_raced (s);
+            return;
+        }
+        if (ev->tid == s->pid && session_fork_crash (s, ev->sig)) {
+            return;
+        }
+        if (ev->tid == s->pid && s->step_req == PTRACE_SINGLESTEP) {
+            // don't step into the handler (its ret is not main()'s!)
+            // let it run and catch the child when it comes back here
+            pt_insert_breakpoint (s->pid, pt_get_eip (s->pid), 1,
+                                  &s->step_bp);
+            s->step_req = PTRACE_CONT;
+            pt_resume (s->pid, PTRACE_CONT, ev->sig);
+        } else if (ev->tid == s->pid) {
+            pt_resume (s->pid, s->step_req, ev->sig);
+        } else {
+            pt_resume (ev->tid, PTRACE_CONT, ev->sig);
+        }
+        return;
+    }
+
+    switch (s->state) {
+    case SESSION_TO_MAIN:
+        // remove the breakpoint
+        stats_phase ("toolbox");
+        pt_remove_breakpoint (s->pid, &s->main_bp);
+        session_at_main (s);
+        break;
+
+    case SESSION_CHECK_PLAN:
+        planless = session_inject_finish (s);
+
+        // adjust the operation mode based on plan status (and, with
+        // --drift, on how it has been doing)
+        if (s->drift_path) {
+            drift_load (s->drift_path, &s->drift);
+        }
+        set_mode (s, planless);
+
+        // --online: only a run that has a plan has one to try against
+        if (s->opt.online && s->opt.mode == 0) {
+            s->online = SESSION_ONLINE_PLAN;
+        }
+
+        // build the rest of the injections
+        s->inj_start       = inject_build_start    (s->arena, s->tbox->start, s->opt.mode);
+        s->inj_end         = inject_build_end      (s->arena, s->tbox->end);
+        s->inj_set_project = inject_build_prjpln   (s->arena, s->tbox->set_project, s->project);
+        s->inj_set_plan    = inject_build_prjpln   (s->arena, s->tbox->set_plan, s->plan_hash);
+        s->inj_set_tuner   = inject_build_settuner (s->arena, s->tbox->set_tuner, s->opt.tuner);
+
+        // a run with a plan makes one pass and needs no tracing after
+        // cuzmem_start(), if the child's libc will call cuzmem_end()
+        // for us.  --step wants main() traced, so it stays attached, as
+        // does --roi, whose end() comes well before the exit, and
+        // --online and --drift, which time main()
+        if (s->opt.mode == 0 && !s->opt.step && !s->opt.roi &&
+            (s->opt.reps <= 1) && !s->online && !s->opt.drift) {
+            s->tbox->atexit = child_dlsym_cached (s->pid, "__cxa_atexit",
+                                                  "libc.so", s->syms);
+            if (s->tbox->atexit) {
+                s->inj_atexit = inject_build_atexit (s->arena, s->tbox->atexit,
+                                                     s->tbox->end);
+            }
+        }
+
+        // --fork only pays off with passes to run
+        if ((s->opt.fork || (s->opt.jobs > 1)) && s->opt.mode == 1 &&
+            s->opt.tuner != 0) {
+            if (session_fork_setup (s)) {
+                fprintf (s->out, "fossa: cannot fork the child, "
+                                 "tuning iterations will share it\n");
+            } else if ((s->opt.jobs > 1) && session_jobs_setup (s)) {
+                fprintf (s->out, "fossa: libcuzmem hands out one candidate "
+                                 "at a time, tuning iterations will too\n");
+            }
+        }
+
+        // --checkpoint: the tuner has to save its state itself
+        if (s->ckpt && s->opt.mode == 1 && s->opt.tuner != 0) {
+            s->tbox->save = child_dlsym_cached (s->pid, "cuzmem_save", "libcuzmem.so", s->syms);
+            s->tbox->load = child_dlsym_cached (s->pid, "cuzmem_load", "libcuzmem.so", s->syms);
+            if (!s->tbox->save || !s->tbox->load) {
+                fprintf (s->out, "fossa: libcuzmem can't save its tuner, "
+                                 "tuning won't be checkpointed\n");
+                s->ckpt = NULL;
+            }
+        }
+
+        // --online: the run has a plan, and tries a candidate besides
+        if (s->online && session_online_setup (s)) {
+            fprintf (s->out, "fossa: libcuzmem can't try candidates out, "
+                             "running the plan\n");
+            s->online = 0;
+        }
+
+        // set the plan, the project, and the tuner
+        stats_phase ("setup");
+        session_inject (s, s->inj_set_project, SESSION_SET_PROJECT);
+        break;
+
+    case SESSION_SET_PROJECT:
+        session_inject_finish (s);
+        session_inject (s, s->inj_set_plan, SESSION_SET_PLAN);
+        break;
+
+    case SESSION_SET_PLAN:
+        session_inject_finish (s);
+        session_inject (s, s->inj_set_tuner, SESSION_SET_TUNER);
+        break;
+
+    case SESSION_SET_TUNER:
+        session_inject_finish (s);
+
+        // --online: the record of past runs says what this one is to do
+        if (s->online) {
+            s->iter = s->iter0 = checkpoint_load (s);
+            session_online (s);
+            break;
+        }
+
+        // --resume: the tuner picks up where the last run left off
+        if (s->ckpt && s->opt.resume) {
+            s->iter = s->iter0 = checkpoint_load (s);
+            if (s->iter) {
+                fprintf (s->out, "fossa: resuming tuning at iteration %03i\n",
+                         s->iter);
+            }
+        }
+        session_iterate (s);
+        break;
+
+    case SESSION_FORK:
+        // the child that fork() made stops at the same place, and is
+        // put back from the same backups
+        s->fork_ctx = s->ictx;
+        pid = session_inject_finish (s);
+        pt_trace_forks (s->snap, 0);
+
+        if ((pid <= 0) || (pt_adopt (pid) < 0)) {
+            fprintf (s->out, "fossa: cannot fork the child\n");
+            session_fail (s);
+            break;
+        }
+
+        // the pass's own children aren't followed
+        pt_trace_forks (pid, 0);
+
+        if (s->nslots) {
+            c = session_slot_new (s, pid);
+            if (!c) {
+                fprintf (s->out, "fossa: no free slot for the pass\n");
+                pt_kill (pid);
+                session_fail (s);
+                break;
+            }
+            fprintf (s->out, "fossa: Tuning Iteration: %03i\n", c->iter);
+            fprintf (s->out, "----------------------------\n");
+            session_resume (c, PTRACE_CONT);
+            s->state = SESSION_IDLE;
+            session_sched (s);
+            break;
+        }
+
+        s->pid = pid;
+        s->state = SESSION_FORKED;
+        session_resume (s, PTRACE_CONT);
+        break;
+
+    case SESSION_FORKED:
+        inject_finish (s->pid, s->main_start, s->inj_fork, &s->fork_ctx);
+        session_inject (s, (s->online == SESSION_ONLINE_TRY) ? s->inj_try
+                                                             : s->inj_start,
+                        SESSION_START);
+        break;
+
+    case SESSION_FLUSH:
+        if (s->parent) {
+            s->state = SESSION_SCORED;
+            session_sched (s->parent);
+            break;
+        }
+        pt_kill (s->pid);
+        session_fork_next (s);
+        break;
+
+    case SESSION_REAP:
+        session_inject_finish (s);
+        if (s->online) {
+            session_online_report (s);
+            break;
+        }
+        if (s->nslots) {
+            s->state = SESSION_IDLE;
+            session_sched (s);
+            break;
+        }
+        s->iter++;
+        session_iterate (s);
+        break;
+
+    case SESSION_NEXT:
+        s->next = session_inject_finish (s);
+        if (s->online) {
+            session_online_try (s, s->next);
+            break;
+        }
+        if (s->next < 0) {
+            s->starved = 1;
+            s->state = SESSION_IDLE;
+            session_sched (s);
+            break;
+        }
+        pt_trace_forks (s->pid, 1);
+        session_inject (s, s->inj_fork, SESSION_FORK);
+        break;
+
+    case SESSION_REPORT:
+        // the pass is done with, and the tuner may have more to try
+        session_inject_finish (s);
+        if (s->online) {
+            session_online_reported (s);
+            break;
+        }
+        session_checkpoint (s, s->pid, s->iter);
+        session_slot_done (s);
+        break;
+
+    case SESSION_REPEAT:
+        // --online: a new candidate will do
+        if (s->online) {
+            if (session_inject_finish (s) < 0) {
+                session_inject (s, s->inj_next, SESSION_NEXT);
+            } else {
+                session_online_try (s, s->candidate);
+            }
+            break;
+        }
+
+        // the tuner can't go back to it: what there is will have to do
+        if (session_inject_finish (s) < 0) {
+            session_report (s);
+            break;
+        }
+        s->next = s->slot[s->cur]->candidate;
+        s->again = 1;
+        session_slot_done (s);
+        break;
+
+    case SESSION_BEST:
+        session_inject_finish (s);
+        if (s->online) {
+            session_online_done (s);
+            break;
+        }
+        session_report (s);
+        break;
+
+    case SESSION_START:
+        session_inject_finish (s);
+
+        // a planned run: hand cuzmem_end() over to the child's own
+        // exit path, so there is nothing left to trace
+        if (s->inj_atexit) {
+            session_inject (s, s->inj_atexit, SESSION_AT_EXIT);
+            break;
+        }
+
+        session_run_main (s);
+        break;
+
+    case SESSION_AT_EXIT:
+        if (session_inject_finish (s) == 0) {
+            stats_phase ("detach");
+            session_detach (s);
+            break;
+        }
+
+        // couldn't register it: stay and inject cuzmem_end() as usual
+        s->inj_atexit = NULL;
+        session_run_main (s);
+        break;
+
+    case SESSION_TRACE:
+        // back from a block, call or loop
+        if (s->step_bp.addr) {
+            pt_remove_breakpoint (s->pid, &s->step_bp);
+        }
+        for (i=0; i<s->nexits; i++) {
+            pt_remove_breakpoint (s->pid, &s->exit_bp[i]);
+        }
+        s->nexits = 0;
+
+        if (session_at_site (s)) {
+            s->ret_bp = s->site_bp;
+            s->site_bp.addr = 0;
+            s->ret_site = 1;
+            session_main_done (s);
+            break;
+        }
+
+        if (session_step (s)) {
+            session_main_done (s);
+        }
+        break;
+
+    case SESSION_RUN:
+        // main() is done
+        session_main_done (s);
+        break;
+
+    case SESSION_END:
+        tuning = session_inject_finish (s);
+
+        // --jobs: that was cuzmem_score(), for the snapshot to report
+        if (s->parent) {
+            s->score = tuning;
+            session_inject (s, s->inj_flush, SESSION_FLUSH);
+            break;
+        }
+
+        // --online: as was that, for a candidate
+        if (s->online) {
+            session_online_end (s, tuning);
+            break;
+        }
+
+        // --checkpoint: this pass's child has the tuner as it is now,
+        // whether or not the pass turns out to be the last
+        if (tuning) {
+            session_checkpoint (s, s->pid, s->iter + 1);
+        }
+
+        // --tune-budget: out of time, so this pass is the last
+        if (tuning && (s->tuned || session_spent (s))) {
+            if (!s->tuned) {
+                fprintf (s->out, "fossa: tuning budget spent\n");
+            }
+            tuning = 0;
+        }
+
+        // --fork: whatever the tuner made of the pass goes back to the
+        // snapshot with it.  A last pass that was cut short didn't
+        // finish main(), so one more is run to do that
+        if (s->snap) {
+            s->lost = 0;
+            if (tuning || s->raced) {
+                if (!tuning) {
+                    s->tuned = 1;
+                }
+                session_fork_keep (s);
+                // what the pass printed is written out before it goes,
+                // unless it crashed, and its stdio may be in any state
+                if (!s->crashed && !s->raced) {
+                    session_inject (s, s->inj_flush, SESSION_FLUSH);
+                    break;
+                }
+                s->crashed = 0;
+                s->raced = 0;
+                pt_kill (s->pid);
+                session_fork_next (s);
+                break;
+            }
+            pt_kill (s->snap);
+            s->snap = 0;
+        }
+
+        if (tuning) {
+            s->iter++;
+            session_iterate (s);
+            break;
+        }
+
+        // we are done.
+        // remove the breakpoint @ the end of main()
+        if (s->opt.mode == 1 && s->opt.tuner != 0) {
+            session_tuned (s);
+        }
+
+        // the last pass crashed: it can't be let go on with main()
+        if (s->crashed) {
+            session_fail (s);
+            s->status = 128 + s->crashed;
+            break;
+        }
+
+        if (s->drift_path && (s->opt.mode == 0)) {
+            session_drift (s);
+        }
+
+        session_let_go (s);
+        break;
+
+    case SESSION_DETACHED:
+        // --zygote: still traced, but nothing of ours
+        session_resume (s, PTRACE_CONT);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+// The child has stopped (or gone away).  A ptrace call that failed on
+// it, or on a --fork or --jobs copy of it, along the way means it can't
+// be trusted to be as we left it: the session gives up on it.  Nobody
+// else's child is any the worse for it.
+void
+session_event (struct session *s, struct pt_event *ev)
+{
+    struct session *r = s->parent ? s->parent : s;
+
+    session_handle (s, ev);
+
+    if (session_finished (r)) {
+        return;
+    }
+    if ((s->pid && pt_failed (s->pid)) || (r->snap && pt_failed (r->snap))) {
+        fprintf (r->out, "fossa: lost control of `%s'\n", r->opt.child_prg);
+        session_fail (r);
+    }
+}
+
+
+// Nothing left for the tracer to do with this child
+int
+session_finished (struct session *s)
+{
+    return (s->state == SESSION_DETACHED || s->state == SESSION_DONE);
+}
+
+
+// --race, --tune-budget: when the pass p has to be done by, or 0
+static double
+session_pass_deadline (struct session *s, struct session *p)
+{
+    double d = s->budget_end, race;
+
+    if (p->stopping) {
+        return p->stop_t + SESSION_STOP_WAIT;
+    }
+    if ((p->state != SESSION_RUN) || p->tuned) {
+        return 0;
+    }
+
+    if (s->opt.race && s->best) {
+        race = p->pass_t0 + s->opt.race * s->best;
+        if (!d || (race < d)) {
+            d = race;
+        }
+    }
+
+    return d;
+}
+
+
+// --race, --tune-budget: the pass p has run out of time.  A --jobs
+// pass is simply killed, for the tuner to hear it failed.  Otherwise
+// the tuner is in the pass's child, so the child is stopped and made
+// to call cuzmem_end() (session_fork_raced()); the SIGSTOP is sent
+// again should it get lost among those that stop the child's threads
+static void
+session_race (struct session *p)
+{
+    struct session *s = p->parent;
+
+    if (!p->stopping) {
+        fprintf ((s ? s : p)->out, "fossa: iteration %03i ran out of time\n",
+                 p->iter);
+    }
+
+    if (s) {
+        pt_kill (p->pid);
+        p->gone = 1;
+        p->score = -1;
+        p->state = SESSION_SCORED;
+        session_sched (s);
+        return;
+    }
+
+    p->stopping = 1;
+    p->stop_t = session_now ();
+    pt_interrupt (p->pid);
+}
+
+
+// --race, --tune-budget: cut short the passes that have run out of
+// time.  Returns how long (ms) until the next one does, or -1 if no
+// pass is being timed
+int
+session_timeout (struct session *s)
+{
+    double d, next = 0, now = session_now ();
+    struct session *c;
+    int i;
+
+    if (s->nslots) {
+        for (i=0; i<s->nslots; i++) {
+            c = s->slot[i];
+            if (!c || !c->pid || c->gone) {
+                continue;
+            }
+            d = session_pass_deadline (s, c);
+            if (d && (d <= now)) {
+                session_race (c);
+            } else if (d && (!next || (d < next))) {
+                next = d;
+            }
+        }
+    } else if (s->snap && (s->pid != s->snap)) {
+        d = session_pass_deadline (s, s);
+        if (d && (d <= now)) {
+            session_race (s);
+            d = session_pass_deadline (s, s);
+        }
+        next = d;
+    }
+
+    if (!next) {
+        return -1;
+    }
+
+    return (int)((next - now) * 1000) + 1;
+}
+
+
+// Is pid the child, or one of its --fork/--jobs copies?
+int
+session_owns (struct session *s, pid_t pid)
+{
+    int i;
+
+    if ((pid == s->pid) || (s->snap && (pid == s->snap))) {
+        return 1;
+    }
+
+    for (i=0; i<s->nslots; i++) {
+        if (s->slot[i] && (s->slot[i]->pid == pid)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Everything but the plan hash lives in the session's arenas
+void
+session_destroy (struct session *s)
+{
+    int i;
+
+    for (i=0; i<s->nslots; i++) {
+        if (s->slot[i]) {
+            arena_destroy (s->slot[i]->scratch);
+        }
+    }
+    if (s->report) {
+        arena_destroy (s->report);
+    }
+    free (s->plan_hash);
+    arena_destroy (s->scratch);
+    arena_destroy (s->arena);
+}
@@ -0,0 +1,224 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _session_h_
+#define _session_h_
+
+#include <stdio.h>
+#include "fossa.h"
+#include "options.h"
+#include "ptrace_wrap.h"
+#include "inject.h"
+#include "child_tools.h"
+#include "samples.h"
+#include "drift.h"
+
+struct toolbox {
+    Elf_Addr start;
+    Elf_Addr end;
+    Elf_Addr set_project;
+    Elf_Addr set_plan;
+    Elf_Addr set_tuner;
+    Elf_Addr check_plan;
+    Elf_Addr atexit;        /* libc's __cxa_atexit(), for planned runs */
+    Elf_Addr fork;          /* libc's fork(), waitpid() and fflush(), */
+    Elf_Addr waitpid;       /* for --fork                             */
+    Elf_Addr fflush;
+    Elf_Addr next;          /* libcuzmem's candidate hand out, for    */
+    Elf_Addr score;         /* --jobs                                 */
+    Elf_Addr report;
+    Elf_Addr repeat;        /* and for --samples                      */
+    Elf_Addr best;
+    Elf_Addr save;          /* the tuner's own state, for --checkpoint */
+    Elf_Addr load;
+};
+
+// --samples: how a candidate has done so far
+struct cand {
+    int candidate;
+    struct samples time;    /* main()'s run time, warm-up left out    */
+    long score;             /* sum of its passes' scores              */
+    int nscore;
+    int failed;             /* a pass of it crashed or ran over       */
+};
+
+#define SESSION_MAX_LOOPS   64      /* loops --step remembers         */
+#define SESSION_MAX_EXITS   8       /* ways out of a loop (or main()) it
+                                       can breakpoint                 */
+#define SESSION_MAX_SEGS    4       /* libcuzmem data segments --fork
+                                       carries from pass to pass      */
+#define SESSION_MAX_LOST    3       /* passes in a row --fork may lose
+                                       to crashes before giving up    */
+#define SESSION_MAX_JOBS    64      /* passes --jobs runs at once     */
+#define SESSION_MAX_CANDS   256     /* candidates --samples keeps track of */
+#define SESSION_STOP_WAIT   0.1     /* seconds before a pass that ran out
+                                       of time is told to stop again  */
+#define SESSION_ONLINE_RACE 2.0     /* --online: times the plan's run time
+                                       a candidate gets, without --race */
+#define SESSION_PLAN        -1      /* --online: the plan, as a candidate */
+
+// what an --online production run is doing
+#define SESSION_ONLINE_PLAN 1       /* running the plan, timing it    */
+#define SESSION_ONLINE_TRY  2       /* trying a candidate, in a fork() */
+
+// where a traced child is in the launch -> check_plan -> set_* ->
+// start -> main() -> end flow.  Each state (other than LAUNCH and
+// DONE) is waiting on the child to trap.
+enum session_state {
+    SESSION_TO_MAIN,        /* running to the breakpoint on main()    */
+    SESSION_CHECK_PLAN,     /* cuzmem_check_plan() injection running  */
+    SESSION_SET_PROJECT,    /* cuzmem_set_project() injection running */
+    SESSION_SET_PLAN,       /* cuzmem_set_plan() injection running    */
+    SESSION_SET_TUNER,      /* cuzmem_set_tuner() injection running   */
+    SESSION_FORK,           /* fork() injection running in the snapshot */
+    SESSION_FORKED,         /* the pass's child finishing its fork()  */
+    SESSION_REAP,           /* waitpid() injection running in the snapshot */
+    SESSION_NEXT,           /* cuzmem_next() injection running in it  */
+    SESSION_REPORT,         /* cuzmem_report() injection running in it */
+    SESSION_REPEAT,         /* cuzmem_repeat() injection running in it */
+    SESSION_BEST,           /* cuzmem_best() injection running in it  */
+    SESSION_IDLE,           /* snapshot waiting on the passes (--jobs) */
+    SESSION_START,          /* cuzmem_start() injection running       */
+    SESSION_AT_EXIT,        /* __cxa_atexit(cuzmem_end) injection running */
+    SESSION_TRACE,          /* stepping main() to find its ret (--step) */
+    SESSION_RUN,            /* running main() until it returns        */
+    SESSION_END,            /* cuzmem_end() injection running         */
+    SESSION_SCORED,         /* pass over, its score not yet reported  */
+    SESSION_FLUSH,          /* fflush() injection running in a pass's child */
+    SESSION_DETACHED,       /* child let go, running on its own       */
+    SESSION_DONE            /* child is gone                          */
+};
+
+struct session {
+    pid_t pid;
+    enum session_state state;
+    struct fossa_options opt;
+    FILE *out;              /* where progress messages go             */
+    int shared;             /* one of many jobs: --daemon or --batch  */
+    int status;             /* exit status, once SESSION_DONE         */
+
+    Elf_Addr main_start;    /* of main(), or of the --roi function    */
+    struct user_regs_struct entry_regs; /* as main() was entered      */
+    struct user_fpregs_struct entry_fpregs; /* ... (--roi only)       */
+    Elf_Addr entry_sp;      /* stack pointer on entry, at the ret address */
+    Elf_Addr ret_addr;      /* where main() returns to                */
+    struct pt_breakpoint main_bp;   /* on main() prologue             */
+    struct pt_breakpoint ret_bp;    /* on ret_addr (main()'s ret with --step) */
+    struct pt_breakpoint step_bp;   /* pending step-over (addr 0 if none) */
+    struct pt_breakpoint site_bp;   /* on ret_addr while stepping (--step) */
+    int ret_site;           /* ret_bp is on ret_addr, not on the ret  */
+    Elf_Addr loops[SESSION_MAX_LOOPS];  /* loop latches seen by --step */
+    int nloops, next_loop;
+    struct pt_breakpoint exit_bp[SESSION_MAX_EXITS];  /* loop being run,
+                                                         or main()'s exits */
+    int nexits;
+    struct elf_cfg *cfg;    /* main()'s CFG, if --step could build it */
+    int step_req;           /* how the child was last resumed         */
+    int iter;
+    int rep;                /* calls made so far this pass (--reps)   */
+
+    pid_t snap;             /* --fork: the child frozen at main()'s entry,
+                               which each pass runs a fork() of       */
+    int crashed;            /* signal that ended this pass early      */
+    int lost;               /* passes in a row lost to crashes        */
+    struct lib_seg keep[SESSION_MAX_SEGS];  /* libcuzmem's globals    */
+    int nkeep;
+    struct inject_ctx fork_ctx;     /* fork() injection, in the child */
+
+    struct session *parent; /* --jobs: the snapshot's, for a pass's   */
+    struct session *slot[SESSION_MAX_JOBS]; /* the passes running     */
+    int nslots;
+    int cur;                /* slot being reported on                 */
+    int next;               /* candidate being forked for             */
+    int starved;            /* the tuner has nothing to hand out      */
+    int candidate;          /* a pass's candidate, and how it did     */
+    int score;
+    int gone;               /* a pass's child is no more              */
+    struct arena *report;   /* holds the cuzmem_report() injection    */
+
+    double pass_t0;         /* when the pass went into main()         */
+    double best;            /* --race: quickest pass so far           */
+    double budget_end;      /* --tune-budget: when tuning must stop   */
+    double stop_t;          /* when the pass was last told to stop    */
+    int stopping;           /* it is due to stop for our SIGSTOP      */
+    int raced;              /* it was cut short                       */
+    int tuned;              /* the last pass is being run: no racing  */
+    double elapsed;         /* how long the pass took                 */
+
+    struct cand *cands;     /* --samples: every candidate run so far  */
+    int ncands;
+    struct cand *best_cand; /* the one proven quickest                */
+    int again;              /* the tuner is set to run one again      */
+
+    char *ckpt;             /* --checkpoint: file tuning is saved to  */
+    int iter0;              /* --resume: iteration this run started at */
+    int online;             /* --online: SESSION_ONLINE_*, or 0       */
+
+    char *drift_path;       /* --drift: the plan's record of runs     */
+    struct drift drift;
+
+    struct sym_cache *syms; /* --batch: symbols found by other jobs   */
+    int zygote;             /* --zygote: forked off one, not launched */
+
+    char project[FILENAME_MAX];
+    char *plan_hash;
+    struct toolbox *tbox;
+    struct code_injection *inj_check_plan, *inj_start, *inj_end,
+                          *inj_set_project, *inj_set_plan, *inj_set_tuner,
+                          *inj_atexit, *inj_fork, *inj_reap, *inj_flush,
+                          *inj_next, *inj_score, *inj_try;
+    struct code_injection *inj;     /* injection in flight            */
+    struct inject_ctx ictx;
+
+    struct arena *arena;    /* holds the session and all it owns      */
+    struct arena *scratch;  /* emptied before each injection          */
+};
+
+struct toolbox*
+create_toolbox (struct arena *a, pid_t pid, struct sym_cache *syms, FILE *out);
+
+struct session*
+session_launch (struct fossa_options *opt, pid_t pid, Elf_Addr main_start,
+                FILE *out);
+
+struct session*
+session_adopt (struct fossa_options *opt, pid_t pid, Elf_Addr main_start,
+               struct toolbox *tbox, FILE *out);
+
+struct session*
+session_spawn (struct fossa_options *opt, char **envp, Elf_Addr main_start,
+               FILE *out);
+
+struct session*
+session_create (struct fossa_options *opt, char **envp, FILE *out);
+
+void
+session_event (struct session *s, struct pt_event *ev);
+
+int
+session_finished (struct session *s);
+
+int
+session_owns (struct session *s, pid_t pid);
+
+int
+session_timeout (struct session *s);
+
+void
+session_destroy (struct session *s);
+
+#endif /* #ifndef _session_h_ */
@@ -0,0 +1,1106 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A simulated tracee: a ptrace_wrap backend that doesn't talk to a real
+// child at all.  The "child" is an address space held in our own memory,
+// laid out the way child_tools expects a dynamically linked program to
+// be: an ELF header at BASE_TEXT, a GOT that leads to a link_map, and
+// libraries with hash, symbol and string tables, libcuzmem.so among
+// them.  Its main() is real x86-64 machine code, run by a tiny
+// interpreter that knows just the instructions that main() and our
+// injections are made of.  Calls into libcuzmem.so are answered here.
+//
+// Everything is deterministic, so runs can be compared instruction for
+// instruction and transfer for transfer.  x86-64 only.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <link.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+
+#include "fossa.h"
+#include "ptrace_wrap.h"
+#include "sim.h"
+
+#if _arch_x86_64_
+
+#ifndef TRAP_TRACE
+#define TRAP_TRACE 2
+#endif
+#ifndef TRAP_HWBKPT
+#define TRAP_HWBKPT 4
+#endif
+
+#define SIM_PID         ((1 << 22) + 1)     /* above any real pid_max */
+#define SIM_STACK_TOP   0x7ffff0000000UL
+#define SIM_STACK_SIZE  0x10000
+#define SIM_EXIT        0xdead0000UL        /* main()'s return address */
+#define SIM_MAX_INSNS   (1 << 24)           /* per resume             */
+#define SIM_MAX_FUNCS   32
+
+struct sim;
+
+struct sim_func {
+    const char *name;
+    Elf_Addr addr;
+    unsigned long long (*fn) (struct sim *s);
+};
+
+struct sim {
+    pid_t pid;
+    struct sim_config cfg;
+
+    unsigned char *img;     /* mapped at BASE_TEXT                    */
+    size_t img_size;
+    size_t img_used;
+    unsigned char *stack;   /* mapped just below SIM_STACK_TOP        */
+
+    struct user_regs_struct regs;
+    struct user_fpregs_struct fpregs;   /* kept, not used             */
+    unsigned long dr[8];
+    int si_code;            /* of the last SIGTRAP                    */
+    int fault_sig;
+    int has_status;
+    int status;
+    int gone;
+    int detached;
+
+    struct sim_func funcs[SIM_MAX_FUNCS];
+    int nfuncs;
+    int iters;              /* cuzmem_end() calls so far              */
+};
+
+static struct sim *sim = NULL;
+static struct sim_stats stats;
+
+
+// Where in our memory the tracee's [addr, addr+*len) lives.  *len is
+// cut down to what is mapped; NULL if addr isn't mapped at all.
+static unsigned char*
+sim_map (Elf_Addr addr, size_t *len)
+{
+    Elf_Addr stack_base = SIM_STACK_TOP - SIM_STACK_SIZE;
+
+    if ((addr >= BASE_TEXT) && (addr < BASE_TEXT + sim->img_used)) {
+        if (*len > BASE_TEXT + sim->img_used - addr) {
+            *len = BASE_TEXT + sim->img_used - addr;
+        }
+        return sim->img + (addr - BASE_TEXT);
+    }
+
+    if ((addr >= stack_base) && (addr < SIM_STACK_TOP)) {
+        if (*len > SIM_STACK_TOP - addr) {
+            *len = SIM_STACK_TOP - addr;
+        }
+        return sim->stack + (addr - stack_base);
+    }
+
+    return NULL;
+}
+
+
+// Like sim_map(), but all of it has to be there
+static unsigned char*
+sim_mem (Elf_Addr addr, size_t len)
+{
+    size_t n = len;
+    unsigned char *p = sim_map (addr, &n);
+
+    return (p && (n == len)) ? p : NULL;
+}
+
+
+static unsigned long long*
+sim_reg (int r)
+{
+    struct user_regs_struct *regs = &sim->regs;
+
+    switch (r & 7) {
+        case 0:  return &regs->rax;
+        case 1:  return &regs->rcx;
+        case 2:  return &regs->rdx;
+        case 3:  return &regs->rbx;
+        case 4:  return &regs->rsp;
+        case 5:  return &regs->rbp;
+        case 6:  return &regs->rsi;
+        default: return &regs->rdi;
+    }
+}
+
+
+
+// The libcuzmem.so the tracee is linked against
+static unsigned long long
+sim_cuzmem_nop (struct sim *s)
+{
+    return 0;
+}
+
+
+static unsigned long long
+sim_cuzmem_check_plan (struct sim *s)
+{
+    return s->cfg.planless;
+}
+
+
+// asks for another pass until tune_iters have been made
+static unsigned long long
+sim_cuzmem_end (struct sim *s)
+{
+    return (++s->iters < s->cfg.tune_iters);
+}
+
+
+struct sim_sym {
+    const char *name;
+    unsigned long long (*fn) (struct sim *s);
+};
+
+// Each name fossa looks up comes after one that starts with it, as
+// malloc() does after malloc_stats() in a real libc: a lookup that
+// took any name starting with the one asked for would get that instead
+static struct sim_sym sim_cuzmem[] = {
+    { "cuzmem_start_time",  sim_cuzmem_nop        },
+    { "cuzmem_start",       sim_cuzmem_nop        },
+    { "cuzmem_end_pass",    sim_cuzmem_nop        },
+    { "cuzmem_end",         sim_cuzmem_end        },
+    { "cuzmem_set_project", sim_cuzmem_nop        },
+    { "cuzmem_set_planned", sim_cuzmem_nop        },
+    { "cuzmem_set_plan",    sim_cuzmem_nop        },
+    { "cuzmem_set_tuner_opt", sim_cuzmem_nop      },
+    { "cuzmem_set_tuner",   sim_cuzmem_nop        },
+    { "cuzmem_check_plan_age", sim_cuzmem_nop     },
+    { "cuzmem_check_plan",  sim_cuzmem_check_plan },
+};
+
+// The libc.so.6 it is linked against, as far as fossa is concerned
+static struct sim_sym sim_libc[] = {
+    { "__cxa_atexit_impl",  sim_cuzmem_nop        },
+    { "__cxa_atexit",       sim_cuzmem_nop        },
+    { "__fork_handlers",    sim_cuzmem_nop        },
+    { "__fork",             sim_cuzmem_nop        },
+    { "__waitpid_nocancel", sim_cuzmem_nop        },
+    { "__waitpid",          sim_cuzmem_nop        },
+    { "_IO_fflush_unlocked", sim_cuzmem_nop       },
+    { "_IO_fflush",         sim_cuzmem_nop        },
+    { "malloc_stats",       sim_cuzmem_nop        },
+    { "malloc",             sim_cuzmem_nop        },
+};
+
+
+// Building the image
+
+static Elf_Addr
+sim_alloc (size_t len)
+{
+    Elf_Addr addr;
+
+    sim->img_used = (sim->img_used + 15) & ~15UL;
+    if (sim->img_used + len > sim->img_size) {
+        fprintf (stderr, "fossa: simulated tracee image too small\n");
+        exit (1);
+    }
+
+    addr = BASE_TEXT + sim->img_used;
+    sim->img_used += len;
+
+    return addr;
+}
+
+
+static Elf_Addr
+sim_str (const char *str)
+{
+    Elf_Addr addr = sim_alloc (strlen (str) + 1);
+
+    strcpy ((char *)sim_mem (addr, 1), str);
+
+    return addr;
+}
+
+
+// Lay out a library: nfill filler functions followed by the nsyms given
+// in syms (last, so finding them means going through the whole table),
+// along with its symbol, string and hash tables and dynamic section.
+// The functions are one ret each.  Returns its link_map entry.
+static Elf_Addr
+sim_add_lib (const char *name, int nfill, struct sim_sym *syms, int nsyms)
+{
+    int i, n = nfill + nsyms;
+    char buf[64];
+    const char *sym_name;
+    size_t strsz = 1;
+    Elf_Addr base, strtab, symtab, hash, dyn, lm;
+    Elf_Sym *sym;
+    Elf_Dyn *d;
+    uint32_t *h;
+    char *str;
+    struct link_map *map;
+
+    // code: 16 bytes per function
+    base = sim_alloc (n * 16);
+    memset (sim_mem (base, n * 16), 0xc3, n * 16);
+
+    for (i=0; i<n; i++) {
+        if (i < nfill) {
+            sprintf (buf, "sim_%s_fn%i", name, i);
+            strsz += strlen (buf) + 1;
+        } else {
+            strsz += strlen (syms[i - nfill].name) + 1;
+        }
+    }
+
+    strtab = sim_alloc (strsz);
+    symtab = sim_alloc ((n + 1) * sizeof (Elf_Sym));
+    str = (char *)sim_mem (strtab, strsz);
+    sym = (Elf_Sym *)sim_mem (symtab, (n + 1) * sizeof (Elf_Sym));
+
+    memset (sym, 0, sizeof (Elf_Sym));
+    str[0] = '\0';
+    strsz = 1;
+    for (i=0; i<n; i++) {
+        if (i < nfill) {
+            sprintf (buf, "sim_%s_fn%i", name, i);
+            sym_name = buf;
+        } else {
+            sym_name = syms[i - nfill].name;
+            sim->funcs[sim->nfuncs].name = sym_name;
+            sim->funcs[sim->nfuncs].addr = base + i * 16;
+            sim->funcs[sim->nfuncs].fn = syms[i - nfill].fn;
+            sim->nfuncs++;
+        }
+        strcpy (str + strsz, sym_name);
+
+        memset (&sym[i+1], 0, sizeof (Elf_Sym));
+        sym[i+1].st_name = strsz;
+        sym[i+1].st_info = ELF64_ST_INFO (STB_GLOBAL, STT_FUNC);
+        sym[i+1].st_value = i * 16;
+        sym[i+1].st_size = 16;
+
+        strsz += strlen (sym_name) + 1;
+    }
+
+    // DT_HASH with a single bucket: we only need nchain from it
+    hash = sim_alloc ((3 + n + 1) * sizeof (uint32_t));
+    h = (uint32_t *)sim_mem (hash, (3 + n + 1) * sizeof (uint32_t));
+    memset (h, 0, (3 + n + 1) * sizeof (uint32_t));
+    h[0] = 1;
+    h[1] = n + 1;
+
+    dyn = sim_alloc (6 * sizeof (Elf_Dyn));
+    d = (Elf_Dyn *)sim_mem (dyn, 6 * sizeof (Elf_Dyn));
+    d[0].d_tag = DT_HASH;       d[0].d_un.d_ptr = hash;
+    d[1].d_tag = DT_STRTAB;     d[1].d_un.d_ptr = strtab;
+    d[2].d_tag = DT_STRSZ;      d[2].d_un.d_val = strsz;
+    d[3].d_tag = DT_SYMTAB;     d[3].d_un.d_ptr = symtab;
+    d[4].d_tag = DT_SYMENT;     d[4].d_un.d_val = sizeof (Elf_Sym);
+    d[5].d_tag = DT_NULL;       d[5].d_un.d_val = 0;
+
+    lm = sim_alloc (sizeof (struct link_map));
+    map = (struct link_map *)sim_mem (lm, sizeof (struct link_map));
+    memset (map, 0, sizeof (struct link_map));
+    map->l_addr = base;
+    map->l_ld = (Elf_Dyn *)dyn;
+    map->l_name = (char *)sim_str (name);
+
+    return lm;
+}
+
+
+// main(): the usual frame setup, then ncalls calls to a small function,
+// alternating between call rel32 and call *%rax, each preceded by a
+// couple of instructions that have to be single-stepped.
+static Elf_Addr
+sim_add_main (int ncalls)
+{
+    int i;
+    int32_t rel;
+    Elf_Addr work, main_start, pc;
+    unsigned char *p;
+
+    work = sim_alloc (6);
+    memcpy (sim_mem (work, 6),
+        "\xb8\x01\x00\x00\x00"          /* mov    $0x1, %eax        */
+        "\xc3",                         /* ret                      */
+        6
+    );
+
+    main_start = sim_alloc (4 + ncalls * 18 + 4);
+    p = sim_mem (main_start, 4 + ncalls * 18 + 4);
+    pc = main_start;
+
+    memcpy (p, "\x55\x48\x89\xe5", 4);  /* push %rbp; mov %rsp, %rbp */
+    p += 4;
+    pc += 4;
+
+    for (i=0; i<ncalls; i++) {
+        *p = 0xb8;                      /* mov    $i, %eax          */
+        memcpy (p + 1, &i, 4);
+        *(p + 5) = 0x90;                /* nop                      */
+        p += 6;
+        pc += 6;
+
+        if (i & 1) {
+            memcpy (p, "\x48\xb8", 2);  /* mov    $work, %rax       */
+            memcpy (p + 2, &work, 8);
+            memcpy (p + 10, "\xff\xd0", 2); /* call *%rax           */
+            p += 12;
+            pc += 12;
+        } else {
+            rel = work - (pc + 5);
+            *p = 0xe8;                  /* call   work              */
+            memcpy (p + 1, &rel, 4);
+            p += 5;
+            pc += 5;
+        }
+    }
+
+    memcpy (p, "\x31\xc0\x5d\xc3", 4);  /* xor %eax,%eax; pop %rbp; ret */
+
+    return main_start;
+}
+
+
+// ELF header, program headers and dynamic section of the program, and
+// its GOT, whose address is returned.  GOT[1] is left for the link_map.
+static Elf_Addr
+sim_add_header (void)
+{
+    Elf_Addr ehdr_addr, phdr_addr, dyn_addr, got_addr;
+    Elf_Ehdr *ehdr;
+    Elf_Phdr *phdr;
+    Elf_Dyn *dyn;
+    Elf_Addr *got;
+
+    ehdr_addr = sim_alloc (sizeof (Elf_Ehdr));
+    phdr_addr = sim_alloc (2 * sizeof (Elf_Phdr));
+    dyn_addr = sim_alloc (2 * sizeof (Elf_Dyn));
+    got_addr = sim_alloc (3 * sizeof (Elf_Addr));
+
+    ehdr = (Elf_Ehdr *)sim_mem (ehdr_addr, sizeof (Elf_Ehdr));
+    memset (ehdr, 0, sizeof (Elf_Ehdr));
+    memcpy (ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_type = ET_EXEC;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_phoff = phdr_addr - BASE_TEXT;
+    ehdr->e_phentsize = sizeof (Elf_Phdr);
+    ehdr->e_phnum = 2;
+
+    phdr = (Elf_Phdr *)sim_mem (phdr_addr, 2 * sizeof (Elf_Phdr));
+    memset (phdr, 0, 2 * sizeof (Elf_Phdr));
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_vaddr = BASE_TEXT;
+    phdr[1].p_type = PT_DYNAMIC;
+    phdr[1].p_vaddr = dyn_addr;
+
+    dyn = (Elf_Dyn *)sim_mem (dyn_addr, 2 * sizeof (Elf_Dyn));
+    dyn[0].d_tag = DT_PLTGOT;   dyn[0].d_un.d_ptr = got_addr;
+    dyn[1].d_tag = DT_NULL;     dyn[1].d_un.d_val = 0;
+
+    got = (Elf_Addr *)sim_mem (got_addr, 3 * sizeof (Elf_Addr));
+    got[0] = dyn_addr;
+    got[1] = 0;
+    got[2] = 0;
+
+    return got_addr;
+}
+
+
+static void
+sim_link (Elf_Addr lm, Elf_Addr prev)
+{
+    struct link_map *map, *prev_map;
+
+    map = (struct link_map *)sim_mem (lm, sizeof (struct link_map));
+    prev_map = (struct link_map *)sim_mem (prev, sizeof (struct link_map));
+
+    map->l_prev = (struct link_map *)prev;
+    prev_map->l_next = (struct link_map *)lm;
+}
+
+
+// Create the simulated tracee, stopped with its pc on main() as if it
+// had just been launched and run up to there.  There is only ever one;
+// creating another replaces it.
+pid_t
+sim_create (struct sim_config *cfg, Elf_Addr *main_start)
+{
+    int i;
+    char name[32];
+    Elf_Addr got, lm, prev;
+    size_t per_lib;
+    struct link_map *map;
+    unsigned long exit_addr = SIM_EXIT;
+
+    sim_destroy ();
+
+    sim = malloc (sizeof (struct sim));
+    memset (sim, 0, sizeof (struct sim));
+    sim->pid = SIM_PID;
+    sim->cfg = *cfg;
+
+    per_lib = 1024 + (cfg->nsyms + 16) * (16 + sizeof (Elf_Sym) + 32 + 4);
+    sim->img_size = 4096 + (cfg->nlibs + 2) * per_lib + cfg->ncalls * 18;
+    sim->img = malloc (sim->img_size);
+    sim->stack = malloc (SIM_STACK_SIZE);
+    memset (sim->img, 0, sim->img_size);
+    memset (sim->stack, 0, SIM_STACK_SIZE);
+
+    // the ELF header has to come first, at BASE_TEXT
+    got = sim_add_header ();
+
+    // the program itself heads the link_map, then the libraries.
+    // libcuzmem.so goes last: the worst case for the link_map walk
+    prev = sim_alloc (sizeof (struct link_map));
+    map = (struct link_map *)sim_mem (prev, sizeof (struct link_map));
+    memset (map, 0, sizeof (struct link_map));
+    map->l_name = (char *)sim_str ("");
+    ((Elf_Addr *)sim_mem (got, 3 * sizeof (Elf_Addr)))[1] = prev;
+
+    for (i=0; i<cfg->nlibs; i++) {
+        sprintf (name, "libsim%i.so", i);
+        lm = sim_add_lib (name, cfg->nsyms, NULL, 0);
+        sim_link (lm, prev);
+        prev = lm;
+    }
+    lm = sim_add_lib ("libc.so.6", 0, sim_libc,
+                      sizeof (sim_libc) / sizeof (sim_libc[0]));
+    sim_link (lm, prev);
+    prev = lm;
+    lm = sim_add_lib ("libcuzmem.so", cfg->nsyms, sim_cuzmem,
+                      sizeof (sim_cuzmem) / sizeof (sim_cuzmem[0]));
+    sim_link (lm, prev);
+
+    *main_start = sim_add_main (cfg->ncalls);
+
+    // main (1, ...) was called from somewhere that doesn't exist
+    sim->regs.rip = *main_start;
+    sim->regs.rsp = SIM_STACK_TOP - 64 - sizeof (exit_addr);
+    sim->regs.rdi = 1;
+    sim->regs.eflags = 0x202;
+    memcpy (sim_mem (sim->regs.rsp, sizeof (exit_addr)), &exit_addr,
+            sizeof (exit_addr));
+
+    return sim->pid;
+}
+
+
+void
+sim_destroy (void)
+{
+    if (!sim) {
+        return;
+    }
+
+    free (sim->img);
+    free (sim->stack);
+    free (sim);
+    sim = NULL;
+}
+
+
+// Where the simulated libraries have the function called name; 0 if
+// they haven't
+Elf_Addr
+sim_func_addr (const char *name)
+{
+    int i;
+
+    for (i=0; i<sim->nfuncs; i++) {
+        if (!strcmp (sim->funcs[i].name, name)) {
+            return sim->funcs[i].addr;
+        }
+    }
+
+    return 0;
+}
+
+
+void
+sim_get_stats (struct sim_stats *out)
+{
+    *out = stats;
+}
+
+
+void
+sim_reset_stats (void)
+{
+    memset (&stats, 0, sizeof (stats));
+}
+
+
+
+// Running the tracee
+
+static void
+sim_stop (int sig, int code)
+{
+    sim->status = (sig << 8) | 0x7f;
+    sim->si_code = code;
+    sim->has_status = 1;
+}
+
+
+static void
+sim_exit (int code)
+{
+    sim->status = (code & 0xff) << 8;
+    sim->has_status = 1;
+    sim->gone = 1;
+}
+
+
+static void
+sim_kill (int sig)
+{
+    sim->status = sig;
+    sim->has_status = 1;
+    sim->gone = 1;
+}
+
+
+// A signal sent along with a resume.  Nothing in the tracee handles
+// any, so it either dies of it or ignores it.
+static void
+sim_signal (int sig)
+{
+    switch (sig) {
+        case 0:
+        case SIGCHLD:
+        case SIGCONT:
+        case SIGURG:
+        case SIGWINCH:
+            break;
+        default:
+            sim_kill (sig);
+            break;
+    }
+}
+
+
+static int
+sim_push (unsigned long long val)
+{
+    unsigned char *p = sim_mem (sim->regs.rsp - 8, 8);
+
+    if (!p) {
+        sim_kill (SIGSEGV);
+        return 1;
+    }
+
+    sim->regs.rsp -= 8;
+    memcpy (p, &val, 8);
+
+    return 0;
+}
+
+
+static int
+sim_pop (unsigned long long *val)
+{
+    unsigned char *p = sim_mem (sim->regs.rsp, 8);
+
+    if (!p) {
+        sim_kill (SIGSEGV);
+        return 1;
+    }
+
+    memcpy (val, p, 8);
+    sim->regs.rsp += 8;
+
+    return 0;
+}
+
+
+// Is the tracee sitting on an enabled execute breakpoint?
+static int
+sim_hw_hit (void)
+{
+    int i;
+    unsigned long dr7 = sim->dr[7];
+
+    for (i=0; i<4; i++) {
+        if ((dr7 & (1UL << (i*2))) &&
+            !((dr7 >> (16 + i*4)) & 0xf) &&
+            (sim->dr[i] == sim->regs.rip)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Execute one instruction.  Returns 1 if the tracee stopped or went
+// away doing it (sim->status says which), 0 otherwise.
+//
+// Only what main() and the injections are made of is understood:
+// anything else raises SIGILL.  Code is fetched 16 bytes at a time and
+// whatever lies past the end of a mapping reads as zeros.
+static int
+sim_step (void)
+{
+    int i;
+    int8_t d8;
+    int32_t rel;
+    uint32_t imm32;
+    unsigned long long imm64, next, *reg;
+    unsigned char op[16];
+    size_t n = sizeof (op);
+    unsigned char *p;
+    struct user_regs_struct *r = &sim->regs;
+
+    // back in whatever called main()
+    if (r->rip == SIM_EXIT) {
+        sim_exit ((int)r->rax);
+        return 1;
+    }
+
+    // libcuzmem.so: its functions are a lone ret that we fill %rax in for
+    for (i=0; i<sim->nfuncs; i++) {
+        if (sim->funcs[i].addr == r->rip) {
+            r->rax = sim->funcs[i].fn (sim);
+            break;
+        }
+    }
+
+    p = sim_map (r->rip, &n);
+    if (!p) {
+        sim_kill (SIGSEGV);
+        return 1;
+    }
+    memset (op, 0, sizeof (op));
+    memcpy (op, p, n);
+    stats.insns++;
+
+    switch (op[0]) {
+    case 0x90:                          /* nop                      */
+        r->rip += 1;
+        return 0;
+
+    case 0xcc:                          /* int3                     */
+        r->rip += 1;
+        sim_stop (SIGTRAP, SI_KERNEL);
+        return 1;
+
+    case 0xc3:                          /* ret                      */
+        if (sim_pop (&r->rip)) {
+            return 1;
+        }
+        return 0;
+
+    case 0xc9:                          /* leave                    */
+        r->rsp = r->rbp;
+        if (sim_pop (&r->rbp)) {
+            return 1;
+        }
+        r->rip += 1;
+        return 0;
+
+    case 0xe8:                          /* call   rel32             */
+        memcpy (&rel, op + 1, 4);
+        next = r->rip + 5;
+        if (sim_push (next)) {
+            return 1;
+        }
+        r->rip = next + rel;
+        return 0;
+
+    case 0xff:                          /* call   *%reg             */
+        if ((op[1] & 0xf8) != 0xd0) {
+            break;
+        }
+        next = r->rip + 2;
+        imm64 = *sim_reg (op[1]);
+        if (sim_push (next)) {
+            return 1;
+        }
+        r->rip = imm64;
+        return 0;
+
+    case 0x31:                          /* xor    %reg, %reg (32)   */
+        if ((op[1] & 0xc0) != 0xc0) {
+            break;
+        }
+        reg = sim_reg (op[1]);
+        *reg = (uint32_t)(*reg ^ *sim_reg (op[1] >> 3));
+        r->rip += 2;
+        return 0;
+
+    case 0x48:                          /* REX.W                    */
+        if (op[1] == 0x89 && (op[2] & 0xc0) == 0xc0) {
+            /* mov    %reg, %reg        */
+            *sim_reg (op[2]) = *sim_reg (op[2] >> 3);
+            r->rip += 3;
+            return 0;
+        }
+        if (op[1] == 0x8d && (op[2] & 0xc0) == 0x40 && (op[2] & 7) != 4) {
+            /* lea    disp8(%reg), %reg */
+            d8 = (int8_t)op[3];
+            *sim_reg (op[2] >> 3) = *sim_reg (op[2]) + d8;
+            r->rip += 4;
+            return 0;
+        }
+        if (op[1] == 0x83 && (op[2] & 0xc0) == 0xc0) {
+            /* add/and/sub $imm8, %reg  */
+            d8 = (int8_t)op[3];
+            reg = sim_reg (op[2]);
+            switch ((op[2] >> 3) & 7) {
+                case 0: *reg += d8; break;
+                case 4: *reg &= d8; break;
+                case 5: *reg -= d8; break;
+                default:
+                    sim_kill (SIGILL);
+                    return 1;
+            }
+            r->rip += 4;
+            return 0;
+        }
+        if ((op[1] & 0xf8) == 0xb8) {
+            /* mov    $imm64, %reg      */
+            memcpy (&imm64, op + 2, 8);
+            *sim_reg (op[1]) = imm64;
+            r->rip += 10;
+            return 0;
+        }
+        break;
+
+    default:
+        if ((op[0] & 0xf8) == 0x50) {   /* push   %reg              */
+            if (sim_push (*sim_reg (op[0]))) {
+                return 1;
+            }
+            r->rip += 1;
+            return 0;
+        }
+        if ((op[0] & 0xf8) == 0x58) {   /* pop    %reg              */
+            if (sim_pop (sim_reg (op[0]))) {
+                return 1;
+            }
+            r->rip += 1;
+            return 0;
+        }
+        if ((op[0] & 0xf8) == 0xb8) {   /* mov    $imm32, %reg      */
+            memcpy (&imm32, op + 1, 4);
+            *sim_reg (op[0]) = imm32;
+            r->rip += 5;
+            return 0;
+        }
+        break;
+    }
+
+    sim_kill (SIGILL);
+    return 1;
+}
+
+
+// Run until something stops the tracee
+static void
+sim_run (void)
+{
+    int i;
+
+    for (i=0; i<SIM_MAX_INSNS; i++) {
+        if (!sim->detached && sim_hw_hit ()) {
+            sim_stop (SIGTRAP, TRAP_HWBKPT);
+            return;
+        }
+        if (sim_step ()) {
+            return;
+        }
+    }
+
+    // it's looping.  Real children get killed for this, too
+    sim_kill (SIGXCPU);
+}
+
+
+
+// The backend
+
+static int
+sim_check (pid_t pid)
+{
+    if (!sim || sim->gone || (pid != sim->pid)) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static ssize_t
+sim_read (pid_t pid, Elf_Addr addr, void *buf, size_t len)
+{
+    unsigned char *p;
+
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    p = sim_map (addr, &len);
+    if (!p) {
+        errno = EFAULT;
+        return -1;
+    }
+    memcpy (buf, p, len);
+
+    stats.reads++;
+    stats.read_bytes += len;
+
+    return len;
+}
+
+
+static ssize_t
+sim_write (pid_t pid, Elf_Addr addr, void *buf, size_t len)
+{
+    unsigned char *p;
+
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    p = sim_map (addr, &len);
+    if (!p) {
+        errno = EFAULT;
+        return -1;
+    }
+    memcpy (p, buf, len);
+
+    stats.writes++;
+    stats.write_bytes += len;
+
+    return len;
+}
+
+
+static int
+sim_get_regs (pid_t pid, struct user_regs_struct *regs)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    *regs = sim->regs;
+    stats.get_regs++;
+
+    return 0;
+}
+
+
+static int
+sim_set_regs (pid_t pid, struct user_regs_struct *regs)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    sim->regs = *regs;
+    stats.set_regs++;
+
+    return 0;
+}
+
+
+static int
+sim_get_fpregs (pid_t pid, struct user_fpregs_struct *fpregs)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    *fpregs = sim->fpregs;
+    stats.get_regs++;
+
+    return 0;
+}
+
+
+static int
+sim_set_fpregs (pid_t pid, struct user_fpregs_struct *fpregs)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    sim->fpregs = *fpregs;
+    stats.set_regs++;
+
+    return 0;
+}
+
+
+static int
+sim_set_dr (pid_t pid, int i, unsigned long val)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+    if ((i < 0) || (i > 7)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sim->dr[i] = val;
+    stats.set_dr++;
+
+    return 0;
+}
+
+
+// The tracee runs to its next stop right here, so by the time this
+// returns there is a status waiting for sim_wait()
+static int
+sim_resume (pid_t pid, int request, int sig)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    stats.resumes++;
+
+    sim_signal (sig);
+    if (sim->gone) {
+        return 0;
+    }
+
+    switch (request) {
+    case PTRACE_CONT:
+        sim_run ();
+        break;
+
+    case PTRACE_SINGLESTEP:
+        if (sim_hw_hit ()) {
+            sim_stop (SIGTRAP, TRAP_HWBKPT);
+        } else if (!sim_step ()) {
+            sim_stop (SIGTRAP, TRAP_TRACE);
+        }
+        break;
+
+    case PTRACE_DETACH:
+        // on its own now: the next trap kills it
+        sim->detached = 1;
+        memset (sim->dr, 0, sizeof (sim->dr));
+        sim_run ();
+        if (!sim->gone) {
+            sim_kill (SIGTRAP);
+        }
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+sim_stop_thread (pid_t tgid, pid_t pid)
+{
+    // the tracee never runs outside of sim_resume()
+    return sim_check (pid);
+}
+
+
+static pid_t
+sim_wait (int *status, int options)
+{
+    if (sim && sim->has_status) {
+        *status = sim->status;
+        sim->has_status = 0;
+        return sim->pid;
+    }
+
+    if (sim && !sim->gone && (options & WNOHANG)) {
+        return 0;
+    }
+
+    errno = ECHILD;
+    return -1;
+}
+
+
+static int
+sim_siginfo (pid_t pid, siginfo_t *si)
+{
+    if (sim_check (pid) < 0) {
+        return -1;
+    }
+
+    memset (si, 0, sizeof (siginfo_t));
+    si->si_signo = SIGTRAP;
+    si->si_code = sim->si_code;
+
+    return 0;
+}
+
+
+static int
+sim_eventmsg (pid_t pid, unsigned long *msg)
+{
+    // it never clones, so there are no events
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int
+sim_setoptions (pid_t pid, int options)
+{
+    return sim_check (pid);
+}
+
+
+static pid_t
+sim_tgid (pid_t pid)
+{
+    return pid;
+}
+
+
+struct pt_backend sim_backend = {
+    "sim",
+    sim_read,
+    sim_write,
+    sim_get_regs,
+    sim_set_regs,
+    sim_get_fpregs,
+    sim_set_fpregs,
+    sim_set_dr,
+    sim_resume,
+    sim_stop_thread,
+    sim_wait,
+    sim_siginfo,
+    sim_eventmsg,
+    sim_setoptions,
+    sim_tgid
+};
+
+#endif /* #if _arch_x86_64_ */
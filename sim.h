@@ -0,0 +1,66 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _sim_h_
+#define _sim_h_
+
+#include "fossa.h"
+#include "ptrace_wrap.h"
+
+// What a simulated tracee looks like.  Its link_map holds nlibs filler
+// libraries of nsyms symbols each, followed by libc.so.6 and
+// libcuzmem.so; its main() makes ncalls calls.  cuzmem_end() asks for
+// tune_iters passes.
+struct sim_config {
+    int nlibs;
+    int nsyms;
+    int ncalls;
+    int tune_iters;
+    int planless;
+};
+
+// Everything the simulated tracee was asked to do
+struct sim_stats {
+    unsigned long reads;
+    unsigned long read_bytes;
+    unsigned long writes;
+    unsigned long write_bytes;
+    unsigned long get_regs;
+    unsigned long set_regs;
+    unsigned long set_dr;
+    unsigned long resumes;
+    unsigned long insns;        /* instructions executed by the tracee */
+};
+
+extern struct pt_backend sim_backend;
+
+pid_t
+sim_create (struct sim_config *cfg, Elf_Addr *main_start);
+
+void
+sim_destroy (void);
+
+Elf_Addr
+sim_func_addr (const char *name);
+
+void
+sim_get_stats (struct sim_stats *stats);
+
+void
+sim_reset_stats (void);
+
+#endif /* #ifndef _sim_h_ */
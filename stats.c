@@ -0,0 +1,478 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fossa --stats: account for everything the tracer asks of the tracee.
+//
+// Once enabled, every call ptrace_wrap makes into its backend goes
+// through the wrappers below, which count it and time it.  Calls are
+// charged to the current phase, which the session moves along as the
+// child makes its way through startup, the toolbox lookup, check_plan,
+// each tuning iteration and the final detach.  Each primitive carries
+// a latency histogram with power of two buckets: bucket i counts the
+// calls that took [2^i, 2^(i+1)) ns.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ptrace.h>
+
+#include "fossa.h"
+#include "ptrace_wrap.h"
+#include "stats.h"
+
+#define STATS_BUCKETS   32
+
+enum stats_op {
+    STATS_PEEK,
+    STATS_POKE,
+    STATS_GETREGS,
+    STATS_SETREGS,
+    STATS_CONT,
+    STATS_SINGLESTEP,
+    STATS_DETACH,
+    STATS_SETDR,
+    STATS_WAIT,
+    STATS_OTHER,            /* stop, siginfo, eventmsg, setoptions */
+    STATS_NOPS
+};
+
+static const char *stats_op_name[STATS_NOPS] = {
+    "peek", "poke", "getregs", "setregs", "cont",
+    "singlestep", "detach", "setdr", "wait", "other"
+};
+
+struct stats_prim {
+    unsigned long count;
+    unsigned long bytes;
+    unsigned long long ns;
+    unsigned long long max_ns;
+    unsigned long hist[STATS_BUCKETS];
+};
+
+struct stats_phase {
+    char name[32];
+    struct stats_prim op[STATS_NOPS];
+};
+
+static struct pt_backend *inner = NULL;
+static struct stats_phase *phases = NULL;
+static int num_phases = 0;
+
+
+static unsigned long long
+stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+stats_account (enum stats_op op, unsigned long long t0, ssize_t bytes)
+{
+    int b;
+    unsigned long long ns = stats_now () - t0;
+    struct stats_prim *p = &phases[num_phases-1].op[op];
+
+    for (b=0; (b < STATS_BUCKETS-1) && (ns >> (b+1)); b++);
+
+    p->count++;
+    p->ns += ns;
+    p->hist[b]++;
+    if (bytes > 0) {
+        p->bytes += bytes;
+    }
+    if (ns > p->max_ns) {
+        p->max_ns = ns;
+    }
+}
+
+
+
+// The backend wrappers
+
+static ssize_t
+stats_read (pid_t pid, Elf_Addr addr, void *buf, size_t len)
+{
+    unsigned long long t0 = stats_now ();
+    ssize_t ret = inner->read (pid, addr, buf, len);
+
+    stats_account (STATS_PEEK, t0, ret);
+
+    return ret;
+}
+
+
+static ssize_t
+stats_write (pid_t pid, Elf_Addr addr, void *buf, size_t len)
+{
+    unsigned long long t0 = stats_now ();
+    ssize_t ret = inner->write (pid, addr, buf, len);
+
+    stats_account (STATS_POKE, t0, ret);
+
+    return ret;
+}
+
+
+static int
+stats_get_regs (pid_t pid, struct user_regs_struct *regs)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->get_regs (pid, regs);
+
+    stats_account (STATS_GETREGS, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_set_regs (pid_t pid, struct user_regs_struct *regs)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->set_regs (pid, regs);
+
+    stats_account (STATS_SETREGS, t0, 0);
+
+    return ret;
+}
+
+
+// the x87/SSE registers count as register transfers, too
+static int
+stats_get_fpregs (pid_t pid, struct user_fpregs_struct *fpregs)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->get_fpregs (pid, fpregs);
+
+    stats_account (STATS_GETREGS, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_set_fpregs (pid_t pid, struct user_fpregs_struct *fpregs)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->set_fpregs (pid, fpregs);
+
+    stats_account (STATS_SETREGS, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_set_dr (pid_t pid, int i, unsigned long val)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->set_dr (pid, i, val);
+
+    stats_account (STATS_SETDR, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_resume (pid_t pid, int request, int sig)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->resume (pid, request, sig);
+
+    switch (request) {
+        case PTRACE_CONT:
+            stats_account (STATS_CONT, t0, 0);
+            break;
+        case PTRACE_SINGLESTEP:
+            stats_account (STATS_SINGLESTEP, t0, 0);
+            break;
+        default:
+            stats_account (STATS_DETACH, t0, 0);
+            break;
+    }
+
+    return ret;
+}
+
+
+static int
+stats_stop (pid_t tgid, pid_t pid)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->stop (tgid, pid);
+
+    stats_account (STATS_OTHER, t0, 0);
+
+    return ret;
+}
+
+
+// this one includes however long the child ran for
+static pid_t
+stats_wait (int *status, int options)
+{
+    unsigned long long t0 = stats_now ();
+    pid_t ret = inner->wait (status, options);
+
+    stats_account (STATS_WAIT, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_siginfo (pid_t pid, siginfo_t *si)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->siginfo (pid, si);
+
+    stats_account (STATS_OTHER, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_eventmsg (pid_t pid, unsigned long *msg)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->eventmsg (pid, msg);
+
+    stats_account (STATS_OTHER, t0, 0);
+
+    return ret;
+}
+
+
+static int
+stats_setoptions (pid_t pid, int options)
+{
+    unsigned long long t0 = stats_now ();
+    int ret = inner->setoptions (pid, options);
+
+    stats_account (STATS_OTHER, t0, 0);
+
+    return ret;
+}
+
+
+// not a ptrace request: passed straight through
+static pid_t
+stats_tgid (pid_t pid)
+{
+    return inner->tgid (pid);
+}
+
+
+static struct pt_backend stats_backend = {
+    NULL,
+    stats_read,
+    stats_write,
+    stats_get_regs,
+    stats_set_regs,
+    stats_get_fpregs,
+    stats_set_fpregs,
+    stats_set_dr,
+    stats_resume,
+    stats_stop,
+    stats_wait,
+    stats_siginfo,
+    stats_eventmsg,
+    stats_setoptions,
+    stats_tgid
+};
+
+
+
+// Start counting.  Goes on top of whatever backend is in use, so
+// that has to be set up first.
+void
+stats_enable (void)
+{
+    if (inner) {
+        return;
+    }
+
+    inner = pt_get_backend ();
+    stats_backend.name = inner->name;
+    pt_set_backend (&stats_backend);
+
+    stats_phase ("startup");
+}
+
+
+// Charge everything from here on to a new phase
+void
+stats_phase (const char *fmt, ...)
+{
+    va_list ap;
+    struct stats_phase *p;
+
+    if (!inner) {
+        return;
+    }
+
+    phases = realloc (phases, (num_phases+1) * sizeof (struct stats_phase));
+    p = &phases[num_phases++];
+    memset (p, 0, sizeof (struct stats_phase));
+
+    va_start (ap, fmt);
+    vsnprintf (p->name, sizeof (p->name), fmt, ap);
+    va_end (ap);
+}
+
+
+// Upper bound (in ns) of the bucket holding the q-th fraction of
+// calls, or the slowest call if that was quicker
+static unsigned long long
+stats_quantile (struct stats_prim *p, double q)
+{
+    int b;
+    unsigned long n = 0;
+    unsigned long long bound;
+
+    for (b=0; b<STATS_BUCKETS; b++) {
+        n += p->hist[b];
+        if (n >= q * p->count) {
+            break;
+        }
+    }
+
+    bound = (b < STATS_BUCKETS-1) ? (2ULL << b) : p->max_ns;
+
+    return (bound < p->max_ns) ? bound : p->max_ns;
+}
+
+
+static void
+stats_print_prim (FILE *fp, const char *phase, const char *op,
+                  struct stats_prim *p)
+{
+    fprintf (fp, "%-16s %-10s %8lu %10lu %12.1f %10.1f %10.1f %10.1f\n",
+             phase, op, p->count, p->bytes, p->ns / 1e3,
+             stats_quantile (p, 0.5) / 1e3, stats_quantile (p, 0.99) / 1e3,
+             p->max_ns / 1e3);
+}
+
+
+// The report: every primitive used in every phase, then totals
+void
+stats_print (FILE *fp)
+{
+    int i, j, b;
+    struct stats_prim total[STATS_NOPS];
+    struct stats_prim *p;
+
+    if (!inner) {
+        return;
+    }
+
+    memset (total, 0, sizeof (total));
+
+    fprintf (fp, "\nfossa: tracer statistics (%s)\n", inner->name);
+    fprintf (fp, "%-16s %-10s %8s %10s %12s %10s %10s %10s\n",
+             "phase", "op", "count", "bytes", "total us",
+             "p50 us", "p99 us", "max us");
+
+    for (i=0; i<num_phases; i++) {
+        for (j=0; j<STATS_NOPS; j++) {
+            p = &phases[i].op[j];
+            if (!p->count) {
+                continue;
+            }
+            stats_print_prim (fp, phases[i].name, stats_op_name[j], p);
+
+            total[j].count += p->count;
+            total[j].bytes += p->bytes;
+            total[j].ns += p->ns;
+            if (p->max_ns > total[j].max_ns) {
+                total[j].max_ns = p->max_ns;
+            }
+            for (b=0; b<STATS_BUCKETS; b++) {
+                total[j].hist[b] += p->hist[b];
+            }
+        }
+    }
+
+    for (j=0; j<STATS_NOPS; j++) {
+        if (total[j].count) {
+            stats_print_prim (fp, "total", stats_op_name[j], &total[j]);
+        }
+    }
+}
+
+
+// The same, as JSON, so that tracer overhead can be followed across releases
+int
+stats_write_json (const char *path)
+{
+    int i, j, b;
+    const char *sep;
+    struct stats_prim *p;
+    FILE *fp;
+
+    if (!inner) {
+        return 0;
+    }
+
+    fp = fopen (path, "w");
+    if (!fp) {
+        fprintf (stderr, "fossa: cannot write statistics to `%s'\n", path);
+        return -1;
+    }
+
+    fprintf (fp, "{\n  \"version\": \"%s\",\n  \"backend\": \"%s\",\n"
+                 "  \"hist_bucket\": \"log2 ns\",\n  \"phases\": [",
+             FOSSA_VERSION, inner->name);
+
+    for (i=0; i<num_phases; i++) {
+        fprintf (fp, "%s\n    {\n      \"name\": \"%s\",\n      \"ops\": {",
+                 i ? "," : "", phases[i].name);
+
+        sep = "";
+        for (j=0; j<STATS_NOPS; j++) {
+            p = &phases[i].op[j];
+            if (!p->count) {
+                continue;
+            }
+            fprintf (fp, "%s\n        \"%s\": {\"count\": %lu, \"bytes\": %lu, "
+                         "\"total_ns\": %llu, \"max_ns\": %llu, \"hist\": [",
+                     sep, stats_op_name[j], p->count, p->bytes,
+                     p->ns, p->max_ns);
+            for (b=0; b<STATS_BUCKETS; b++) {
+                fprintf (fp, "%s%lu", b ? ", " : "", p->hist[b]);
+            }
+            fprintf (fp, "]}");
+            sep = ",";
+        }
+
+        fprintf (fp, "\n      }\n    }");
+    }
+
+    fprintf (fp, "\n  ]\n}\n");
+    fclose (fp);
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _stats_h_
+#define _stats_h_
+
+#include <stdio.h>
+
+void
+stats_enable (void);
+
+void
+stats_phase (const char *fmt, ...);
+
+void
+stats_print (FILE *fp);
+
+int
+stats_write_json (const char *path);
+
+#endif /* #ifndef _stats_h_ */
@@ -0,0 +1,403 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A table driven x86 / x86-64 instruction length decoder.
+//
+// All we want to know about an instruction is how long it is and what
+// it does to the flow of control, so that code can be walked a basic
+// block at a time.  Each opcode map gets a table of what follows the
+// opcode (a ModRM byte and an immediate, of what size); prefixes, the
+// ModRM addressing forms and VEX/EVEX are handled around that.
+
+#include <string.h>
+#include <stdint.h>
+
+#include "fossa.h"
+#include "x86_decode.h"
+
+#define M       0x01        /* ModRM (and SIB, displacement) follows  */
+#define I8      0x02        /* 8-bit immediate                        */
+#define IZ      0x04        /* 16/32-bit immediate, by operand size   */
+#define IV      0x08        /* 16/32/64-bit immediate (mov $imm, %r)  */
+#define I16     0x10        /* 16-bit immediate                       */
+#define MO      0x20        /* memory offset, by address size         */
+#define PFX     0x40        /* legacy prefix                          */
+#define BAD     0x80        /* invalid / undefined                    */
+
+#define X86_MAX_LEN     15
+
+// one byte opcodes
+static const unsigned char x86_op1[256] = {
+    /* 00 */ M, M, M, M, I8, IZ, 0, 0,        M, M, M, M, I8, IZ, 0, 0,
+    /* 10 */ M, M, M, M, I8, IZ, 0, 0,        M, M, M, M, I8, IZ, 0, 0,
+    /* 20 */ M, M, M, M, I8, IZ, PFX, 0,      M, M, M, M, I8, IZ, PFX, 0,
+    /* 30 */ M, M, M, M, I8, IZ, PFX, 0,      M, M, M, M, I8, IZ, PFX, 0,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0,          0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0,          0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ 0, 0, M, M, PFX, PFX, PFX, PFX,  IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+    /* 70 */ I8, I8, I8, I8, I8, I8, I8, I8,  I8, I8, I8, I8, I8, I8, I8, I8,
+    /* 80 */ M|I8, M|IZ, M|I8, M|I8, M, M, M, M,  M, M, M, M, M, M, M, M,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0,          0, 0, I16|IZ, 0, 0, 0, 0, 0,
+    /* a0 */ MO, MO, MO, MO, 0, 0, 0, 0,      I8, IZ, 0, 0, 0, 0, 0, 0,
+    /* b0 */ I8, I8, I8, I8, I8, I8, I8, I8,  IV, IV, IV, IV, IV, IV, IV, IV,
+    /* c0 */ M|I8, M|I8, I16, 0, M, M, M|I8, M|IZ,  I16|I8, 0, I16, 0, 0, I8, 0, 0,
+    /* d0 */ M, M, M, M, I8, I8, 0, 0,        M, M, M, M, M, M, M, M,
+    /* e0 */ I8, I8, I8, I8, I8, I8, I8, I8,  IZ, IZ, I16|IZ, I8, 0, 0, 0, 0,
+    /* f0 */ PFX, 0, PFX, PFX, 0, 0, M, M,    0, 0, 0, 0, 0, 0, M, M
+};
+
+// two byte opcodes (0f xx).  0f 38 and 0f 3a lead to the three byte
+// maps, where everything has a ModRM byte (and 0f 3a an imm8 as well)
+static const unsigned char x86_op2[256] = {
+    /* 00 */ M, M, M, M, BAD, 0, 0, 0,        0, 0, BAD, 0, BAD, M, 0, M|I8,
+    /* 10 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* 20 */ M, M, M, M, BAD, BAD, BAD, BAD,  M, M, M, M, M, M, M, M,
+    /* 30 */ 0, 0, 0, 0, 0, 0, BAD, 0,        M, BAD, M|I8, BAD, BAD, BAD, BAD, BAD,
+    /* 40 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* 50 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* 60 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* 70 */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0,  M, M, BAD, BAD, M, M, M, M,
+    /* 80 */ IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,  IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+    /* 90 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* a0 */ 0, 0, 0, M, M|I8, M, BAD, BAD,   0, 0, 0, M, M|I8, M, M, M,
+    /* b0 */ M, M, M, M, M, M, M, M,          M, M, M|I8, M, M, M, M, M,
+    /* c0 */ M, M, M|I8, M, M|I8, M|I8, M|I8, M,  0, 0, 0, 0, 0, 0, 0, 0,
+    /* d0 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* e0 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M,
+    /* f0 */ M, M, M, M, M, M, M, M,          M, M, M, M, M, M, M, M
+};
+
+// one byte opcodes that are gone in 64-bit mode
+static int
+x86_invalid64 (unsigned char op)
+{
+    switch (op) {
+        case 0x06: case 0x07: case 0x0e: case 0x16: case 0x17:
+        case 0x1e: case 0x1f: case 0x27: case 0x2f: case 0x37:
+        case 0x3f: case 0x60: case 0x61: case 0x82: case 0x9a:
+        case 0xce: case 0xd4: case 0xd5: case 0xd6: case 0xea:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+
+// Length of the ModRM byte and what follows it (SIB, displacement).
+// *disp_at is set to the offset of a %rip relative (in 32-bit code,
+// absolute) displacement from the ModRM byte, or left alone if there
+// isn't one.
+static int
+x86_modrm_len (const unsigned char *p, size_t avail, int bits,
+               int addr16, int *disp_at)
+{
+    unsigned char mod, rm;
+    int n = 1;
+
+    if (avail < 1) {
+        return -1;
+    }
+
+    mod = p[0] >> 6;
+    rm = p[0] & 7;
+
+    if (mod == 3) {
+        return 1;
+    }
+
+    // 16-bit addressing: no SIB, disp16 in place of disp32
+    if (addr16) {
+        if ((mod == 0 && rm == 6) || (mod == 2)) {
+            return 3;
+        }
+        return (mod == 1) ? 2 : 1;
+    }
+
+    if (rm == 4) {
+        if (avail < 2) {
+            return -1;
+        }
+        n++;
+        if ((mod == 0) && ((p[1] & 7) == 5)) {
+            return n + 4;
+        }
+    }
+
+    if (mod == 0 && rm == 5) {
+        *disp_at = 1;
+        return n + 4;
+    }
+
+    if (mod == 1) {
+        return n + 1;
+    }
+    if (mod == 2) {
+        return n + 4;
+    }
+
+    return n;
+}
+
+
+static int64_t
+x86_imm (const unsigned char *p, int size)
+{
+    switch (size) {
+        case 1:  return (int8_t)p[0];
+        case 2:  return (int16_t)(p[0] | (p[1] << 8));
+        default: return (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) |
+                                  ((uint32_t)p[3] << 24));
+    }
+}
+
+
+// Decode the instruction at code (which lives at addr in the tracee).
+// bits is 32 or 64.  Returns the instruction's length, or 0 if it's
+// not valid or runs past len.
+int
+x86_decode (const unsigned char *code, size_t len, Elf_Addr addr,
+            int bits, struct x86_insn *insn)
+{
+    const unsigned char *p = code;
+    const unsigned char *end;
+    unsigned char op, flags, reg;
+    int opsize16 = 0, addr16 = 0, addr_pfx = 0, rex_w = 0, vex = 0;
+    int map = 1;            /* 1: one byte, 2: 0f, 3: 0f 38, 4: 0f 3a */
+    int n, imm = 0, rel = 0, disp_at = -1;
+    const unsigned char *modrm = NULL;
+
+    memset (insn, 0, sizeof (struct x86_insn));
+    if (len > X86_MAX_LEN) {
+        len = X86_MAX_LEN;
+    }
+    end = code + len;
+
+    // legacy prefixes, then REX (which has to come last)
+    for (;;) {
+        if (p >= end) {
+            return 0;
+        }
+        op = *p;
+        if (x86_op1[op] & PFX) {
+            if (op == 0x66) {
+                opsize16 = 1;
+            } else if (op == 0x67) {
+                addr_pfx = 1;
+            }
+            rex_w = 0;
+            p++;
+        } else if ((bits == 64) && ((op & 0xf0) == 0x40)) {
+            rex_w = op & 0x08;
+            p++;
+        } else {
+            break;
+        }
+    }
+    // in 64-bit mode 0x67 selects 32-bit addressing, which is encoded
+    // the same way as 64-bit addressing
+    addr16 = (bits == 32) && addr_pfx;
+
+    op = *p++;
+
+    // VEX (c4, c5) and EVEX (62).  In 32-bit mode these are
+    // les, lds and bound unless the next byte would be a register ModRM
+    if (((op == 0xc4) || (op == 0xc5) || (op == 0x62)) &&
+        (p < end) && ((bits == 64) || ((*p & 0xc0) == 0xc0)))
+    {
+        vex = 1;
+        if (op == 0xc5) {
+            p += 1;
+            map = 2;
+        } else if (op == 0xc4) {
+            if (p + 2 > end) {
+                return 0;
+            }
+            map = (p[0] & 0x1f) + 1;
+            rex_w = p[1] & 0x80;
+            p += 2;
+        } else {
+            if (p + 3 > end) {
+                return 0;
+            }
+            map = (p[0] & 0x07) + 1;
+            p += 3;
+        }
+        if (p >= end) {
+            return 0;
+        }
+        op = *p++;
+
+        switch (map) {
+            case 2:  flags = x86_op2[op] | M; break;
+            case 3:  flags = M; break;
+            case 4:  flags = M | I8; break;
+            default: flags = M; break;
+        }
+        // vzeroupper and vzeroall have no ModRM
+        if (map == 2 && op == 0x77) {
+            flags = 0;
+        }
+    } else if (op == 0x0f) {
+        if (p >= end) {
+            return 0;
+        }
+        op = *p++;
+        map = 2;
+        flags = x86_op2[op];
+        if (op == 0x38 || op == 0x3a) {
+            map = (op == 0x38) ? 3 : 4;
+            if (p >= end) {
+                return 0;
+            }
+            op = *p++;
+            flags = (map == 3) ? M : (M | I8);
+        }
+    } else {
+        if ((bits == 64) && x86_invalid64 (op)) {
+            return 0;
+        }
+        flags = x86_op1[op];
+    }
+
+    if (flags & BAD) {
+        return 0;
+    }
+
+    // ModRM
+    if (flags & M) {
+        modrm = p;
+        n = x86_modrm_len (p, end - p, bits, addr16, &disp_at);
+        if (n < 0) {
+            return 0;
+        }
+        p += n;
+    }
+
+    // immediates
+    if (flags & I16) {
+        imm += 2;
+    }
+    if (flags & I8) {
+        imm += 1;
+    }
+    if (flags & IZ) {
+        imm += opsize16 ? 2 : 4;
+    }
+    if (flags & IV) {
+        imm += rex_w ? 8 : (opsize16 ? 2 : 4);
+    }
+    if (flags & MO) {
+        if (bits == 64) {
+            imm += addr_pfx ? 4 : 8;
+        } else {
+            imm += addr16 ? 2 : 4;
+        }
+    }
+    // test $imm, r/m hides in group 3
+    if (map == 1 && (op == 0xf6 || op == 0xf7)) {
+        if (((modrm[0] >> 3) & 7) < 2) {
+            imm += (op == 0xf6) ? 1 : (opsize16 ? 2 : 4);
+        }
+    }
+
+    // relative branches.  In 64-bit mode these are rel32 regardless
+    if ((map == 1 && (op == 0xe8 || op == 0xe9)) ||
+        (map == 2 && (op & 0xf0) == 0x80))
+    {
+        if (bits == 64) {
+            imm = 4;
+        }
+        rel = imm;
+    } else if ((map == 1) &&
+               (((op & 0xf0) == 0x70) || (op >= 0xe0 && op <= 0xe3) ||
+                (op == 0xeb)))
+    {
+        rel = 1;
+    }
+
+    if (p + imm > end) {
+        return 0;
+    }
+    p += imm;
+
+    insn->length = p - code;
+
+    // where the flow of control goes
+    insn->flow = X86_NEXT;
+    if (rel) {
+        insn->target = addr + insn->length + x86_imm (p - rel, rel);
+        if (bits == 32) {
+            insn->target &= opsize16 ? 0xffff : 0xffffffff;
+        }
+    }
+
+    if (map == 1) {
+        switch (op) {
+            case 0xe8:
+                insn->flow = X86_CALL;
+                break;
+            case 0xe9: case 0xeb:
+                insn->flow = X86_JMP;
+                break;
+            case 0xe0: case 0xe1: case 0xe2: case 0xe3:
+                insn->flow = X86_JCC;
+                break;
+            case 0xc2: case 0xc3: case 0xca: case 0xcb: case 0xcf:
+                insn->flow = X86_RET;
+                break;
+            case 0x9a:
+                insn->flow = X86_CALL_IND;
+                break;
+            case 0xea:
+                insn->flow = X86_JMP_IND;
+                break;
+            case 0xcc: case 0xf4:
+                insn->flow = X86_TRAP;
+                break;
+            case 0xff:
+                reg = (modrm[0] >> 3) & 7;
+                if (reg == 2 || reg == 3) {
+                    insn->flow = X86_CALL_IND;
+                } else if (reg == 4 || reg == 5) {
+                    insn->flow = X86_JMP_IND;
+                }
+                break;
+            default:
+                if ((op & 0xf0) == 0x70) {
+                    insn->flow = X86_JCC;
+                }
+                break;
+        }
+    } else if (map == 2 && !vex) {
+        if ((op & 0xf0) == 0x80) {
+            insn->flow = X86_JCC;
+        } else if (op == 0x0b || op == 0xb9 || op == 0xff) {
+            insn->flow = X86_TRAP;
+        }
+    }
+
+    // a %rip relative operand is relative to the end of the instruction
+    if (disp_at >= 0) {
+        insn->has_mem = 1;
+        insn->mem = (Elf_Addr)x86_imm (modrm + disp_at, 4);
+        if (bits == 64) {
+            insn->mem += addr + insn->length;
+        }
+    }
+
+    return insn->length;
+}
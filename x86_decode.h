@@ -0,0 +1,48 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _x86_decode_h_
+#define _x86_decode_h_
+
+#include <stddef.h>
+#include "fossa.h"
+
+// What an instruction does to the flow of control
+enum x86_flow {
+    X86_NEXT,               /* falls through to the next instruction  */
+    X86_CALL,               /* call rel                               */
+    X86_CALL_IND,           /* call *r/m, lcall                       */
+    X86_RET,                /* ret, ret imm16, lret, iret             */
+    X86_JMP,                /* jmp rel                                */
+    X86_JMP_IND,            /* jmp *r/m, ljmp                         */
+    X86_JCC,                /* jcc, loop, jcxz: rel, or falls through */
+    X86_TRAP,               /* int3, int n, ud2, hlt: doesn't go on   */
+};
+
+struct x86_insn {
+    unsigned int length;
+    enum x86_flow flow;
+    Elf_Addr target;        /* X86_CALL, X86_JMP, X86_JCC             */
+    int has_mem;            /* has a %rip relative (32-bit: absolute) */
+    Elf_Addr mem;           /* memory operand, at this address        */
+};
+
+int
+x86_decode (const unsigned char *code, size_t len, Elf_Addr addr,
+            int bits, struct x86_insn *insn);
+
+#endif /* #ifndef _x86_decode_h_ */
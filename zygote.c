@@ -0,0 +1,312 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fossa --batch --zygote: the jobs that run the same program start out
+// as fork()s of one child of it, launched once and kept stopped at
+// main()'s entry.  The exec, the dynamic linking, the constructors and
+// the search for libcuzmem's symbols have all been done by then, so a
+// job costs a fork() to launch.
+//
+// A job's argv is written to a block of the zygote's own (malloc()ed
+// in it) just before the fork(); the job's child gets its copy, and
+// main() is called with it.  Anything set up before main() is shared,
+// though: the environment, the working directory, the stdio, and what
+// the constructors did (__libc_argv and /proc/self/cmdline, too, are
+// the zygote's).
+//
+// The zygote is driven a step at a time, waiting on it in place: it
+// only ever runs an injection, for a moment.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ptrace.h>
+
+#include "fossa.h"
+#include "options.h"
+#include "arena.h"
+#include "ptrace_wrap.h"
+#include "inject.h"
+#include "child_tools.h"
+#include "isolate.h"
+#include "session.h"
+#include "zygote.h"
+
+#define ZYGOTE_ARGV_MIN     4096    /* bytes set aside for a job's argv */
+
+
+// Let the child run until it traps.  Signals that come its way are
+// handed to it.  Returns 0, or -1 if it went away (or was killed, as a
+// ptrace call on it failed).
+static int
+zygote_run (pid_t pid)
+{
+    struct pt_event ev;
+
+    if (pt_resume (pid, PTRACE_CONT, 0) < 0) {
+        pt_kill (pid);
+        return -1;
+    }
+
+    while (1) {
+        if (pt_wait (pid, &ev) < 0) {
+            return -1;
+        }
+
+        switch (ev.type) {
+        case PT_EVENT_STOP:
+            return 0;
+        case PT_EVENT_SIGNAL:
+            pt_resume (ev.tid, PTRACE_CONT, ev.sig);
+            break;
+        case PT_EVENT_EXIT:
+        case PT_EVENT_KILLED:
+            pt_forget (pid);
+            return -1;
+        }
+    }
+}
+
+
+// Have the zygote call a function, and get back what it returned.  The
+// pointer-sized return value is read from the register it is in, not
+// through inject_finish().  With ctx, the injection's backups are kept
+// there as well, for a child it fork()ed to be put back from.  Returns
+// 0, or -1 if the zygote is gone.
+static int
+zygote_inject (struct zygote *z, struct code_injection *inj,
+               struct inject_ctx *ctx, Elf_Addr *ret)
+{
+    struct user_regs_struct regs;
+
+    arena_reset (z->scratch);
+    inject_begin (z->pid, z->at, inj, &z->ictx);
+    if (zygote_run (z->pid) < 0) {
+        z->pid = 0;
+        return -1;
+    }
+
+    pt_get_regs (z->pid, &regs);
+#if _arch_i386_
+    *ret = regs.eax;
+#elif _arch_x86_64_
+    *ret = regs.rax;
+#endif
+
+    if (ctx) {
+        *ctx = z->ictx;
+    }
+    inject_finish (z->pid, z->at, inj, &z->ictx);
+
+    return 0;
+}
+
+
+// Launch opt's program and run it to main() (at main_start), to be
+// the zygote of the jobs that run it.  NULL if it can't be.
+struct zygote*
+zygote_create (struct fossa_options *opt, char **envp, Elf_Addr main_start,
+               struct sym_cache *syms, FILE *out)
+{
+    struct arena *arena;
+    struct zygote *z;
+    struct pt_breakpoint bp;
+    Elf_Addr fork, waitpid;
+    pid_t pid;
+
+    if (isolate_prep (opt, out) < 0) {
+        return NULL;
+    }
+
+    pid = child_fork (opt->child_argv, envp, opt);
+    if (pid < 0) {
+        return NULL;
+    }
+    pt_insert_breakpoint (pid, main_start, 1, &bp);
+    if (zygote_run (pid) < 0) {
+        fprintf (out, "fossa: `%s' exited before main()\n", opt->child_prg);
+        return NULL;
+    }
+    pt_remove_breakpoint (pid, &bp);
+
+    arena = arena_create (1024);
+    z = arena_alloc (arena, sizeof (struct zygote));
+    memset (z, 0, sizeof (struct zygote));
+    z->arena = arena;
+    z->scratch = arena_create (256);
+    z->ictx.arena = z->scratch;
+    z->pid = pid;
+    z->opt = *opt;
+    z->main_start = main_start;
+    z->at = inject_site (pid, main_start);
+
+    z->tbox = create_toolbox (z->arena, pid, syms, out);
+    fork    = child_dlsym_cached (pid, "__fork"   , "libc.so", syms);
+    waitpid = child_dlsym_cached (pid, "__waitpid", "libc.so", syms);
+    z->malloc = child_dlsym_cached (pid, "malloc"   , "libc.so", syms);
+
+    if (!z->tbox || !fork || !waitpid || !z->malloc || pt_failed (pid)) {
+        fprintf (out, "fossa: cannot fork `%s', its jobs will be "
+                      "launched one by one\n", opt->child_prg);
+        zygote_destroy (z);
+        return NULL;
+    }
+
+    z->inj_fork = inject_build_fork (z->arena, fork);
+    z->inj_reap = inject_build_waitpid (z->arena, waitpid);
+
+    return z;
+}
+
+
+static int
+zygote_same (char *a, char *b)
+{
+    return (!a && !b) || (a && b && !strcmp (a, b));
+}
+
+
+// Can the zygote stand in for a launch of opt's program?  The child's
+// surroundings are set before it is exec()ed, so they must match too.
+int
+zygote_fits (struct zygote *z, struct fossa_options *opt)
+{
+    return z->pid &&
+           !strcmp (z->opt.child_argv[0], opt->child_argv[0]) &&
+           zygote_same (z->opt.cpus, opt->cpus) &&
+           (z->opt.numa_node == opt->numa_node) &&
+           zygote_same (z->opt.cgroup, opt->cgroup) &&
+           zygote_same (z->opt.cpu_max, opt->cpu_max) &&
+           zygote_same (z->opt.mem_max, opt->mem_max) &&
+           (z->opt.oom_score == opt->oom_score) &&
+           (!(z->opt.ckpt || z->opt.resume || z->opt.online) ==
+            !(opt->ckpt || opt->resume || opt->online));
+}
+
+
+// Fork a child off the zygote, stopped at main()'s entry, to be called
+// with argv.  Returns its pid, or -1 if the zygote can't make one.
+pid_t
+zygote_fork (struct zygote *z, char **argv, FILE *out)
+{
+    struct code_injection *inj;
+    struct inject_ctx ctx;
+    struct user_regs_struct regs;
+    Elf_Addr ret, *ptrs;
+    size_t len, off;
+    char *buf;
+    int argc;
+    pid_t pid;
+
+    // the jobs it forked before that are gone are its to collect
+    do {
+        if (zygote_inject (z, z->inj_reap, NULL, &ret) < 0) {
+            goto gone;
+        }
+    } while ((int)ret > 0);
+
+    // lay the argv out as the child will see it, in the zygote's block
+    len = 0;
+    for (argc=0; argv[argc]; argc++) {
+        len += strlen (argv[argc]) + 1;
+    }
+    off = (argc + 1) * sizeof (Elf_Addr);
+    len += off;
+
+    if (len > z->argv_len) {
+        z->argv_len = (len > ZYGOTE_ARGV_MIN) ? len : ZYGOTE_ARGV_MIN;
+        inj = inject_build_malloc (z->arena, z->malloc, z->argv_len);
+        if (zygote_inject (z, inj, NULL, &z->argv) < 0) {
+            goto gone;
+        }
+        if (!z->argv) {
+            z->argv_len = 0;
+            fprintf (out, "fossa: the zygote has no room for the arguments\n");
+            return -1;
+        }
+    }
+
+    buf = malloc (len);
+    ptrs = (Elf_Addr *)buf;
+    for (argc=0; argv[argc]; argc++) {
+        ptrs[argc] = z->argv + off;
+        strcpy (buf + off, argv[argc]);
+        off += strlen (argv[argc]) + 1;
+    }
+    ptrs[argc] = 0;
+    ret = pt_write (z->pid, z->argv, buf, len);
+    free (buf);
+    if (ret != len) {
+        fprintf (out, "fossa: cannot write the arguments to the zygote\n");
+        return -1;
+    }
+
+    // the child that fork() made stops at the same place, and is put
+    // back from the same backups
+    pt_trace_forks (z->pid, 1);
+    if (zygote_inject (z, z->inj_fork, &ctx, &ret) < 0) {
+        goto gone;
+    }
+    pt_trace_forks (z->pid, 0);
+
+    pid = (pid_t)ret;
+    if ((pid <= 0) || (pt_adopt (pid) < 0)) {
+        fprintf (out, "fossa: cannot fork the zygote\n");
+        return -1;
+    }
+    pt_trace_forks (pid, 0);
+
+    if (zygote_run (pid) < 0) {
+        fprintf (out, "fossa: the zygote's fork() went away\n");
+        return -1;
+    }
+    inject_finish (pid, z->at, z->inj_fork, &ctx);
+
+    // main (argc, argv, envp)
+    pt_get_regs (pid, &regs);
+#if _arch_i386_
+    pt_poke (pid, regs.esp + 4, &argc, sizeof (int));
+    pt_poke (pid, regs.esp + 8, &z->argv, sizeof (Elf_Addr));
+#elif _arch_x86_64_
+    regs.rdi = argc;
+    regs.rsi = z->argv;
+    pt_set_regs (pid, &regs);
+#endif
+
+    if (pt_failed (pid)) {
+        fprintf (out, "fossa: cannot set up the zygote's fork()\n");
+        pt_kill (pid);
+        return -1;
+    }
+
+    return pid;
+
+gone:
+    fprintf (out, "fossa: lost the zygote of `%s'\n", z->opt.child_prg);
+    return -1;
+}
+
+
+void
+zygote_destroy (struct zygote *z)
+{
+    if (z->pid) {
+        pt_kill (z->pid);
+    }
+    arena_destroy (z->scratch);
+    arena_destroy (z->arena);
+}
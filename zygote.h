@@ -0,0 +1,62 @@
+/*  This file is part of fossa
+    Copyright (C) 2011  James A. Shackleford
+
+    fossa is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _zygote_h_
+#define _zygote_h_
+
+#include <stdio.h>
+#include <sys/user.h>
+#include "fossa.h"
+#include "options.h"
+#include "arena.h"
+#include "inject.h"
+#include "child_tools.h"
+#include "ptrace_wrap.h"
+#include "session.h"
+
+// --zygote: a child launched once and kept stopped at main()'s entry,
+// with its libraries loaded and libcuzmem found.  The jobs that run
+// its program are fork()s of it, given their own argv.
+struct zygote {
+    pid_t pid;
+    struct fossa_options opt;   /* it was launched with (argv aside)  */
+    Elf_Addr main_start;
+    Elf_Addr at;                /* where the injections go            */
+    struct toolbox *tbox;
+    struct code_injection *inj_fork, *inj_reap;
+    Elf_Addr malloc;
+    Elf_Addr argv;              /* its block the jobs' argv go in     */
+    size_t argv_len;
+    struct inject_ctx ictx;
+    struct arena *arena;
+    struct arena *scratch;
+};
+
+struct zygote*
+zygote_create (struct fossa_options *opt, char **envp, Elf_Addr main_start,
+               struct sym_cache *syms, FILE *out);
+
+int
+zygote_fits (struct zygote *z, struct fossa_options *opt);
+
+pid_t
+zygote_fork (struct zygote *z, char **argv, FILE *out);
+
+void
+zygote_destroy (struct zygote *z);
+
+#endif /* #ifndef _zygote_h_ */